@@ -0,0 +1,123 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "access_manifest.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+typedef std::unique_lock<std::mutex> scoped_lock;
+
+access_manifest::access_manifest(size_t capacity) : capacity_(capacity) {}
+
+void access_manifest::record(const std::string& path) {
+    if (path.find('\n') != std::string::npos) {
+        /* It cannot be written as a line. */
+        return;
+    }
+
+    scoped_lock l(mx_);
+    auto it = counts_.find(path);
+    if (it != counts_.end()) {
+        it->second++;
+    } else if (counts_.size() < capacity_) {
+        counts_.insert(std::make_pair(path, 1));
+    }
+}
+
+bool access_manifest::merge(const std::string& text) {
+    std::vector<count> parsed;
+    size_t offset = 0;
+    while (offset < text.size()) {
+        size_t end = text.find('\n', offset);
+        if (end == std::string::npos) {
+            return false;
+        }
+
+        const char *line = text.c_str() + offset;
+        char *space;
+        errno = 0;
+        const unsigned long long n = strtoull(line, &space, 10);
+        if (space == line || *space != ' ' || errno != 0 ||
+                space[1] != '/') {
+            return false;
+        }
+
+        const size_t path_offset = size_t(space + 1 - text.c_str());
+        parsed.push_back(count(text.substr(path_offset, end - path_offset),
+            uint64_t(n)));
+        offset = end + 1;
+    }
+
+    scoped_lock l(mx_);
+    for (const auto& c : parsed) {
+        const uint64_t n = c.second / 2;
+        if (n == 0) {
+            continue;
+        }
+
+        auto it = counts_.find(c.first);
+        if (it != counts_.end()) {
+            it->second += n;
+        } else if (counts_.size() < capacity_) {
+            counts_.insert(std::make_pair(c.first, n));
+        }
+    }
+    return true;
+}
+
+std::vector<access_manifest::count> access_manifest::sorted(size_t n) const {
+    std::vector<count> counts;
+    {
+        scoped_lock l(mx_);
+        counts.assign(counts_.begin(), counts_.end());
+    }
+
+    /* Ties are broken by path, so the order is stable across mounts. */
+    const auto hotter = [](const count& a, const count& b) {
+        return a.second > b.second ||
+            (a.second == b.second && a.first < b.first);
+    };
+    if (n < counts.size()) {
+        std::partial_sort(counts.begin(), counts.begin() + ptrdiff_t(n),
+            counts.end(), hotter);
+        counts.resize(n);
+    } else {
+        std::sort(counts.begin(), counts.end(), hotter);
+    }
+    return counts;
+}
+
+std::vector<std::string> access_manifest::hottest(size_t n) const {
+    std::vector<std::string> paths;
+    for (const auto& c : sorted(n)) {
+        paths.push_back(c.first);
+    }
+    return paths;
+}
+
+std::string access_manifest::serialize(size_t n) const {
+    std::string text;
+    for (const auto& c : sorted(n)) {
+        text += std::to_string(c.second);
+        text += ' ';
+        text += c.first;
+        text += '\n';
+    }
+    return text;
+}
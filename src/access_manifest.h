@@ -0,0 +1,67 @@
+#ifndef __ASYMMETRICFS__ACCESS_MANIFEST_H__
+#define __ASYMMETRICFS__ACCESS_MANIFEST_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * access_manifest counts how often each file is opened, so the files opened
+ * most can be decrypted ahead of time after the next mount.  In text form,
+ * each line holds a file's count and path, separated by a space.
+ */
+class access_manifest {
+public:
+    /* Counts are kept for up to capacity files; others are not counted. */
+    explicit access_manifest(size_t capacity);
+
+    void record(const std::string& path);
+
+    /**
+     * Adds the counts of a manifest in text form, halved so that files no
+     * longer opened eventually drop out.  Returns false if text is
+     * malformed, in which case nothing is added.
+     */
+    bool merge(const std::string& text);
+
+    /**
+     * Returns the paths of the n files opened most, most first, and the text
+     * form of their counts.
+     */
+    std::vector<std::string> hottest(size_t n) const;
+    std::string serialize(size_t n) const;
+private:
+    typedef std::pair<std::string, uint64_t> count;
+    std::vector<count> sorted(size_t n) const;
+
+    mutable std::mutex mx_;
+    const size_t capacity_;
+    std::unordered_map<std::string, uint64_t> counts_;
+
+    access_manifest(const access_manifest &) = delete;
+    const access_manifest & operator=(const access_manifest &) = delete;
+};
+
+#endif // __ASYMMETRICFS__ACCESS_MANIFEST_H__
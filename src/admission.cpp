@@ -0,0 +1,163 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "admission.h"
+#include <algorithm>
+#include <cassert>
+
+typedef std::unique_lock<std::mutex> scoped_lock;
+
+struct admission::waiter {
+    uid_t user;
+    priority p;
+    bool admitted;
+};
+
+admission::statistics::statistics() : running(0), queued(0), max_queued(0),
+    admitted(0), waited(0), background_admitted(0), background_waited(0),
+    background_queued(0), total_wait(0), max_wait(0) {}
+
+admission::admission(unsigned limit, unsigned per_user) : limit_(limit),
+    per_user_(per_user) {}
+
+admission::~admission() {
+    assert(stats_.running == 0);
+    assert(queue_.empty());
+}
+
+void admission::set_limits(unsigned limit, unsigned per_user) {
+    scoped_lock l(mx_);
+    limit_ = limit;
+    per_user_ = per_user;
+
+    /* Raising the limits may admit waiting jobs. */
+    dispatch();
+    cv_.notify_all();
+}
+
+admission::slot::slot(admission& a, uid_t user, priority p) :
+        admission_(a), user_(user) {
+    admission_.acquire(user_, p);
+}
+
+admission::slot::~slot() {
+    admission_.release(user_);
+}
+
+admission::statistics admission::stats() const {
+    scoped_lock l(mx_);
+    return stats_;
+}
+
+bool admission::eligible(uid_t user) const {
+    if (limit_ != 0 && stats_.running >= limit_) {
+        return false;
+    } else if (per_user_ == 0) {
+        return true;
+    }
+
+    auto it = running_by_user_.find(user);
+    return it == running_by_user_.end() || it->second < per_user_;
+}
+
+void admission::admit(uid_t user, priority p) {
+    stats_.running++;
+    stats_.admitted++;
+    if (p == priority::background) {
+        stats_.background_admitted++;
+    }
+    running_by_user_[user]++;
+}
+
+void admission::dispatch() {
+    dispatch(priority::foreground);
+    dispatch(priority::background);
+
+    stats_.queued = queue_.size();
+    stats_.background_queued = size_t(std::count_if(queue_.begin(),
+        queue_.end(), [](const waiter *w) {
+            return w->p == priority::background;
+        }));
+}
+
+void admission::dispatch(priority p) {
+    for (auto it = queue_.begin(); it != queue_.end(); ) {
+        if (limit_ != 0 && stats_.running >= limit_) {
+            break;
+        }
+
+        waiter *w = *it;
+        if (w->p == p && eligible(w->user)) {
+            admit(w->user, w->p);
+            w->admitted = true;
+            it = queue_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void admission::acquire(uid_t user, priority p) {
+    scoped_lock l(mx_);
+
+    /*
+     * dispatch leaves no job waiting that could run, so this job can only
+     * overtake those held back by their users' limits.
+     */
+    if (eligible(user)) {
+        admit(user, p);
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    waiter w{user, p, false};
+    queue_.push_back(&w);
+    stats_.queued = queue_.size();
+    stats_.max_queued = std::max(stats_.max_queued, stats_.queued);
+    if (p == priority::background) {
+        stats_.background_queued++;
+    }
+
+    while (!(w.admitted)) {
+        cv_.wait(l);
+    }
+
+    const auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    stats_.waited++;
+    if (p == priority::background) {
+        stats_.background_waited++;
+    }
+    stats_.total_wait += wait;
+    stats_.max_wait = std::max(stats_.max_wait, wait);
+}
+
+void admission::release(uid_t user) {
+    scoped_lock l(mx_);
+    assert(stats_.running > 0);
+    stats_.running--;
+
+    auto it = running_by_user_.find(user);
+    assert(it != running_by_user_.end());
+    if (--it->second == 0) {
+        running_by_user_.erase(it);
+    }
+
+    dispatch();
+    cv_.notify_all();
+}
@@ -0,0 +1,124 @@
+#ifndef __ASYMMETRICFS__ADMISSION_H__
+#define __ASYMMETRICFS__ADMISSION_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sys/types.h>
+
+/**
+ * admission bounds the number of jobs (for us, gpg processes) running at
+ * once, overall and for each user.  Jobs beyond the limits wait in FIFO
+ * order, except that a job held back only by its user's limit does not hold
+ * up the jobs of other users queued behind it, and that foreground jobs
+ * (those a blocked request is waiting for) are admitted ahead of any
+ * background jobs.
+ */
+class admission {
+    struct waiter;
+public:
+    enum class priority {
+        foreground,
+        background
+    };
+
+    /**
+     * limit bounds the jobs running at once, and per_user bounds those of any
+     * single user.  If 0, there is no limit.
+     */
+    admission(unsigned limit, unsigned per_user);
+    ~admission();
+
+    void set_limits(unsigned limit, unsigned per_user);
+
+    /**
+     * A slot blocks until its job is admitted, and holds its place among the
+     * running jobs until it is destroyed.
+     */
+    class slot {
+    public:
+        slot(admission& a, uid_t user, priority p = priority::foreground);
+        ~slot();
+    private:
+        admission& admission_;
+        const uid_t user_;
+
+        slot(const slot &) = delete;
+        const slot & operator=(const slot &) = delete;
+    };
+
+    struct statistics {
+        statistics();
+
+        /* The jobs running and waiting now, and the most ever waiting. */
+        unsigned running;
+        size_t queued;
+        size_t max_queued;
+
+        /*
+         * The jobs admitted, and how many of them had to wait.  Background
+         * jobs are counted separately as well.
+         */
+        uint64_t admitted;
+        uint64_t waited;
+        uint64_t background_admitted;
+        uint64_t background_waited;
+
+        /* Background jobs waiting now. */
+        size_t background_queued;
+
+        /* The total and longest time jobs spent waiting. */
+        std::chrono::microseconds total_wait;
+        std::chrono::microseconds max_wait;
+    };
+    statistics stats() const;
+private:
+    void acquire(uid_t user, priority p);
+    void release(uid_t user);
+
+    /*
+     * Admits what queued jobs it can, foreground jobs first.  The caller
+     * should hold mx_.
+     */
+    void dispatch();
+    void dispatch(priority p);
+    bool eligible(uid_t user) const;
+    void admit(uid_t user, priority p);
+
+    mutable std::mutex mx_;
+    std::condition_variable cv_;
+
+    unsigned limit_;
+    unsigned per_user_;
+    std::map<uid_t, unsigned> running_by_user_;
+    std::list<waiter*> queue_;
+
+    statistics stats_;
+
+    admission(const admission &) = delete;
+    const admission & operator=(const admission &) = delete;
+};
+
+#endif // __ASYMMETRICFS__ADMISSION_H__
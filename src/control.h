@@ -0,0 +1,66 @@
+#ifndef __ASYMMETRICFS__CONTROL_H__
+#define __ASYMMETRICFS__CONTROL_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * Commands applications can issue with ioctl(2) on a file of the filesystem,
+ * to pass on what asymmetricfs cannot infer for itself.
+ *
+ * ASYMMETRICFS_PREFETCH starts decrypting the file in the background, as it
+ *     will be read soon.
+ * ASYMMETRICFS_EVICT drops the file's plaintext, as it will not be read
+ *     again soon.  It fails with EBUSY if the file has unsaved changes.
+ * ASYMMETRICFS_FLUSH encrypts any unsaved changes now, as close(2) would.
+ * ASYMMETRICFS_QUERY describes the file's state in an asymmetricfs_status.
+ *
+ * They fail with ENOTTY on files that are not decrypted, such as those
+ * beneath /.raw.
+ */
+struct asymmetricfs_status {
+    /* ASYMMETRICFS_STATE_* flags. */
+    uint32_t state;
+    /* The gpg processes running and waiting to run, for any file. */
+    uint32_t gpg_running;
+    uint32_t gpg_queued;
+    uint32_t reserved;
+    /* The bytes of plaintext held, the file's size and its ciphertext's. */
+    uint64_t buffered;
+    uint64_t size;
+    uint64_t ciphertext;
+};
+
+/* The whole plaintext is held. */
+#define ASYMMETRICFS_STATE_LOADED   (1u << 0)
+/* There are changes not yet encrypted. */
+#define ASYMMETRICFS_STATE_DIRTY    (1u << 1)
+/* A decryption is paused partway, or a prefetch is pending. */
+#define ASYMMETRICFS_STATE_LOADING  (1u << 2)
+
+#define ASYMMETRICFS_IOCTL_MAGIC    0xae
+#define ASYMMETRICFS_PREFETCH   _IO(ASYMMETRICFS_IOCTL_MAGIC, 1)
+#define ASYMMETRICFS_EVICT      _IO(ASYMMETRICFS_IOCTL_MAGIC, 2)
+#define ASYMMETRICFS_FLUSH      _IO(ASYMMETRICFS_IOCTL_MAGIC, 3)
+#define ASYMMETRICFS_QUERY      _IOR(ASYMMETRICFS_IOCTL_MAGIC, 4, \
+    struct asymmetricfs_status)
+
+#endif // __ASYMMETRICFS__CONTROL_H__
@@ -0,0 +1,96 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * asymmetricfs-ctl issues the commands of control.h on files of a mounted
+ * asymmetricfs.
+ */
+#include "control.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <libgen.h>
+#include <string>
+#include <unistd.h>
+
+static int usage(char *argv0) {
+    std::cerr << "Usage: " << basename(argv0)
+              << " prefetch|evict|flush|query file..." << std::endl;
+    return 1;
+}
+
+static void print_status(const char *path, const asymmetricfs_status& s) {
+    std::cout << path << ":";
+    if (s.state & ASYMMETRICFS_STATE_LOADED) {
+        std::cout << " loaded";
+    } else if (s.state & ASYMMETRICFS_STATE_LOADING) {
+        std::cout << " loading";
+    } else {
+        std::cout << " not loaded";
+    }
+    if (s.state & ASYMMETRICFS_STATE_DIRTY) {
+        std::cout << ", dirty";
+    }
+
+    std::cout << "; " << s.buffered << " of " << s.size << " bytes held, "
+              << s.ciphertext << " bytes of ciphertext; gpg: "
+              << s.gpg_running << " running, " << s.gpg_queued << " queued"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        return usage(argv[0]);
+    }
+
+    const std::string command(argv[1]);
+    unsigned long request;
+    if (command == "prefetch") {
+        request = ASYMMETRICFS_PREFETCH;
+    } else if (command == "evict") {
+        request = ASYMMETRICFS_EVICT;
+    } else if (command == "flush") {
+        request = ASYMMETRICFS_FLUSH;
+    } else if (command == "query") {
+        request = ASYMMETRICFS_QUERY;
+    } else {
+        return usage(argv[0]);
+    }
+
+    int ret = 0;
+    for (int i = 2; i < argc; i++) {
+        const int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << argv[i] << ": " << strerror(errno) << std::endl;
+            ret = 1;
+            continue;
+        }
+
+        asymmetricfs_status status;
+        if (ioctl(fd, request, &status) != 0) {
+            std::cerr << argv[i] << ": " << strerror(errno) << std::endl;
+            ret = 1;
+        } else if (request == ASYMMETRICFS_QUERY) {
+            print_status(argv[i], status);
+        }
+        close(fd);
+    }
+
+    return ret;
+}
@@ -0,0 +1,170 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include "directory_cache.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+class directory_cache::descriptor {
+public:
+    explicit descriptor(int fd) : fd_(fd) {}
+    ~descriptor() {
+        ::close(fd_);
+    }
+
+    int fd() const {
+        return fd_;
+    }
+private:
+    const int fd_;
+
+    descriptor(const descriptor &) = delete;
+    const descriptor & operator=(const descriptor &) = delete;
+};
+
+directory_cache::resolved::resolved() : fd_(-1), name_(nullptr) {}
+
+int directory_cache::resolved::fd() const {
+    return fd_;
+}
+
+const char *directory_cache::resolved::name() const {
+    return name_;
+}
+
+directory_cache::directory_cache(int root, size_t capacity) : root_(root),
+        capacity_(capacity), generation_(0) {}
+
+directory_cache::~directory_cache() {}
+
+int directory_cache::open_parent(const path_ref& parent,
+        descriptor_ptr *out) {
+    uint64_t generation;
+    int root;
+    {
+        std::unique_lock<std::mutex> l(mx_);
+        auto it = index_.find(parent);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            *out = it->second->second;
+            return 0;
+        }
+
+        generation = generation_;
+        root = root_;
+    }
+
+    // parent is absolute and not NUL-terminated, so copy it, relative to the
+    // root, onto the stack.
+    char relpath[PATH_MAX];
+    if (parent.size() >= sizeof(relpath)) {
+        return ENAMETOOLONG;
+    }
+    memcpy(relpath, parent.data() + 1, parent.size() - 1);
+    relpath[parent.size() - 1] = '\0';
+
+    int fd = ::openat(root, relpath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    *out = std::make_shared<descriptor>(fd);
+
+    std::unique_lock<std::mutex> l(mx_);
+    if (capacity_ == 0 || generation != generation_ ||
+            index_.count(parent)) {
+        // Use the descriptor for this operation alone.
+        return 0;
+    }
+
+    lru_.emplace_front(std::string(parent.data(), parent.size()), *out);
+    index_[path_ref(lru_.front().first)] = lru_.begin();
+    while (lru_.size() > capacity_) {
+        index_.erase(path_ref(lru_.back().first));
+        lru_.pop_back();
+    }
+
+    return 0;
+}
+
+int directory_cache::resolve(const char *path, resolved *out) {
+    if (path[0] != '/') {
+        return EINVAL;
+    }
+
+    const char *slash = strrchr(path, '/');
+    out->name_ = slash[1] ? slash + 1 : ".";
+
+    if (slash == path) {
+        std::unique_lock<std::mutex> l(mx_);
+        out->parent_.reset();
+        out->fd_ = root_;
+        return 0;
+    }
+
+    descriptor_ptr parent;
+    int ret = open_parent(path_ref(path, size_t(slash - path)), &parent);
+    if (ret) {
+        return ret;
+    }
+
+    out->fd_ = parent->fd();
+    out->parent_ = std::move(parent);
+    return 0;
+}
+
+void directory_cache::invalidate(const path_ref& path) {
+    std::unique_lock<std::mutex> l(mx_);
+    generation_++;
+
+    const size_t n = path.size();
+    const bool root = n == 1 && path.data()[0] == '/';
+    for (auto it = lru_.begin(); it != lru_.end(); ) {
+        const std::string& key = it->first;
+        if (key.compare(0, n, path.data(), n) == 0 &&
+                (key.size() == n || key[n] == '/' || root)) {
+            index_.erase(path_ref(key));
+            it = lru_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void directory_cache::reset(int root) {
+    std::unique_lock<std::mutex> l(mx_);
+    generation_++;
+    root_ = root;
+    index_.clear();
+    lru_.clear();
+}
+
+void directory_cache::set_capacity(size_t capacity) {
+    std::unique_lock<std::mutex> l(mx_);
+    generation_++;
+    capacity_ = capacity;
+    index_.clear();
+    lru_.clear();
+}
+
+size_t directory_cache::size() const {
+    std::unique_lock<std::mutex> l(mx_);
+    return lru_.size();
+}
@@ -0,0 +1,127 @@
+#ifndef __ASYMMETRICFS__DIRECTORY_CACHE_H__
+#define __ASYMMETRICFS__DIRECTORY_CACHE_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include "path_ref.h"
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * directory_cache keeps a bounded, least-recently-used set of O_PATH
+ * descriptors for directories beneath a root directory.  Operations on a
+ * path can then use the descriptor of its parent and the final component with
+ * the *at() family of syscalls, rather than having the kernel walk every
+ * component of the path each time.
+ *
+ * Paths are absolute with respect to the root, e.g., "/a/b/c".  The cache
+ * follows the directories themselves, so any change that may alter what a
+ * cached path refers to (rename, removal, permission changes) must be
+ * reported via invalidate.
+ */
+class directory_cache {
+    class descriptor;
+public:
+    /**
+     * A resolved path:  a descriptor for its parent directory and its final
+     * component.  The descriptor remains open for the lifetime of the
+     * instance, even if it is evicted from the cache meanwhile.
+     */
+    class resolved {
+    public:
+        resolved();
+
+        int fd() const;
+        const char *name() const;
+    private:
+        friend class directory_cache;
+
+        std::shared_ptr<descriptor> parent_;
+        int fd_;
+        const char *name_;
+    };
+
+    /**
+     * root is not owned by the cache.  capacity is the maximum number of
+     * descriptors held; if 0, nothing is cached.
+     */
+    directory_cache(int root, size_t capacity);
+    ~directory_cache();
+
+    /**
+     * Resolves path into *out.  out->name() points into path, which must
+     * outlive out.  The root itself resolves to the root descriptor and ".".
+     *
+     * Returns 0 on success, otherwise the corresponding standard error code.
+     */
+    int resolve(const char *path, resolved *out);
+
+    /**
+     * Drops path and every cached directory beneath it.
+     */
+    void invalidate(const path_ref& path);
+
+    /**
+     * Drops all cached directories and uses root henceforth.
+     */
+    void reset(int root);
+
+    /**
+     * Drops all cached directories and changes the capacity.
+     */
+    void set_capacity(size_t capacity);
+
+    /**
+     * The number of cached directories.
+     */
+    size_t size() const;
+private:
+    typedef std::shared_ptr<descriptor> descriptor_ptr;
+    typedef std::list<std::pair<std::string, descriptor_ptr>> lru_list;
+
+    int open_parent(const path_ref& parent, descriptor_ptr *out);
+
+    mutable std::mutex mx_;
+    int root_;
+    size_t capacity_;
+
+    /**
+     * generation_ is advanced by every invalidation, so a lookup that raced
+     * with one does not repopulate the cache with a stale descriptor.
+     */
+    uint64_t generation_;
+
+    /**
+     * Most recently used first.  The keys of index_ refer to the paths held
+     * by lru_.
+     */
+    lru_list lru_;
+    std::unordered_map<path_ref, lru_list::iterator, path_ref::hash> index_;
+
+    directory_cache(const directory_cache &) = delete;
+    const directory_cache & operator=(const directory_cache &) = delete;
+};
+
+#endif // __ASYMMETRICFS__DIRECTORY_CACHE_H__
@@ -0,0 +1,336 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <ftw.h>
+#include "gpg_home.h"
+#include <stdexcept>
+#include "subprocess.h"
+#include <unistd.h>
+
+/**
+ * Runs file with argv, with its output written to out, or discarded if out is
+ * negative, and returns its exit status, or -1 if it did not exit normally.
+ */
+static int run(const std::string& file, const std::vector<std::string>& argv,
+        int out = -1) {
+    int in = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        throw std::runtime_error("Unable to open /dev/null.");
+    }
+
+    int null_out = -1;
+    if (out < 0) {
+        out = null_out = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (out < 0) {
+            ::close(in);
+            throw std::runtime_error("Unable to open /dev/null.");
+        }
+    }
+
+    int ret;
+    {
+        subprocess s(in, out, file, argv);
+        ret = s.wait();
+    }
+
+    ::close(in);
+    if (null_out >= 0) {
+        ::close(null_out);
+    }
+    return ret;
+}
+
+/**
+ * Like run, but stores the output in *output, less any trailing newlines.
+ */
+static int capture(const std::string& file,
+        const std::vector<std::string>& argv, std::string *output) {
+    int in = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        throw std::runtime_error("Unable to open /dev/null.");
+    }
+
+    output->clear();
+    int ret;
+    {
+        subprocess s(in, -1, file, argv);
+
+        char buffer[4096];
+        while (true) {
+            const ssize_t n = ::read(s.out(), buffer, sizeof(buffer));
+            if (n > 0) {
+                output->append(buffer, static_cast<size_t>(n));
+            } else if (n == 0 || errno != EINTR) {
+                break;
+            }
+        }
+
+        ret = s.wait();
+    }
+
+    ::close(in);
+
+    /* gpgconf ends its answers with a newline. */
+    while (!(output->empty()) && output->back() == '\n') {
+        output->pop_back();
+    }
+    return ret;
+}
+
+/**
+ * Returns the fingerprints of the primary keys in a listing by
+ * gpg --with-colons, those of record type ("pub" or "sec").
+ */
+static std::vector<std::string> fingerprints(const std::string& listing,
+        const std::string& type) {
+    std::vector<std::string> fingerprints;
+    bool want_fingerprint = false;
+
+    size_t offset = 0;
+    while (offset < listing.size()) {
+        size_t end = listing.find('\n', offset);
+        if (end == std::string::npos) {
+            end = listing.size();
+        }
+        const std::string line = listing.substr(offset, end - offset);
+        offset = end + 1;
+
+        if (line.compare(0, type.size() + 1, type + ":") == 0) {
+            want_fingerprint = true;
+        } else if (line.compare(0, 4, "fpr:") == 0 && want_fingerprint) {
+            /* The fingerprint is the tenth field; subkeys' follow. */
+            size_t field = 0;
+            for (int i = 0; i < 9 && field != std::string::npos; i++) {
+                field = line.find(':', field);
+                if (field != std::string::npos) {
+                    field++;
+                }
+            }
+
+            if (field != std::string::npos) {
+                fingerprints.push_back(
+                    line.substr(field, line.find(':', field) - field));
+            }
+            want_fingerprint = false;
+        }
+    }
+
+    return fingerprints;
+}
+
+/**
+ * gpgconf is installed alongside gpg, so prefer the one next to gpg_path.
+ */
+static std::string gpgconf_path(const std::string& gpg_path) {
+    const size_t slash = gpg_path.rfind('/');
+    if (slash != std::string::npos) {
+        const std::string sibling = gpg_path.substr(0, slash + 1) + "gpgconf";
+        if (::access(sibling.c_str(), X_OK) == 0) {
+            return sibling;
+        }
+    }
+
+    return "gpgconf";
+}
+
+static int remove_entry(const char *path, const struct stat *s, int type,
+        struct FTW *ftw) {
+    (void) s;
+    (void) type;
+    (void) ftw;
+
+    (void) ::remove(path);
+    return 0;
+}
+
+gpg_home::gpg_home() {}
+
+gpg_home::~gpg_home() {
+    remove();
+}
+
+int gpg_home::create(const std::string& parent, const std::string& gpg_path,
+        const std::vector<gpg_recipient>& recipients) {
+    remove();
+
+    std::string name = parent + "/asymmetricfs-gpg.XXXXXX";
+    if (!(::mkdtemp(&name[0]))) {
+        return errno;
+    }
+    path_ = name;
+
+    const int ret = populate(gpg_path, recipients);
+    if (ret != 0) {
+        remove();
+    }
+    return ret;
+}
+
+int gpg_home::populate(const std::string& gpg_path,
+        const std::vector<gpg_recipient>& recipients) {
+    /* Public keys are needed for our secret keys as well, to decrypt. */
+    std::string listing;
+    if (capture(gpg_path, {"gpg", "--batch", "--no-tty", "--with-colons",
+            "--list-secret-keys"}, &listing) != 0) {
+        return EIO;
+    }
+
+    const std::string keys = path_ + "/keys.gpg";
+    std::vector<std::string> exporting{"gpg", "--batch", "--no-tty", "--yes",
+        "--output", keys, "--export"};
+    for (const auto& r : recipients) {
+        exporting.push_back(static_cast<std::string>(r));
+    }
+    for (const auto& fingerprint : fingerprints(listing, "sec")) {
+        exporting.push_back(fingerprint);
+    }
+
+    if (run(gpg_path, exporting) != 0) {
+        return EIO;
+    }
+
+    /* Until its socket is linked, no agent should start for the home. */
+    int ret = run(gpg_path, {"gpg", "--homedir", path_, "--batch",
+        "--no-tty", "--quiet", "--no-autostart", "--import", keys});
+    ::unlink(keys.c_str());
+    if (ret != 0) {
+        return EIO;
+    }
+
+    /*
+     * Keys are as valid here as in the user's home.  gpg --check-trustdb
+     * fails for trust in keys it does not have, so only the trust in the
+     * imported keys is copied.
+     */
+    std::string trust;
+    if (capture(gpg_path, {"gpg", "--homedir", path_, "--batch", "--no-tty",
+            "--with-colons", "--list-keys"}, &listing) != 0 ||
+            capture(gpg_path, {"gpg", "--batch", "--no-tty",
+            "--export-ownertrust"}, &trust) != 0) {
+        return EIO;
+    }
+
+    const std::vector<std::string> imported = fingerprints(listing, "pub");
+    std::string kept;
+    size_t offset = 0;
+    while (offset < trust.size()) {
+        size_t end = trust.find('\n', offset);
+        if (end == std::string::npos) {
+            end = trust.size();
+        }
+        const std::string line = trust.substr(offset, end - offset);
+        offset = end + 1;
+
+        if (std::find(imported.begin(), imported.end(),
+                line.substr(0, line.find(':'))) != imported.end()) {
+            kept += line + "\n";
+        }
+    }
+
+    const std::string trust_path = path_ + "/ownertrust.txt";
+    int fd = ::open(trust_path.c_str(),
+        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return errno;
+    }
+    const bool written = ::write(fd, kept.data(), kept.size()) ==
+        static_cast<ssize_t>(kept.size());
+    ::close(fd);
+    ret = written ? run(gpg_path, {"gpg", "--homedir", path_, "--batch",
+        "--no-tty", "--quiet", "--no-autostart", "--import-ownertrust",
+        trust_path}) : EIO;
+    ::unlink(trust_path.c_str());
+    if (ret != 0 || run(gpg_path, {"gpg", "--homedir", path_, "--batch",
+            "--no-tty", "--quiet", "--no-autostart", "--check-trustdb"}) != 0) {
+        return EIO;
+    }
+
+    /*
+     * Point gpg at the user's agent, which holds the secret keys.  The
+     * agent's socket may live outside of the home, beneath /run/user.
+     */
+    const std::string gpgconf = gpgconf_path(gpg_path);
+    std::string socket, link;
+    if (capture(gpgconf, {"gpgconf", "--list-dirs", "agent-socket"},
+            &socket) != 0 || socket.empty() ||
+            capture(gpgconf, {"gpgconf", "--homedir", path_, "--list-dirs",
+            "agent-socket"}, &link) != 0 || link.empty()) {
+        return EIO;
+    }
+
+    (void) run(gpgconf, {"gpgconf", "--launch", "gpg-agent"});
+    if (link.compare(0, path_.size() + 1, path_ + "/") != 0) {
+        (void) run(gpgconf, {"gpgconf", "--homedir", path_,
+            "--create-socketdir"});
+        socket_link_ = link;
+    }
+    if (::symlink(socket.c_str(), link.c_str()) != 0) {
+        return errno;
+    }
+
+    /* Check the recipients can be encrypted to, as asymmetricfs will. */
+    std::vector<std::string> encrypting{"gpg"};
+    const std::vector<std::string> args = arguments();
+    encrypting.insert(encrypting.end(), args.begin(), args.end());
+    encrypting.insert(encrypting.end(), {"--batch", "--no-tty", "-e"});
+    if (std::all_of(recipients.begin(), recipients.end(),
+            [](const gpg_recipient& r) { return r.explicit_fingerprint(); })) {
+        encrypting.insert(encrypting.end(), {"--trust-model", "always"});
+    }
+    for (const auto& r : recipients) {
+        encrypting.push_back("-r");
+        encrypting.push_back(static_cast<std::string>(r));
+    }
+
+    return run(gpg_path, encrypting) == 0 ? 0 : EIO;
+}
+
+std::vector<std::string> gpg_home::arguments() const {
+    if (path_.empty()) {
+        return std::vector<std::string>();
+    }
+
+    return {"--homedir", path_, "--no-auto-check-trustdb",
+        "--no-random-seed-file", "--auto-key-locate", "local"};
+}
+
+const std::string& gpg_home::path() const {
+    return path_;
+}
+
+void gpg_home::remove() {
+    if (!(socket_link_.empty())) {
+        ::unlink(socket_link_.c_str());
+
+        /* Remove the socket directory gpgconf made, if nothing else uses it. */
+        const size_t slash = socket_link_.rfind('/');
+        if (slash != std::string::npos && slash > 0) {
+            (void) ::rmdir(socket_link_.substr(0, slash).c_str());
+        }
+        socket_link_.clear();
+    }
+
+    if (!(path_.empty())) {
+        (void) ::nftw(path_.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        path_.clear();
+    }
+}
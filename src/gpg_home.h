@@ -0,0 +1,72 @@
+#ifndef __ASYMMETRICFS__GPG_HOME_H__
+#define __ASYMMETRICFS__GPG_HOME_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpg_recipient.h"
+#include <string>
+#include <vector>
+
+/**
+ * gpg_home is a private gpg home directory holding only the public keys that
+ * are needed:  those of the recipients, and those of the secret keys of the
+ * user's own home (GNUPGHOME, or ~/.gnupg), along with the user's ownertrust.
+ * Secret keys stay with the user's gpg-agent, whose socket is linked into the
+ * private home.  gpg then starts without loading the user's whole keyring.
+ *
+ * The directory is removed when the gpg_home is destroyed.
+ */
+class gpg_home {
+public:
+    gpg_home();
+    ~gpg_home();
+
+    /**
+     * Creates the home in a new directory beneath parent, which should be on
+     * a tmpfs, and checks that the recipients can be encrypted to from it.
+     * gpg_path is run for gpg; gpgconf is expected alongside it or on the
+     * path.  Returns 0 on success, otherwise the corresponding standard error
+     * code (EIO if gpg or gpgconf failed).
+     */
+    int create(const std::string& parent, const std::string& gpg_path,
+        const std::vector<gpg_recipient>& recipients);
+
+    /**
+     * The arguments selecting the home for gpg.  As the home is private, they
+     * also skip maintaining the trust database and the random seed file, and
+     * keep gpg from looking for missing keys elsewhere.
+     */
+    std::vector<std::string> arguments() const;
+
+    const std::string& path() const;
+private:
+    /* Fills path_, returning as create does. */
+    int populate(const std::string& gpg_path,
+        const std::vector<gpg_recipient>& recipients);
+    void remove();
+
+    std::string path_;
+    /* The link to the agent's socket, if it is outside of path_. */
+    std::string socket_link_;
+
+    gpg_home(const gpg_home &) = delete;
+    const gpg_home & operator=(const gpg_home &) = delete;
+};
+
+#endif // __ASYMMETRICFS__GPG_HOME_H__
@@ -16,11 +16,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <boost/program_options.hpp>
+#include <cctype>
+#include <cerrno>
 #include <fcntl.h>
 #include "gpg_recipient.h"
 #include <string>
 #include "subprocess.h"
+#include <unistd.h>
 #include <vector>
 
 invalid_gpg_recipient::invalid_gpg_recipient(const std::string & r) : r_(r) { }
@@ -33,7 +37,11 @@ const char * invalid_gpg_recipient::what() const noexcept {
     return "Invalid gpg recipient.";
 }
 
-gpg_recipient::gpg_recipient(const std::string& r) : r_(r) {}
+gpg_recipient::gpg_recipient(const std::string& r) :
+    gpg_recipient(r, false) {}
+
+gpg_recipient::gpg_recipient(const std::string& r, bool resolved) : r_(r),
+    resolved_(resolved) {}
 
 void gpg_recipient::validate(const std::string& gpg_path) const {
     /* Start gpg. */
@@ -63,6 +71,192 @@ void gpg_recipient::validate(const std::string& gpg_path) const {
     }
 }
 
+namespace {
+
+struct listed_key {
+    std::string fingerprint;
+    /* The key's user IDs, in lower case. */
+    std::vector<std::string> uids;
+};
+
+}  // namespace
+
+static std::string to_lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+/**
+ * If r names a key by ID or fingerprint (8, 16 or 40 hex digits, optionally
+ * prefixed by 0x), stores it in *id in upper case and returns true.
+ */
+static bool key_id(const std::string& r, std::string *id) {
+    std::string hex = r;
+    if (hex.size() > 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+        hex = hex.substr(2);
+    }
+
+    if (hex.size() != 8 && hex.size() != 16 && hex.size() != 40) {
+        return false;
+    }
+    for (auto& c : hex) {
+        if (!(std::isxdigit(static_cast<unsigned char>(c)))) {
+            return false;
+        }
+        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    }
+
+    *id = hex;
+    return true;
+}
+
+/**
+ * Parses the keys listed by gpg --with-colons --with-fingerprint.
+ */
+static std::vector<listed_key> parse_keys(const std::string& listing) {
+    std::vector<listed_key> keys;
+    bool want_fingerprint = false;
+
+    size_t offset = 0;
+    while (offset < listing.size()) {
+        size_t end = listing.find('\n', offset);
+        if (end == std::string::npos) {
+            end = listing.size();
+        }
+
+        std::vector<std::string> fields;
+        size_t field = offset;
+        while (true) {
+            const size_t colon = listing.find(':', field);
+            if (colon == std::string::npos || colon >= end) {
+                fields.push_back(listing.substr(field, end - field));
+                break;
+            }
+            fields.push_back(listing.substr(field, colon - field));
+            field = colon + 1;
+        }
+        offset = end + 1;
+
+        /* The user ID or fingerprint is the tenth field. */
+        if (fields[0] == "pub") {
+            keys.push_back(listed_key());
+            want_fingerprint = true;
+        } else if (keys.empty() || fields.size() < 10) {
+            continue;
+        } else if (fields[0] == "fpr" && want_fingerprint) {
+            /* Subkeys' fingerprints follow the primary key's. */
+            keys.back().fingerprint = fields[9];
+            want_fingerprint = false;
+        } else if (fields[0] == "uid") {
+            keys.back().uids.push_back(to_lower(fields[9]));
+        }
+    }
+
+    return keys;
+}
+
+/**
+ * Returns true if r names key, by the rules gpg applies to plain key IDs and
+ * user ID substrings.  Other forms gpg accepts match no key here.
+ */
+static bool names(const listed_key& key, const std::string& r) {
+    std::string id;
+    if (key_id(r, &id)) {
+        return key.fingerprint.size() >= id.size() &&
+            key.fingerprint.compare(key.fingerprint.size() - id.size(),
+                id.size(), id) == 0;
+    }
+
+    const std::string needle = to_lower(r);
+    return std::any_of(key.uids.begin(), key.uids.end(),
+        [&](const std::string& uid) {
+            return uid.find(needle) != std::string::npos;
+        });
+}
+
+std::vector<gpg_recipient> gpg_recipient::resolve(
+        const std::vector<gpg_recipient>& recipients,
+        const std::string& gpg_path) {
+    if (recipients.empty()) {
+        return recipients;
+    }
+
+    int in = ::open("/dev/null", O_RDONLY);
+    if (in < 0) {
+        throw std::runtime_error("Unable to open /dev/null.");
+    }
+
+    std::vector<std::string> argv{"gpg", "--batch", "--no-tty",
+        "--with-colons", "--with-fingerprint", "--list-keys", "--"};
+    for (const auto& r : recipients) {
+        argv.push_back(r.r_);
+    }
+
+    std::string listing;
+    int ret;
+    {
+        subprocess s(in, -1, gpg_path, argv);
+
+        char buffer[4096];
+        while (true) {
+            const ssize_t n = ::read(s.out(), buffer, sizeof(buffer));
+            if (n > 0) {
+                listing.append(buffer, static_cast<size_t>(n));
+            } else if (n == 0 || errno != EINTR) {
+                break;
+            }
+        }
+
+        ret = s.wait();
+    }
+    ::close(in);
+
+    if (ret != 0) {
+        /* Find which recipient is at fault, at the cost of a run for each. */
+        for (const auto& r : recipients) {
+            r.validate(gpg_path);
+        }
+        throw invalid_gpg_recipient(recipients.front().r_);
+    }
+
+    const std::vector<listed_key> keys = parse_keys(listing);
+    std::vector<gpg_recipient> resolved;
+    for (const auto& r : recipients) {
+        const listed_key *match = nullptr;
+        size_t n_matches = 0;
+        for (const auto& key : keys) {
+            if (names(key, r.r_)) {
+                match = &key;
+                n_matches++;
+            }
+        }
+
+        if (n_matches == 0) {
+            /*
+             * gpg lists what it finds of several names without failing, so
+             * check this one on its own.  It may be in a form we do not
+             * match.
+             */
+            r.validate(gpg_path);
+            resolved.push_back(r);
+        } else if (n_matches == 1 && !(r.explicit_fingerprint()) &&
+                !(match->fingerprint.empty())) {
+            resolved.push_back(gpg_recipient(match->fingerprint, true));
+        } else {
+            /* Leave ambiguous names for gpg to choose among, as before. */
+            resolved.push_back(r);
+        }
+    }
+
+    return resolved;
+}
+
+bool gpg_recipient::explicit_fingerprint() const {
+    std::string id;
+    return !(resolved_) && key_id(r_, &id) && id.size() == 40;
+}
+
 gpg_recipient::operator std::string() const {
     return r_;
 }
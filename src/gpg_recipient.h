@@ -42,9 +42,25 @@ public:
     // invalid_gpg_recipient on error.
     void validate(const std::string& gpg_path) const;
 
+    // Validates every recipient with a single run of gpg, returning them with
+    // each replaced by the full fingerprint of its key where it names exactly
+    // one key listed.  Others are returned as given, for gpg to look up each
+    // time, and those matching no key listed are validated on their own.
+    // Throws invalid_gpg_recipient on error.
+    static std::vector<gpg_recipient> resolve(
+        const std::vector<gpg_recipient>& recipients,
+        const std::string& gpg_path);
+
+    // Returns true if the recipient was given as a full fingerprint, rather
+    // than resolved to one, so its key was chosen explicitly.
+    bool explicit_fingerprint() const;
+
     operator std::string() const;
 private:
+    gpg_recipient(const std::string & r, bool resolved);
+
     std::string r_;
+    bool resolved_;
 };
 
 void validate(boost::any & v, const std::vector<std::string> & values,
@@ -0,0 +1,178 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cassert>
+#include <cerrno>
+#include "group_commit.h"
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef std::unique_lock<std::mutex> scoped_lock;
+
+struct group_commit::ticket {
+    int fd;
+    bool datasync;
+    bool done;
+    int result;
+};
+
+group_commit::participant::participant(group_commit& g) : group_(g),
+        joined_(true) {
+    group_.join();
+}
+
+group_commit::participant::~participant() {
+    if (joined_) {
+        group_.leave();
+    }
+}
+
+int group_commit::participant::sync(int fd, bool datasync) {
+    assert(joined_);
+    joined_ = false;
+    return group_.sync(fd, datasync);
+}
+
+group_commit::group_commit(std::chrono::microseconds window) :
+    window_(window), preparing_(0), syncing_(false), batches_(0), syncs_(0),
+    filesystems_(0) {}
+
+group_commit::~group_commit() {
+    assert(preparing_ == 0);
+    assert(queue_.empty());
+}
+
+void group_commit::set_window(std::chrono::microseconds window) {
+    scoped_lock l(mx_);
+    window_ = window;
+}
+
+uint64_t group_commit::batches() const {
+    scoped_lock l(mx_);
+    return batches_;
+}
+
+uint64_t group_commit::syncs() const {
+    scoped_lock l(mx_);
+    return syncs_;
+}
+
+uint64_t group_commit::filesystems() const {
+    scoped_lock l(mx_);
+    return filesystems_;
+}
+
+void group_commit::join() {
+    scoped_lock l(mx_);
+    preparing_++;
+}
+
+void group_commit::leave() {
+    scoped_lock l(mx_);
+    assert(preparing_ > 0);
+    preparing_--;
+    cv_.notify_all();
+}
+
+int group_commit::sync(int fd, bool datasync) {
+    ticket t{fd, datasync, false, 0};
+
+    scoped_lock l(mx_);
+    assert(preparing_ > 0);
+    preparing_--;
+    queue_.push_back(&t);
+    cv_.notify_all();
+
+    while (!(t.done)) {
+        if (syncing_) {
+            cv_.wait(l);
+            continue;
+        }
+
+        /* Lead the next batch. */
+        syncing_ = true;
+        const auto deadline = std::chrono::steady_clock::now() + window_;
+        while (preparing_ > 0 &&
+                cv_.wait_until(l, deadline) != std::cv_status::timeout) {}
+
+        std::vector<ticket*> batch;
+        batch.swap(queue_);
+        l.unlock();
+
+        const unsigned synced = flush(batch);
+
+        l.lock();
+        for (ticket* b : batch) {
+            b->done = true;
+        }
+        syncing_ = false;
+        batches_++;
+        syncs_ += batch.size();
+        filesystems_ += synced;
+        cv_.notify_all();
+    }
+
+    return t.result;
+}
+
+unsigned group_commit::flush(const std::vector<ticket*>& batch) {
+    assert(!(batch.empty()));
+
+    /*
+     * The files may lie on several filesystems (e.g., beneath bind mounts),
+     * and syncfs only syncs the one holding the descriptor it is given.
+     */
+    std::vector<ticket*> singles;
+    std::map<dev_t, std::vector<ticket*>> filesystems;
+    if (batch.size() > 1) {
+        for (ticket* t : batch) {
+            struct stat s;
+            if (::fstat(t->fd, &s) == 0) {
+                filesystems[s.st_dev].push_back(t);
+            } else {
+                singles.push_back(t);
+            }
+        }
+    } else {
+        singles = batch;
+    }
+
+    unsigned synced = 0;
+    for (const auto& f : filesystems) {
+        const std::vector<ticket*>& tickets = f.second;
+        if (tickets.size() > 1 && ::syncfs(tickets[0]->fd) == 0) {
+            for (ticket* t : tickets) {
+                t->result = 0;
+            }
+            synced++;
+        } else {
+            /*
+             * Fall back to syncing each file, which attributes any errors to
+             * the files concerned.
+             */
+            singles.insert(singles.end(), tickets.begin(), tickets.end());
+        }
+    }
+
+    for (ticket* t : singles) {
+        const int ret = t->datasync ? ::fdatasync(t->fd) : ::fsync(t->fd);
+        t->result = ret == 0 ? 0 : errno;
+    }
+    return synced;
+}
@@ -0,0 +1,101 @@
+#ifndef __ASYMMETRICFS__GROUP_COMMIT_H__
+#define __ASYMMETRICFS__GROUP_COMMIT_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * group_commit batches the syncs of files.  Callers join as participants
+ * before they prepare their data (for us, encrypting it), and sync once it is
+ * written.  One participant leads each batch, waiting up to the window for
+ * the others still preparing their data, and then syncs the files of the
+ * batch on each filesystem at once, with syncfs.  Participants arriving while
+ * a batch is being synced form the next one.
+ *
+ * A file that is alone on its filesystem within a batch, as is a lone
+ * participant, is synced by itself, with fsync or fdatasync.
+ */
+class group_commit {
+    struct ticket;
+public:
+    class participant {
+    public:
+        explicit participant(group_commit& g);
+        /* Leaves the group, if sync was not called. */
+        ~participant();
+
+        /**
+         * Syncs fd, which must remain open until this returns.  Returns 0 on
+         * success, otherwise the corresponding standard error code.
+         */
+        int sync(int fd, bool datasync);
+    private:
+        group_commit& group_;
+        bool joined_;
+
+        participant(const participant &) = delete;
+        const participant & operator=(const participant &) = delete;
+    };
+
+    explicit group_commit(std::chrono::microseconds window);
+    ~group_commit();
+
+    void set_window(std::chrono::microseconds window);
+
+    /**
+     * The number of batches synced, the number of syncs they held, and the
+     * number of times a filesystem was synced whole for them.
+     */
+    uint64_t batches() const;
+    uint64_t syncs() const;
+    uint64_t filesystems() const;
+private:
+    void join();
+    void leave();
+    int sync(int fd, bool datasync);
+
+    /*
+     * Syncs the tickets of batch, setting their results.  Returns the number
+     * of filesystems synced whole.
+     */
+    static unsigned flush(const std::vector<ticket*>& batch);
+
+    mutable std::mutex mx_;
+    std::condition_variable cv_;
+    std::chrono::microseconds window_;
+
+    /* The number of participants that have yet to sync. */
+    unsigned preparing_;
+    bool syncing_;
+    std::vector<ticket*> queue_;
+
+    uint64_t batches_;
+    uint64_t syncs_;
+    uint64_t filesystems_;
+
+    group_commit(const group_commit &) = delete;
+    const group_commit & operator=(const group_commit &) = delete;
+};
+
+#endif // __ASYMMETRICFS__GROUP_COMMIT_H__
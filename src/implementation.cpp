@@ -26,23 +26,67 @@ namespace std { class type_info; }
 #ifdef HAS_XATTR
 #include <attr/xattr.h>
 #endif // HAS_XATTR
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
 #include "implementation.h"
+#include <iostream>
+#include <memory>
 #include "page_buffer.h"
 #include <set>
+#include <signal.h>
 #include <stdexcept>
 #include <string>
 #include "subprocess.h"
-#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 typedef std::unique_lock<std::mutex> scoped_lock;
 typedef std::vector<gpg_recipient> RecipientList;
 
+const char asymmetricfs::raw_view_prefix[] = "/.raw";
+
+/**
+ * The raw view is read-only, so strip the write bits from any attributes we
+ * report for it.
+ */
+static void clear_write_bits(struct stat *s) {
+    s->st_mode &= static_cast<mode_t>(~(S_IWUSR | S_IWGRP | S_IWOTH));
+}
+
+bool asymmetricfs::raw_path(const char *path, std::string* relpath) const {
+    if (!(raw_view_)) {
+        return false;
+    }
+
+    const size_t prefix_size = sizeof(raw_view_prefix) - 1;
+    if (strncmp(path, raw_view_prefix, prefix_size) != 0) {
+        return false;
+    } else if (path[prefix_size] != '\0' && path[prefix_size] != '/') {
+        /* A sibling of the raw view, such as "/.rawfoo". */
+        return false;
+    }
+
+    if (relpath) {
+        *relpath = ".";
+        relpath->append(path + prefix_size);
+    }
+    return true;
+}
+
+bool asymmetricfs::writable(const char *path) const {
+    return !(read_only_) && !(raw_path(path, nullptr));
+}
+
 /**
  * System utilities such as truncate open the file descriptor for writing only.
  * This makes it difficult when we must decrypt the file, truncate, and then
@@ -63,441 +107,2190 @@ int asymmetricfs::make_rdwr(int flags) const {
 
 class asymmetricfs::internal {
 public:
-    internal(const asymmetricfs::options& options);
+    explicit internal(asymmetricfs& fs);
+    internal(asymmetricfs& fs, uid_t user_);
     ~internal();
 
     int fd;
     int flags;
+    /* The user the file's gpg jobs are run for. */
+    uid_t user;
+    /*
+     * Set if no request waits for the file to be decrypted, which is then
+     * done as a background job that cannot be interrupted.
+     */
+    bool speculative;
+    /*
+     * Set while a load hinted by ASYMMETRICFS_PREFETCH is pending.  It is
+     * protected by mx.
+     */
+    bool loading;
+    /* references and path are protected by asymmetricfs::mx_. */
     unsigned references;
     std::string path;
 
+    /**
+     * This protects the remaining state, including the buffer, and is held
+     * while gpg runs for this file.
+     */
+    std::mutex mx;
+
     bool buffer_set;
     bool dirty;
     page_buffer buffer;
 
     /**
+     * The ciphertext from offset base onwards holds the first persisted bytes
+     * of buffer.  base is 0 once the buffer is set; otherwise, the buffer
+     * only holds what was written since the file was opened, and base is
+     * where its first block was appended.  Bytes of buffer from dirty_from
+     * onwards have been modified since.
+     */
+    off_t base;
+    size_t persisted;
+    size_t dirty_from;
+    /* The number of blocks appended since the ciphertext was rewritten. */
+    unsigned appended;
+    /*
+     * Once the backing file has been replaced, a descriptor for the directory
+     * it was replaced in, which needs to be synced for the replacement to be
+     * durable.  Otherwise, -1.  Unlike the path, this follows the directory
+     * if it is renamed.
+     */
+    int replaced_in;
+
+    /*
+     * The backing file as we last read or wrote it, so changes made to it by
+     * other processes can be told from our own.
+     */
+    struct stat seen;
+    void note_backing();
+
+    /**
+     * Discards what was decrypted of the file, as the backing file changed,
+     * so it is decrypted again when next needed.  The caller should hold mx
+     * and the file should not be dirty.
+     */
+    void discard();
+
+    /**
+     * A decryption of the file that was paused once it produced the bytes
+     * requested so far, which buffer holds.  It is resumed as more of the
+     * file is read and cancelled if the file is closed first.
+     */
+    struct decryption;
+    std::unique_ptr<decryption> decrypting;
+
+    /**
+     * Decrypts the file into buffer until at least needed bytes are there,
+     * pausing the decryption if more remain, or until the whole file is, at
+     * which point the buffer is set.
+     *
+     * Returns 0 on success, otherwise the corresponding standard error code.
+     * The caller should hold mx.
+     */
+    int load_buffer(size_t needed = SIZE_MAX);
+
+    /**
+     * Stops any paused decryption, discarding what it decrypted.
+     */
+    void cancel_decryption();
+
+    /**
+     * Records that the bytes of buffer from offset onwards were modified.
+     */
+    void modified(size_t offset);
+
+    /**
+     * Encrypts any unsaved changes, leaving the file open.  When only bytes
+     * past those already encrypted were modified, only those are encrypted,
+     * as a new block appended to the ciphertext.  Otherwise, the ciphertext
+     * is rewritten.  If compact, a file whose plaintext is known is rewritten
+     * as a single block if it has had blocks appended.
+     *
      * Returns 0 on success, otherwise the corresponding standard error code.
-     * This should not be called by multiple threads on a single instance.
+     * The caller should hold mx.
+     */
+    int checkpoint(bool compact);
+
+    /**
+     * Encrypts the bytes of buffer from offset from onwards to out, at its
+     * current offset.  Returns 0 on success, otherwise EIO.
+     */
+    int encrypt(int out, size_t from);
+
+    /**
+     * Encrypts the buffer into a new file and renames it over the backing
+     * file, so the backing file is never seen partially written.  Returns 0
+     * on success, EIO if gpg failed, and otherwise the error that prevented
+     * the replacement, in which case the caller may rewrite the backing file
+     * in place.
      */
-    int load_buffer();
+    int replace();
 
+    /**
+     * Encrypts any unsaved changes and closes the file.  Returns 0 on
+     * success, otherwise the corresponding standard error code.
+     */
     int close();
+
+    /**
+     * Returns false once the file is closed.  The caller should hold mx.
+     */
+    bool is_open() const;
+
+    /**
+     * Replaces the size reported in s with the plaintext size, where it is
+     * known.
+     */
+    void adjust_size(struct stat *s) const;
 protected:
     internal(const internal &) = delete;
     const internal & operator=(const internal &) = delete;
 
+    /**
+     * Resumes the decryption until buffer holds needed bytes or every block
+     * is decrypted.  Returns 0 on success, otherwise the corresponding
+     * standard error code.
+     */
+    int decrypt(size_t needed);
+
     bool open_;
+    asymmetricfs& fs_;
     const asymmetricfs::options& options_;
 };
 
-asymmetricfs::internal::internal(const asymmetricfs::options& options) :
-    references(0), buffer_set(false), dirty(false), buffer(options.mlock),
-    open_(true), options_(options) { }
+asymmetricfs::internal::internal(asymmetricfs& fs) :
+    internal(fs, fs.requester_()) {}
 
-asymmetricfs::internal::~internal() {
-    (void) close();
-    assert(references == 0);
+asymmetricfs::internal::internal(asymmetricfs& fs, uid_t user_) :
+    user(user_), speculative(false), loading(false), references(0),
+    buffer_set(false), dirty(false), buffer(fs.options_.mlock), base(0),
+    persisted(0), dirty_from(SIZE_MAX), appended(0), replaced_in(-1),
+    open_(true), fs_(fs), options_(fs.options_) {
+    memset(&seen, 0, sizeof(seen));
 }
 
-int asymmetricfs::internal::close() {
-    if (!(open_)) {
-        return 0;
-    }
+struct asymmetricfs::internal::decryption {
+    decryption(size_t size_, std::atomic<unsigned>& paused_);
+    ~decryption();
 
-    int ret = 0;
-    if (dirty) {
-        std::vector<std::string> argv{"gpg", "-ae", "--no-tty", "--batch"};
-        for (const auto& recipient : options_.recipients) {
-            argv.push_back("-r");
-            argv.push_back(static_cast<std::string>(recipient));
-        }
+    /* Returns true once every block has been decrypted. */
+    bool finished() const;
 
-        /* Start gpg. */
-        subprocess s(-1, fd, options_.gpg_path, argv);
+    /*
+     * A paused gpg holds no admission slot, so the paused decryptions are
+     * counted in paused_count and bounded separately.  pause returns false,
+     * leaving the decryption running, once limit are already paused.
+     */
+    bool pause(unsigned limit);
+    void resume();
+    std::atomic<unsigned>& paused_count;
+    bool paused;
 
-        buffer.splice(s.in(), 0);
+    /*
+     * The size of the ciphertext, and where its next block starts.  The
+     * ciphertext is read as each block starts rather than mapped, as it may
+     * be truncated while the decryption is paused.
+     */
+    const size_t size;
+    size_t offset;
 
-        int wait_ret = s.wait();
-        if (wait_ret != 0) {
-            ret = -EIO;
-        }
+    /*
+     * The gpg decrypting the current block, the block read for it, and the
+     * input it still needs.
+     */
+    std::unique_ptr<subprocess> gpg;
+    std::vector<uint8_t> block;
+    const uint8_t *input;
+    size_t input_size;
+};
 
-        dirty = false;
-    }
+asymmetricfs::internal::decryption::decryption(size_t size_,
+    std::atomic<unsigned>& paused_) : paused_count(paused_), paused(false),
+    size(size_), offset(0), input(nullptr), input_size(0) {}
 
-    open_ = false;
-    int close_ret = ::close(fd);
-    if (ret != 0) {
-        return ret;
-    } else if (close_ret == 0) {
-        return 0;
-    } else {
-        return errno;
-    }
-}
+asymmetricfs::internal::decryption::~decryption() {
+    resume();
 
-int asymmetricfs::internal::load_buffer() {
-    if (buffer_set) {
-        return 0;
+    if (gpg) {
+        /* It may be blocked writing to us, or still working. */
+        gpg->kill(SIGKILL);
+        (void) gpg->wait();
     }
+}
 
-    assert(open_);
+bool asymmetricfs::internal::decryption::finished() const {
+    return !(gpg) && offset >= size;
+}
 
-    /* Clear the current buffer. */
-    dirty = false;
-    buffer.clear();
+bool asymmetricfs::internal::decryption::pause(unsigned limit) {
+    assert(!(paused));
+    if (paused_count.fetch_add(1) >= limit) {
+        paused_count--;
+        return false;
+    }
 
-    /* gpg does not react well to seeing multiple encrypted blocks in the same
-     * session, so the data needs to be chunked across multiple calls. */
-    const std::vector<std::string> argv{"gpg", "-d", "--no-tty", "--batch"};
+    paused = true;
+    return true;
+}
 
-    struct stat fd_stat;
-    int ret = fstat(fd, &fd_stat);
-    if (ret != 0) {
-        return errno;
-    } else if (fd_stat.st_size <= 0) {
-        buffer_set = true;
-        return 0;
+void asymmetricfs::internal::decryption::resume() {
+    if (paused) {
+        paused_count--;
+        paused = false;
     }
+}
 
-    const size_t fd_size = static_cast<size_t>(fd_stat.st_size);
+asymmetricfs::internal::~internal() {
+    (void) close();
+    assert(references == 0);
+}
 
-    const uint8_t * underlying = static_cast<const uint8_t *>(
-        mmap(NULL, fd_size, PROT_READ, MAP_SHARED, fd, 0));
-    if (underlying == MAP_FAILED) {
-        return errno;
-    }
+/**
+ * A handle in read-only mode.  Beneath the raw view, it holds the backing
+ * descriptor; otherwise, it holds the file, which is decrypted before the
+ * handle is created and never modified.
+ */
+struct asymmetricfs::shared_handle {
+    int raw_fd;
+    internal_ptr file;
+};
 
-    static const char terminator[]    = "-----END PGP MESSAGE-----\n";
-    static size_t     terminator_size = sizeof(terminator) - 1;
+asymmetricfs::shared_handle* asymmetricfs::find_shared(
+        const struct fuse_file_info *info) {
+    assert(info && info->fh);
+    return reinterpret_cast<shared_handle *>(
+        static_cast<uintptr_t>(info->fh));
+}
 
-    buffer_set = true;
-    ret = 0;
-    for (size_t offset = 0; offset < fd_size; ) {
-        /*
-         * Find terminator of gpg block.  This can be optimized, but
-         * terminator_size is small.
-         */
-        size_t new_offset;
-        for (new_offset = offset; new_offset <= fd_size - terminator_size;
-                new_offset++) {
-            if (memcmp(terminator, underlying + new_offset,
-                    terminator_size) == 0) {
-                new_offset += terminator_size;
+/**
+ * Writes the bytes of buffer from offset onwards to fd.
+ */
+static void write_from(const page_buffer& buffer, size_t offset, int fd) {
+    uint8_t chunk[1 << 16];
+    while (offset < buffer.size()) {
+        const size_t n = buffer.read(sizeof(chunk), offset, chunk);
+        size_t written = 0;
+        while (written < n) {
+            ssize_t ret = ::write(fd, chunk + written, n - written);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            } else if (ret <= 0) {
+                /* gpg's exit status reports the failure. */
+                offset = buffer.size();
                 break;
             }
+            written += static_cast<size_t>(ret);
         }
-        assert(offset <= new_offset);
-        assert(new_offset <= fd_size);
-
-        const uint8_t *write_buffer;
-        size_t write_size;
-        int gpg_stdin;
-        if (offset == 0 && new_offset == fd_size) {
-            /* Special case:  Single block. */
-            gpg_stdin = fd;
-            write_buffer = NULL;
-            write_size   = 0;
-        } else {
-            gpg_stdin = -1;
-            write_buffer = underlying + offset;
-            write_size   = new_offset - offset;
+        offset += n;
+    }
 
-            if (write_size == 0) {
-                break;
-            }
-        }
+    /* Do not leave plaintext behind on the stack. */
+    volatile uint8_t *p = chunk;
+    for (size_t i = 0; i < sizeof(chunk); i++) {
+        p[i] = 0;
+    }
+}
 
-        /* Start gpg. */
-        subprocess s(gpg_stdin, -1, options_.gpg_path, argv);
+void asymmetricfs::internal::note_backing() {
+    if (::fstat(fd, &seen) != 0) {
+        memset(&seen, 0, sizeof(seen));
+    }
+}
 
-        /* Communicate with gpg. */
-        const size_t chunk_size = 1 << 20;
-        std::string receive_buffer(chunk_size, '\0');
-        while (true) {
-            size_t this_chunk = receive_buffer.size();
+void asymmetricfs::internal::discard() {
+    assert(!(dirty));
 
-            size_t write_remaining = write_size;
-            int cret = s.communicate(&receive_buffer[0], &this_chunk,
-                write_buffer, &write_remaining);
-            if (cret != 0) {
-                ret = -cret;
-                break;
-            }
+    decrypting.reset();
+    buffer.wipe();
+    buffer_set = false;
+    base = 0;
+    persisted = 0;
+    dirty_from = SIZE_MAX;
+    appended = 0;
+}
 
-            if (chunk_size == this_chunk) {
-                break;
-            }
-            buffer.write(
-                chunk_size - this_chunk, buffer.size(), &receive_buffer[0]);
+void asymmetricfs::internal::modified(size_t offset) {
+    dirty = true;
+    dirty_from = std::min(dirty_from, offset);
+}
 
-            if (write_buffer) {
-                write_buffer += write_size - write_remaining;
-                write_size   = write_remaining;
-            }
+int asymmetricfs::internal::checkpoint(bool compact) {
+    assert(open_);
+
+    const bool compacting = compact && buffer_set && (dirty || appended > 0);
+    if (!(dirty) && !(compacting)) {
+        return 0;
+    }
+
+    if (!(buffer_set) && persisted == 0) {
+        /* Nothing has been encrypted yet, so append after what is there. */
+        off_t end = ::lseek(fd, 0, SEEK_END);
+        if (end < 0) {
+            return errno;
         }
+        base = end;
+    }
 
-        int wait = s.wait();
-        if (wait != 0) {
-            buffer_set = false;
-            ret = EIO;
-            break;
+    const bool rewrite = dirty_from < persisted || compacting ||
+        (buffer_set && persisted == 0);
+    if (rewrite && buffer_set) {
+        int ret = replace();
+        if (ret == 0) {
+            note_backing();
+            return 0;
+        } else if (ret == EIO) {
+            return ret;
         }
+        /* Otherwise, fall back to rewriting the file in place. */
+    }
 
-        offset = new_offset;
+    if (rewrite) {
+        if (::ftruncate(fd, base) != 0) {
+            return errno;
+        }
+        /* Whatever was encrypted is gone, should we fail from here on. */
+        persisted = 0;
+        appended = 0;
     }
 
-    munmap(const_cast<uint8_t *>(underlying),
-        static_cast<size_t>(fd_stat.st_size));
+    const off_t start = ::lseek(fd, 0, SEEK_END);
+    if (start < 0) {
+        return errno;
+    }
+    const size_t from = persisted;
 
-    return ret;
-}
+    if (encrypt(fd, from) != 0) {
+        /* Drop any partial block, so the ciphertext remains readable. */
+        (void) ::ftruncate(fd, start);
+        return EIO;
+    }
 
-const memory_lock asymmetricfs::memory_lock_default = memory_lock::all;
+    if (from != 0) {
+        appended++;
+    }
+    persisted = buffer.size();
+    dirty_from = SIZE_MAX;
+    dirty = false;
+    note_backing();
+    return 0;
+}
 
-asymmetricfs::options::options() : gpg_path("gpg"),
-    mlock(memory_lock_default) {}
+int asymmetricfs::internal::encrypt(int out, size_t from) {
+    std::vector<std::string> argv =
+        options_.gpg_command({"-ae", "--no-tty", "--batch"});
+    if (options_.trust_recipients) {
+        /* The keys were chosen explicitly, so need no further validity. */
+        argv.push_back("--trust-model");
+        argv.push_back("always");
+    }
+    for (const auto& recipient : options_.recipients) {
+        argv.push_back("-r");
+        argv.push_back(static_cast<std::string>(recipient));
+    }
 
-asymmetricfs::asymmetricfs() : read_(false), root_set_(false), next_(0) { }
+    /* Start gpg, once it is admitted. */
+    admission::slot slot(fs_.gpg_jobs_, user,
+        admission::priority::background);
+    subprocess s(-1, out, options_.gpg_path, argv, options_.background);
 
-asymmetricfs::~asymmetricfs() {
-    if (root_set_) {
-        ::close(root_);
+    if (from == 0) {
+        buffer.splice(s.in(), 0);
+    } else {
+        write_from(buffer, from, s.in());
     }
 
-    for (open_fd_map_t::iterator it = open_fds_.begin(); it != open_fds_.end();
-            ++it) {
-        delete it->second;
-    }
+    int wait_ret = s.wait();
+    return wait_ret == 0 ? 0 : EIO;
 }
 
-asymmetricfs::fd_t asymmetricfs::next_fd() {
-    return next_++;
+/**
+ * Temporary files are named for the process creating them, so leftovers can
+ * be told from those of another mount of the same target still running.
+ */
+static const char temporary_prefix[] = ".asymmetricfs.";
+
+/**
+ * Returns a name for a temporary file, unique within this process.
+ */
+static std::string temporary_name() {
+    static std::atomic<unsigned> counter(0);
+    return temporary_prefix + std::to_string(getpid()) + "." +
+        std::to_string(counter++);
 }
 
-int asymmetricfs::chmod(const char *path_, mode_t mode) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+/**
+ * Returns true if name is that of a temporary file.
+ */
+static bool is_temporary(const char *name) {
+    return strncmp(name, temporary_prefix, sizeof(temporary_prefix) - 1) == 0;
+}
 
-    int ret = ::fchmodat(root_, relpath.c_str(), mode, 0);
-    if (ret != 0) {
-        return -errno;
+/**
+ * Returns true if name is that of a temporary file left behind by a process
+ * that is no longer running.
+ */
+static bool is_leftover(const char *name) {
+    if (!(is_temporary(name))) {
+        return false;
     }
 
-    return 0;
+    char *end;
+    errno = 0;
+    const unsigned long pid =
+        strtoul(name + sizeof(temporary_prefix) - 1, &end, 10);
+    if (errno != 0 || *end != '.' || pid == 0 ||
+            pid > static_cast<unsigned long>(INT_MAX)) {
+        return false;
+    }
+
+    return static_cast<pid_t>(pid) != getpid() &&
+        ::kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH;
 }
 
-int asymmetricfs::chown(const char *path_, uid_t u, gid_t g) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+/**
+ * Removes the leftover temporary files beneath the directory dir, which is
+ * closed.
+ */
+static void remove_leftovers(int dir) {
+    DIR *d = ::fdopendir(dir);
+    if (!(d)) {
+        ::close(dir);
+        return;
+    }
 
-    int ret = ::fchownat(root_, relpath.c_str(), u, g, 0);
-    if (ret != 0) {
-        return -errno;
+    struct dirent *entry;
+    while ((entry = ::readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0) {
+            continue;
+        } else if (is_leftover(entry->d_name)) {
+            (void) ::unlinkat(::dirfd(d), entry->d_name, 0);
+            continue;
+        }
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat s;
+            if (::fstatat(::dirfd(d), entry->d_name, &s,
+                    AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = IFTODT(s.st_mode);
+        }
+
+        if (type == DT_DIR) {
+            const int child = ::openat(::dirfd(d), entry->d_name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child >= 0) {
+                remove_leftovers(child);
+            }
+        }
     }
 
-    return 0;
+    ::closedir(d);
 }
 
-int asymmetricfs::create(const char *path_, mode_t mode,
-        struct fuse_file_info *info) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+/**
+ * Creates a new file in the directory dir, for writing ciphertext.  If the
+ * file could only be created with a name, it is returned in *name.
+ */
+static int create_temporary(int dir, std::string *name) {
+    name->clear();
 
-    info->flags |= O_CLOEXEC;
-    info->flags |= O_CREAT;
+    int fd = ::openat(dir, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
 
-    assert(info);
-    int ret;
     while (true) {
-        ret = ::openat(root_, relpath.c_str(), make_rdwr(info->flags), mode);
-        if (ret >= 0) {
-            break;
+        *name = temporary_name();
+        fd = ::openat(dir, name->c_str(),
+            O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
         }
+    }
+}
 
-        if (read_ && (info->flags & O_WRONLY) && errno == EACCES) {
-            ret = ::openat(root_, relpath.c_str(), info->flags, mode);
-            if (ret >= 0) {
-                break;
-            }
+/**
+ * Links fd, an anonymous file created by create_temporary, into the directory
+ * dir under a temporary name, which is returned in *name.  Returns 0 on
+ * success, otherwise the corresponding standard error code.
+ */
+static int link_temporary(int fd, int dir, std::string *name) {
+    const std::string self("/proc/self/fd/" + std::to_string(fd));
+    while (true) {
+        *name = temporary_name();
+        if (::linkat(AT_FDCWD, self.c_str(), dir, name->c_str(),
+                AT_SYMLINK_FOLLOW) == 0) {
+            return 0;
+        } else if (errno != EEXIST) {
+            name->clear();
+            return errno;
         }
+    }
+}
 
-        return -errno;
+/**
+ * Gives out the ownership, permissions and extended attributes of in, whose
+ * attributes are s.  Returns 0 on success, otherwise the corresponding
+ * standard error code.
+ */
+static int copy_attributes(int in, const struct stat& s, int out) {
+    if ((s.st_uid != geteuid() || s.st_gid != getegid()) &&
+            ::fchown(out, s.st_uid, s.st_gid) != 0) {
+        return errno;
     }
 
-    /* Update list of open files. */
-    scoped_lock l(mx_);
-    const fd_t fd = next_fd();
-    open_paths_.insert(std::make_pair(path, fd));
+    if (::fchmod(out, s.st_mode & 07777) != 0) {
+        return errno;
+    }
 
-    internal * data = new internal(options_);
-    data->fd            = ret;
-    data->flags         = info->flags;
-    data->path          = path;
-    data->references    = 1;
-    data->buffer_set    = true;
-    open_fds_  .insert(std::make_pair(fd, data));
+    #ifdef HAS_XATTR
+    ssize_t size = ::flistxattr(in, nullptr, 0);
+    if (size < 0) {
+        return errno == ENOTSUP ? 0 : errno;
+    }
 
-    info->fh = fd;
+    std::vector<char> names(static_cast<size_t>(size));
+    size = ::flistxattr(in, names.data(), names.size());
+    if (size < 0) {
+        return errno;
+    }
+
+    std::vector<char> value;
+    for (const char *name = names.data(); name < names.data() + size;
+            name += strlen(name) + 1) {
+        ssize_t n = ::fgetxattr(in, name, nullptr, 0);
+        if (n < 0) {
+            return errno;
+        }
+        value.resize(static_cast<size_t>(n));
+        n = ::fgetxattr(in, name, value.data(), value.size());
+        if (n < 0) {
+            return errno;
+        } else if (::fsetxattr(out, name, value.data(),
+                static_cast<size_t>(n), 0) != 0) {
+            return errno;
+        }
+    }
+    #else
+    (void) in;
+    #endif // HAS_XATTR
 
     return 0;
 }
 
-int asymmetricfs::ftruncate(const char *path, off_t offset,
+int asymmetricfs::internal::replace() {
+    std::string p;
+    {
+        scoped_lock l(fs_.mx_);
+        p = path;
+    }
+
+    directory_cache::resolved r;
+    int ret = fs_.parents_.resolve(p.c_str(), &r);
+    if (ret) {
+        return ret;
+    }
+
+    struct stat old_stat;
+    if (::fstat(fd, &old_stat) != 0) {
+        return errno;
+    }
+
+    /* r's descriptor is only good for lookups, so open one we can sync. */
+    const int dir = ::openat(r.fd(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) {
+        return errno;
+    }
+
+    std::string name;
+    const int out = create_temporary(r.fd(), &name);
+    if (out < 0) {
+        ret = errno;
+        ::close(dir);
+        return ret;
+    }
+
+    ret = encrypt(out, 0);
+    if (ret == 0) {
+        ret = copy_attributes(fd, old_stat, out);
+    }
+
+    if (ret == 0) {
+        /*
+         * Hold mx_, so the file is neither renamed nor unlinked through the
+         * mount point while we check that it is still the backing file.
+         */
+        scoped_lock l(fs_.mx_);
+
+        struct stat current;
+        if (::fstatat(r.fd(), r.name(), &current, AT_SYMLINK_NOFOLLOW) != 0 ||
+                current.st_dev != old_stat.st_dev ||
+                current.st_ino != old_stat.st_ino) {
+            ret = ESTALE;
+        } else if (name.empty() &&
+                (ret = link_temporary(out, r.fd(), &name)) != 0) {
+            /* /proc may not be mounted. */
+        } else if (::renameat(r.fd(), name.c_str(), r.fd(), r.name()) != 0) {
+            ret = errno;
+        } else {
+            name.clear();
+        }
+    }
+
+    if (ret != 0) {
+        if (!(name.empty())) {
+            (void) ::unlinkat(r.fd(), name.c_str(), 0);
+        }
+        ::close(out);
+        ::close(dir);
+        return ret;
+    }
+
+    /* Readers of the old ciphertext may continue to use it. */
+    ::close(fd);
+    fd = out;
+
+    if (replaced_in >= 0) {
+        ::close(replaced_in);
+    }
+    replaced_in = dir;
+
+    base = 0;
+    persisted = buffer.size();
+    dirty_from = SIZE_MAX;
+    dirty = false;
+    appended = 0;
+    return 0;
+}
+
+int asymmetricfs::internal::close() {
+    if (!(open_)) {
+        return 0;
+    }
+
+    /* Nothing needs the rest of the plaintext any longer. */
+    cancel_decryption();
+
+    int ret = checkpoint(true);
+
+    /* Keep the plaintext, now matching the ciphertext, for the next open. */
+    if (ret == 0 && buffer_set && !(dirty) && appended == 0 && fs_.read_) {
+        struct stat s;
+        if (::fstat(fd, &s) == 0) {
+            fs_.plaintext_.insert(s, buffer);
+        }
+    }
+
+    open_ = false;
+    if (replaced_in >= 0) {
+        ::close(replaced_in);
+        replaced_in = -1;
+    }
+    int close_ret = ::close(fd);
+    if (ret != 0) {
+        return ret;
+    } else if (close_ret == 0) {
+        return 0;
+    } else {
+        return errno;
+    }
+}
+
+bool asymmetricfs::internal::is_open() const {
+    return open_;
+}
+
+void asymmetricfs::internal::adjust_size(struct stat *s) const {
+    const size_t size = buffer.size();
+    if (buffer_set) {
+        s->st_size = static_cast<off_t>(size);
+    } else if (flags & O_APPEND) {
+        /* The first persisted bytes are counted in the ciphertext. */
+        s->st_size += size - persisted;
+    } /* else: leave st_size as-is. */
+}
+
+int asymmetricfs::internal::load_buffer(size_t needed) {
+    if (buffer_set) {
+        return 0;
+    }
+
+    assert(open_);
+
+    if (!(decrypting)) {
+        /* Save anything written so far, so it is decrypted with the rest. */
+        int ret = checkpoint(false);
+        if (ret != 0) {
+            return ret;
+        }
+
+        /* Clear the current buffer. */
+        buffer.clear();
+        base = 0;
+        persisted = 0;
+        appended = 0;
+
+        struct stat fd_stat;
+        ret = fstat(fd, &fd_stat);
+        if (ret != 0) {
+            return errno;
+        }
+
+        seen = fd_stat;
+        if (fd_stat.st_size <= 0) {
+            buffer_set = true;
+            return 0;
+        }
+
+        if (fs_.plaintext_.take(fd_stat, buffer)) {
+            buffer_set = true;
+            persisted = buffer.size();
+            return 0;
+        }
+
+        decrypting.reset(new decryption(
+            static_cast<size_t>(fd_stat.st_size), fs_.paused_decryptions_));
+    }
+
+    if (buffer.size() >= needed) {
+        return 0;
+    }
+
+    int ret;
+    decrypting->resume();
+    {
+        /* Each resumption is a job, which a request usually awaits. */
+        admission::slot slot(fs_.gpg_jobs_, user, speculative ?
+            admission::priority::background :
+            admission::priority::foreground);
+        ret = decrypt(needed);
+
+        /*
+         * Pausing holds gpg open outside of any slot, so once too many are
+         * paused, finish decrypting the file while we hold this one.
+         */
+        if (ret == 0 && decrypting->gpg &&
+                !(decrypting->pause(fs_.gpg_job_limit_))) {
+            ret = decrypt(SIZE_MAX);
+        }
+    }
+
+    if (ret == EINTR) {
+        /* The request was abandoned, but other readers may resume it. */
+        if (decrypting->gpg && !(decrypting->pause(fs_.gpg_job_limit_))) {
+            cancel_decryption();
+        }
+        return ret;
+    } else if (ret != 0) {
+        cancel_decryption();
+        return ret;
+    }
+
+    if (decrypting->finished()) {
+        decrypting.reset();
+        buffer_set = true;
+        persisted = buffer.size();
+    }
+    return 0;
+}
+
+void asymmetricfs::internal::cancel_decryption() {
+    if (!(decrypting)) {
+        return;
+    }
+
+    decrypting.reset();
+    buffer.clear();
+    fs_.cancelled_decryptions_++;
+}
+
+/**
+ * Reads size bytes of fd from offset into buffer.  Returns 0 on success, EIO
+ * if the file ends first, otherwise the corresponding standard error code.
+ */
+static int read_fully(int fd, uint8_t *buffer, size_t size, size_t offset) {
+    while (size > 0) {
+        const ssize_t ret = ::pread(fd, buffer, size,
+            static_cast<off_t>(offset));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        } else if (ret == 0) {
+            return EIO;
+        }
+
+        const size_t uret = static_cast<size_t>(ret);
+        buffer += uret;
+        size   -= uret;
+        offset += uret;
+    }
+
+    return 0;
+}
+
+int asymmetricfs::internal::decrypt(size_t needed) {
+    decryption& d = *decrypting;
+
+    /*
+     * Another process may have truncated or extended the ciphertext while the
+     * decryption was paused, so its blocks are no longer where we found them.
+     */
+    struct stat current;
+    if (::fstat(fd, &current) != 0) {
+        return errno;
+    } else if (static_cast<size_t>(current.st_size) != d.size) {
+        return ESTALE;
+    }
+
+    /* gpg does not react well to seeing multiple encrypted blocks in the same
+     * session, so the data needs to be chunked across multiple calls. */
+    const std::vector<std::string> argv =
+        options_.gpg_command({"-d", "--no-tty", "--batch"});
+
+    static const char terminator[]    = "-----END PGP MESSAGE-----\n";
+    static size_t     terminator_size = sizeof(terminator) - 1;
+
+    const size_t chunk_size = 1 << 20;
+    std::string receive_buffer;
+    while (buffer.size() < needed) {
+        if (!(d.gpg)) {
+            if (d.finished()) {
+                return 0;
+            }
+
+            /*
+             * Find terminator of gpg block, reading the ciphertext a chunk at
+             * a time.  Consecutive chunks overlap by less than a terminator,
+             * so one split between them is still found.  Trailing bytes too
+             * few to hold a block are ignored.
+             */
+            size_t new_offset =
+                d.size - d.offset < terminator_size ? d.offset : d.size;
+            d.block.resize(std::min(chunk_size, d.size - d.offset));
+            for (size_t start = d.offset; start + terminator_size <= d.size;) {
+                const size_t n = std::min(chunk_size, d.size - start);
+                int ret = read_fully(fd, d.block.data(), n, start);
+                if (ret != 0) {
+                    return ret;
+                }
+
+                const uint8_t *begin = d.block.data();
+                const uint8_t *end = begin + n;
+                const uint8_t *found = std::search(begin, end, terminator,
+                    terminator + terminator_size);
+                if (found != end) {
+                    new_offset = start + static_cast<size_t>(found - begin) +
+                        terminator_size;
+                    break;
+                } else if (start + n == d.size) {
+                    break;
+                }
+
+                start += n - (terminator_size - 1);
+            }
+            assert(d.offset <= new_offset);
+            assert(new_offset <= d.size);
+
+            int gpg_stdin;
+            if (d.offset == 0 && new_offset == d.size) {
+                /* Special case:  Single block. */
+                if (::lseek(fd, 0, SEEK_SET) < 0) {
+                    return errno;
+                }
+                gpg_stdin = fd;
+                std::vector<uint8_t>().swap(d.block);
+                d.input = nullptr;
+                d.input_size = 0;
+            } else {
+                gpg_stdin = -1;
+                d.input_size = new_offset - d.offset;
+
+                if (d.input_size == 0) {
+                    d.offset = d.size;
+                    return 0;
+                }
+
+                d.block.resize(d.input_size);
+                int ret = read_fully(fd, d.block.data(), d.input_size,
+                    d.offset);
+                if (ret != 0) {
+                    return ret;
+                }
+                d.input = d.block.data();
+            }
+
+            d.offset = new_offset;
+            d.gpg.reset(new subprocess(gpg_stdin, -1, options_.gpg_path, argv,
+                speculative ? options_.background : options_.foreground));
+        }
+
+        if (!(speculative) && fs_.interrupted_()) {
+            return EINTR;
+        }
+
+        /* Only ask gpg for what is needed, so it can be paused after. */
+        const size_t wanted = std::min(chunk_size, needed - buffer.size());
+        receive_buffer.resize(wanted);
+
+        size_t unread = wanted;
+        size_t unwritten = d.input_size;
+        int cret = d.gpg->communicate(&receive_buffer[0], &unread,
+            d.input, &unwritten);
+        if (cret != 0) {
+            return cret;
+        }
+
+        buffer.write(wanted - unread, buffer.size(), &receive_buffer[0]);
+        if (d.input) {
+            d.input += d.input_size - unwritten;
+            d.input_size = unwritten;
+        }
+
+        if (unread == wanted) {
+            /* gpg has finished the block. */
+            const int wait = d.gpg->wait();
+            d.gpg.reset();
+            std::vector<uint8_t>().swap(d.block);
+            if (wait != 0) {
+                return EIO;
+            }
+        }
+    }
+
+    return 0;
+}
+
+const memory_lock asymmetricfs::memory_lock_default = memory_lock::all;
+
+const int asymmetricfs::background_nice_default = 10;
+const int asymmetricfs::background_io_level_default = 7;
+
+asymmetricfs::options::options() : trust_recipients(false), gpg_path("gpg"),
+        mlock(memory_lock_default) {
+    background.nice = background_nice_default;
+    background.io_level = background_io_level_default;
+}
+
+/**
+ * One job per processor.
+ */
+static unsigned default_jobs() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::vector<std::string> asymmetricfs::options::gpg_command(
+        std::initializer_list<std::string> arguments) const {
+    std::vector<std::string> argv{"gpg"};
+    argv.insert(argv.end(), gpg_arguments.begin(), gpg_arguments.end());
+    argv.insert(argv.end(), arguments);
+    return argv;
+}
+
+const size_t asymmetricfs::directory_cache_default = 256;
+
+/**
+ * The most files the access manifest counts opens of, so a scan through a
+ * huge tree cannot grow it without bound.
+ */
+static const size_t access_manifest_capacity = 1 << 16;
+const unsigned asymmetricfs::fsync_window_default = 2000;
+
+asymmetricfs::asymmetricfs() : read_(false), read_only_(false),
+    raw_view_(false), root_set_(false), root_(-1),
+    parents_(-1, directory_cache_default),
+    flush_jobs_(0), failed_flushes_(0),
+    syncs_(std::chrono::microseconds(fsync_window_default)),
+    gpg_jobs_(default_jobs(), 0), gpg_job_limit_(default_jobs()),
+    requester_(::geteuid),
+    interrupted_([]() { return false; }), cancelled_decryptions_(0),
+    paused_decryptions_(0),
+    plaintext_(0, std::chrono::milliseconds(0)),
+    watcher_([this](const std::string& path, bool is_directory) {
+        backing_changed(path, is_directory);
+    }, [this]() { backing_overflowed(); }),
+    pressure_([this]() { drop_plaintext(); }), prefetching_(false),
+    prefetch_ttl_(0), prefetch_([this](const std::string& path, uid_t user) {
+        (void) prefetch(path, user, prefetch_ttl_);
+    }, [this](const std::string& dir) { return list_files(dir); }),
+    manifest_files_(0), accesses_(access_manifest_capacity),
+    manifest_loaded_(false), warmup_stopping_(false), next_(0),
+    next_dir_(0) { }
+
+asymmetricfs::~asymmetricfs() {
+    watcher_.stop();
+    pressure_.stop();
+    prefetch_.stop();
+    stop_warmup();
+
+    if (root_set_) {
+        ::close(root_);
+    }
+
+    for (const auto& raw : raw_fds_) {
+        ::close(raw.second);
+    }
+
+    /* Closing the remaining files encrypts any unsaved changes. */
+    shared_paths_.clear();
+    open_paths_.clear();
+    open_fds_.clear();
+}
+
+asymmetricfs::fd_t asymmetricfs::next_fd() {
+    return next_++;
+}
+
+asymmetricfs::internal_ptr asymmetricfs::find_file(fd_t fd) {
+    scoped_lock l(mx_);
+    auto it = open_fds_.find(fd);
+    if (it == open_fds_.end()) {
+        return internal_ptr();
+    }
+
+    return it->second;
+}
+
+void asymmetricfs::wait_idle(scoped_lock& l, const char *path) {
+    const path_ref p(path);
+    while (busy_paths_.count(p)) {
+        busy_cv_.wait(l);
+    }
+}
+
+void asymmetricfs::finish_busy(const internal_ptr& file) {
+    scoped_lock l(mx_);
+    auto it = busy_paths_.find(path_ref(file->path));
+    if (it != busy_paths_.end() && it->second == file) {
+        busy_paths_.erase(it);
+    }
+    busy_cv_.notify_all();
+}
+
+int asymmetricfs::chmod(const char *path, mode_t mode) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    ret = ::fchmodat(r.fd(), r.name(), mode, 0);
+    if (ret != 0) {
+        return -errno;
+    }
+
+    /* Cached descriptors would bypass the new search permissions. */
+    parents_.invalidate(path);
+    return 0;
+}
+
+int asymmetricfs::chown(const char *path, uid_t u, gid_t g) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    ret = ::fchownat(r.fd(), r.name(), u, g, 0);
+    if (ret != 0) {
+        return -errno;
+    }
+
+    parents_.invalidate(path);
+    return 0;
+}
+
+int asymmetricfs::create(const char *path, mode_t mode,
+        struct fuse_file_info *info) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    info->flags |= O_CLOEXEC;
+    info->flags |= O_CREAT;
+
+    assert(info);
+    while (true) {
+        ret = ::openat(r.fd(), r.name(), make_rdwr(info->flags), mode);
+        if (ret >= 0) {
+            break;
+        }
+
+        if (read_ && (info->flags & O_WRONLY) && errno == EACCES) {
+            ret = ::openat(r.fd(), r.name(), info->flags, mode);
+            if (ret >= 0) {
+                break;
+            }
+        }
+
+        return -errno;
+    }
+
+    /* Update list of open files. */
+    scoped_lock l(mx_);
+    const fd_t fd = next_fd();
+
+    internal_ptr data = std::make_shared<internal>(*this);
+    data->fd            = ret;
+    data->flags         = info->flags;
+    data->path          = path;
+    data->references    = 1;
+    data->buffer_set    = true;
+    data->note_backing();
+    open_fds_  .insert(std::make_pair(fd, data));
+    open_paths_.insert(std::make_pair(path_ref(data->path), fd));
+
+    info->fh = fd;
+
+    return 0;
+}
+
+int asymmetricfs::ftruncate(const char *path, off_t offset,
         struct fuse_file_info *info) {
     (void) path;
     assert(info);
 
-    scoped_lock l(mx_);
-    return truncatefd(info->fh, offset);
+    if (read_only_) {
+        return -EROFS;
+    }
+
+    internal_ptr file = find_file(info->fh);
+    if (!(file)) {
+        return -EBADF;
+    }
+
+    return truncate_file(*file, offset);
+}
+
+int asymmetricfs::truncate_file(internal& file, off_t offset) {
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    scoped_lock l(file.mx);
+    if (!(file.is_open())) {
+        return -ESTALE;
+    } else if (offset == 0) {
+        /*
+         * Nothing remains to decrypt.  A paused gpg would otherwise go on to
+         * append the old plaintext, from the ciphertext we are removing.
+         */
+        file.cancel_decryption();
+
+        int ret = ::ftruncate(file.fd, 0);
+        if (ret != 0) {
+            return -errno;
+        } else {
+            file.buffer.resize(0);
+            file.base = 0;
+            file.persisted = 0;
+            file.appended = 0;
+            file.modified(0);
+            return 0;
+        }
+    } else if (read_) {
+        /* Decrypt, truncate, (lazily) reencrypt. */
+        int ret = file.load_buffer();
+        if (ret != 0) {
+            return -ret;
+        } else {
+            const size_t size = static_cast<size_t>(offset);
+            file.modified(std::min(size, file.buffer.size()));
+            file.buffer.resize(size);
+            return 0;
+        }
+    } else {
+        return -EACCES;
+    }
+}
+
+asymmetricfs::connection_options::connection_options() :
+    max_write(1 << 17), max_readahead(1 << 17), async_read(true),
+    big_writes(true), splice(true) {}
+
+void asymmetricfs::set_connection_options(const connection_options& c) {
+    connection_ = c;
+}
+
+/**
+ * Requests capability if the kernel offers it and enabled is set, otherwise
+ * withdraws any request for it.
+ */
+static void want_capability(struct fuse_conn_info *conn, unsigned capability,
+        bool enabled) {
+    if (enabled && (conn->capable & capability)) {
+        conn->want |= capability;
+    } else {
+        conn->want &= ~capability;
+    }
+}
+
+void* asymmetricfs::init(struct fuse_conn_info *conn) {
+    /*
+     * Without O_TMPFILE, ciphertext is written to named temporary files,
+     * which a crash can leave behind.
+     */
+    if (root_set_ && !(read_only_)) {
+        const int dir = ::openat(root_, ".",
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir >= 0) {
+            remove_leftovers(dir);
+        }
+    }
+
+    if (!(conn)) {
+        return NULL;
+    }
+
+    /* libfuse clamps max_write to its own buffer size after init returns. */
+    if (connection_.max_write > 0) {
+        conn->max_write = connection_.max_write;
+    }
+
+    /* The kernel's proposed readahead is a maximum, so we can only lower it. */
+    if (connection_.max_readahead > 0) {
+        conn->max_readahead =
+            std::min(conn->max_readahead, connection_.max_readahead);
+    }
+
+    conn->async_read = connection_.async_read;
+    want_capability(conn, FUSE_CAP_ASYNC_READ, connection_.async_read);
+
+    /* Without big writes, the kernel issues writes a page at a time,
+     * regardless of max_write. */
+    want_capability(conn, FUSE_CAP_BIG_WRITES, connection_.big_writes);
+
+    /*
+     * Splicing replies to the FUSE device lets read_buf hand over backing
+     * descriptors without copying.  SPLICE_MOVE is not requested, as it would
+     * let the kernel steal pages from our (locked) buffers.
+     */
+    want_capability(conn, FUSE_CAP_SPLICE_WRITE, connection_.splice);
+    want_capability(conn, FUSE_CAP_SPLICE_READ, connection_.splice);
+    want_capability(conn, FUSE_CAP_SPLICE_MOVE, false);
+
+    return NULL;
+}
+
+void asymmetricfs::destroy(void *private_data) {
+    (void) private_data;
+
+    /* Files are about to be rewritten by us, not others. */
+    watcher_.stop();
+    pressure_.stop();
+    prefetch_.stop();
+    stop_warmup();
+
+    if (!(manifest_path_.empty()) && read_) {
+        const int ret = save_manifest();
+        if (ret != 0) {
+            std::cerr << "asymmetricfs: unable to save the access manifest: "
+                      << strerror(ret) << std::endl;
+        }
+    }
+
+    const admission::statistics gpg = gpg_jobs_.stats();
+    if (gpg.waited > 0) {
+        std::cerr << "asymmetricfs: " << gpg.waited << " of " << gpg.admitted
+                  << " gpg job(s) waited to run, for "
+                  << gpg.total_wait.count() / 1000 / gpg.waited
+                  << " ms on average and " << gpg.max_wait.count() / 1000
+                  << " ms at most, with at most " << gpg.max_queued
+                  << " waiting at once." << std::endl;
+    }
+
+    const plaintext_cache::statistics cache = plaintext_.stats();
+    if (cache.insertions > 0) {
+        std::cerr << "asymmetricfs: the plaintext cache served " << cache.hits
+                  << " of " << cache.hits + cache.misses << " open(s) "
+                  << "needing decryption; " << cache.evictions
+                  << " entries were evicted, " << cache.expirations
+                  << " expired and " << cache.invalidations
+                  << " were out of date." << std::endl;
+    }
+
+    if (cache.prefetched > 0) {
+        std::cerr << "asymmetricfs: " << cache.prefetch_hits << " of "
+                  << cache.prefetched << " prefetched file(s) were opened, "
+                  << "and " << cache.prefetch_wasted << " went unused."
+                  << std::endl;
+    }
+
+    /* No requests remain, so take every open file out of circulation. */
+    std::vector<internal_ptr> files;
+    {
+        scoped_lock l(mx_);
+        for (const auto& it : open_fds_) {
+            it.second->references = 0;
+            files.push_back(it.second);
+        }
+
+        open_paths_.clear();
+        open_fds_.clear();
+    }
+
+    /* Unmodified files can be closed immediately. */
+    std::vector<internal_ptr> dirty;
+    for (const auto& file : files) {
+        scoped_lock fl(file->mx);
+        if (file->dirty) {
+            dirty.push_back(file);
+        } else {
+            (void) file->close();
+        }
+    }
+    files.clear();
+
+    const size_t n_dirty = dirty.size();
+    if (n_dirty == 0) {
+        return;
+    }
+
+    unsigned n_jobs = flush_jobs_;
+    if (n_jobs == 0) {
+        n_jobs = default_jobs();
+    }
+    n_jobs = static_cast<unsigned>(std::min<size_t>(n_jobs, n_dirty));
+
+    std::cerr << "asymmetricfs: saving " << n_dirty << " modified file(s) "
+              << "with " << n_jobs << " job(s)." << std::endl;
+
+    /* Each job claims the next file in turn. */
+    std::mutex report_mx;
+    size_t next = 0, done = 0, failed = 0;
+    auto job = [&]() {
+        while (true) {
+            internal_ptr file;
+            {
+                scoped_lock l(report_mx);
+                if (next == n_dirty) {
+                    return;
+                }
+                file = dirty[next++];
+            }
+
+            int ret;
+            {
+                scoped_lock fl(file->mx);
+                ret = file->close();
+            }
+
+            scoped_lock l(report_mx);
+            done++;
+            if (ret == 0) {
+                std::cerr << "asymmetricfs: saved " << file->path << " ("
+                          << done << "/" << n_dirty << ")" << std::endl;
+            } else {
+                failed++;
+                std::cerr << "asymmetricfs: failed to save " << file->path
+                          << ": " << strerror(std::abs(ret)) << " (" << done
+                          << "/" << n_dirty << ")" << std::endl;
+                /* Once daemonized, standard error goes nowhere. */
+                syslog(LOG_ERR, "failed to save %s: %s", file->path.c_str(),
+                    strerror(std::abs(ret)));
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < n_jobs; i++) {
+        threads.emplace_back(job);
+    }
+    job();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (failed > 0) {
+        std::cerr << "asymmetricfs: " << failed << " of " << n_dirty
+                  << " modified file(s) could not be saved." << std::endl;
+        syslog(LOG_ERR, "%zu of %zu modified file(s) could not be saved",
+            failed, n_dirty);
+    }
+
+    scoped_lock l(mx_);
+    failed_flushes_ += failed;
+}
+
+void asymmetricfs::set_flush_jobs(unsigned jobs) {
+    flush_jobs_ = jobs;
+}
+
+size_t asymmetricfs::failed_flushes() const {
+    scoped_lock l(mx_);
+    return failed_flushes_;
+}
+
+bool asymmetricfs::ready() const {
+    return root_set_ && !(options_.recipients.empty());
+}
+
+void asymmetricfs::set_gpg_jobs(unsigned jobs, unsigned per_user) {
+    gpg_job_limit_ = jobs == 0 ? default_jobs() : jobs;
+    gpg_jobs_.set_limits(gpg_job_limit_, per_user);
+}
+
+admission::statistics asymmetricfs::gpg_statistics() const {
+    return gpg_jobs_.stats();
+}
+
+void asymmetricfs::set_background_priority(int nice, int io_level) {
+    options_.background.nice = nice;
+    options_.background.io_level = io_level;
+}
+
+asymmetricfs::placement::placement() : cpu_weight(0) {}
+
+int asymmetricfs::set_placement(admission::priority p,
+        const placement& where) {
+    const bool foreground = p == admission::priority::foreground;
+    cgroup& group = foreground ? foreground_cgroup_ : background_cgroup_;
+    subprocess::scheduling& sched =
+        foreground ? options_.foreground : options_.background;
+
+    if (!(where.cpus.empty())) {
+        int ret = parse_cpu_list(where.cpus, &sched.cpus);
+        if (ret) {
+            return ret;
+        }
+        sched.pin = true;
+    }
+
+    if (!(where.cgroup_path.empty())) {
+        int ret = group.open(where.cgroup_path);
+        if (ret) {
+            return ret;
+        }
+
+        if (where.cpu_weight != 0) {
+            ret = group.set_cpu_weight(where.cpu_weight);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        if (!(where.cpu_max.empty())) {
+            ret = group.set_cpu_max(where.cpu_max);
+            if (ret) {
+                return ret;
+            }
+        }
+
+        sched.cgroup_procs = group.procs();
+    }
+
+    return 0;
+}
+
+void asymmetricfs::set_requester(const requester& callback) {
+    requester_ = callback;
+}
+
+void asymmetricfs::set_interruption(const interruption& callback) {
+    interrupted_ = callback;
+}
+
+uint64_t asymmetricfs::cancelled_decryptions() const {
+    return cancelled_decryptions_;
+}
+
+void asymmetricfs::set_plaintext_cache(size_t bytes,
+        std::chrono::milliseconds ttl) {
+    plaintext_.set_limits(bytes, ttl);
+}
+
+plaintext_cache::statistics asymmetricfs::plaintext_statistics() const {
+    return plaintext_.stats();
 }
 
-int asymmetricfs::truncatefd(fd_t fd, off_t offset) {
-    auto it = open_fds_.find(fd);
-    if (it == open_fds_.end()) {
-        return -EBADF;
+void asymmetricfs::drop_plaintext() {
+    plaintext_.clear();
+}
+
+int asymmetricfs::watch_memory_pressure(std::chrono::milliseconds stall) {
+    return pressure_.start(stall, std::chrono::seconds(2));
+}
+
+void asymmetricfs::set_prefetch(unsigned depth,
+        std::chrono::milliseconds ttl) {
+    prefetching_ = depth > 0;
+    prefetch_ttl_ = ttl;
+    prefetch_.set_limits(depth, std::min(depth, default_jobs()));
+}
+
+prefetcher::statistics asymmetricfs::prefetch_statistics() const {
+    return prefetch_.stats();
+}
+
+void asymmetricfs::opened(const char *path) {
+    if (!(read_)) {
+        return;
     }
 
-    if (offset < 0) {
-        return -EINVAL;
-    } else if (offset == 0) {
-        int ret = ::ftruncate(it->second->fd, 0);
-        if (ret != 0) {
-            return -errno;
-        } else {
-            it->second->buffer.resize(0);
-            it->second->dirty = true;
-            return 0;
+    if (!(manifest_path_.empty())) {
+        accesses_.record(path);
+    }
+    if (prefetching_) {
+        prefetch_.opened(path, requester_());
+    }
+}
+
+bool asymmetricfs::prefetch(const std::string& path, uid_t user,
+        std::chrono::milliseconds ttl) {
+    {
+        /* Open files have their own plaintext. */
+        scoped_lock l(mx_);
+        const path_ref p(path);
+        if (open_paths_.count(p) || shared_paths_.count(p) ||
+                busy_paths_.count(p)) {
+            return true;
         }
-    } else if (read_) {
-        /* Decrypt, truncate, (lazily) reencrypt. */
-        int ret = it->second->load_buffer();
-        if (ret != 0) {
-            return -ret;
-        } else {
-            it->second->buffer.resize(static_cast<size_t>(offset));
-            it->second->dirty = true;
-            return 0;
+    }
+
+    directory_cache::resolved r;
+    if (parents_.resolve(path.c_str(), &r) != 0) {
+        return true;
+    }
+
+    /* Do not wait on a FIFO that is listed alongside the files. */
+    const int fd = ::openat(r.fd(), r.name(),
+        O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+
+    struct stat s;
+    if (::fstat(fd, &s) != 0 || !(S_ISREG(s.st_mode)) || s.st_size == 0 ||
+            plaintext_.contains(s)) {
+        ::close(fd);
+        return true;
+    }
+
+    internal file(*this, user);
+    file.fd = fd;
+    file.flags = O_RDONLY;
+    file.path = path;
+    file.speculative = true;
+
+    bool fit = true;
+    scoped_lock fl(file.mx);
+    if (file.load_buffer() == 0 && file.buffer_set) {
+        fit = plaintext_.insert_prefetched(file.seen, file.buffer, ttl);
+        /* Otherwise, closing the file would cache the emptied buffer. */
+        file.buffer_set = false;
+    }
+    (void) file.close();
+    return fit;
+}
+
+std::vector<std::string> asymmetricfs::list_files(const std::string& dir) {
+    std::vector<std::string> names;
+
+    directory_cache::resolved r;
+    if (parents_.resolve(dir.c_str(), &r) != 0) {
+        return names;
+    }
+
+    const int fd = ::openat(r.fd(), r.name(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return names;
+    }
+
+    DIR *d = ::fdopendir(fd);
+    if (!(d)) {
+        ::close(fd);
+        return names;
+    }
+
+    while (const struct dirent *e = ::readdir(d)) {
+        if (e->d_type == DT_REG || e->d_type == DT_UNKNOWN) {
+            names.push_back(e->d_name);
         }
-    } else {
-        return -EACCES;
     }
+    ::closedir(d);
+    return names;
 }
 
-void* asymmetricfs::init(struct fuse_conn_info *conn) {
-    (void) conn;
+void asymmetricfs::set_warmup_manifest(const std::string& path,
+        size_t files) {
+    manifest_path_ = path;
+    manifest_files_ = files;
+}
 
-    return NULL;
+int asymmetricfs::warm_up(std::chrono::milliseconds ttl) {
+    if (manifest_path_.empty() || !(read_) || warmup_.joinable()) {
+        return EINVAL;
+    }
+
+    warmup_stopping_ = false;
+    warmup_ = std::thread(&asymmetricfs::replay, this, ttl);
+    return 0;
 }
 
-bool asymmetricfs::ready() const {
-    return root_set_ && !(options_.recipients.empty());
+void asymmetricfs::stop_warmup() {
+    warmup_stopping_ = true;
+    if (warmup_.joinable()) {
+        warmup_.join();
+    }
+}
+
+void asymmetricfs::load_manifest() {
+    if (manifest_loaded_) {
+        return;
+    }
+    manifest_loaded_ = true;
+
+    const int fd = ::open(manifest_path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        /* Until one is saved, there is nothing to replay. */
+        if (errno != ENOENT) {
+            std::cerr << "asymmetricfs: unable to open the access manifest: "
+                      << strerror(errno) << std::endl;
+        }
+        return;
+    }
+
+    /* We run outside of any request, so there is no requester to ask. */
+    internal file(*this, ::geteuid());
+    file.fd = fd;
+    file.flags = O_RDONLY;
+    file.path = manifest_path_;
+    file.speculative = true;
+
+    scoped_lock fl(file.mx);
+    int ret = file.load_buffer();
+    if (ret == 0) {
+        std::string text(file.buffer.size(), '\0');
+        file.buffer.read(text.size(), 0, &text[0]);
+        if (!(accesses_.merge(text))) {
+            ret = EINVAL;
+        }
+    }
+
+    /* The manifest is not a file of the filesystem to be cached. */
+    file.buffer.wipe();
+    file.buffer_set = false;
+    (void) file.close();
+
+    if (ret != 0) {
+        std::cerr << "asymmetricfs: unable to read the access manifest: "
+                  << strerror(ret) << std::endl;
+    }
+}
+
+void asymmetricfs::replay(std::chrono::milliseconds ttl) {
+    load_manifest();
+
+    const std::vector<std::string> paths =
+        accesses_.hottest(manifest_files_);
+    const uid_t user = ::geteuid();
+    std::atomic<size_t> next(0);
+    std::atomic<bool> full(false);
+
+    /* Each job decrypts the next hottest file, until the cache is full. */
+    auto work = [&]() {
+        while (!(warmup_stopping_) && !(full)) {
+            const size_t i = next++;
+            if (i >= paths.size()) {
+                return;
+            }
+
+            if (!(prefetch(paths[i], user, ttl))) {
+                full = true;
+            }
+        }
+    };
+
+    const size_t n_jobs = std::min<size_t>(gpg_job_limit_, paths.size());
+    std::vector<std::thread> jobs;
+    for (size_t i = 1; i < n_jobs; i++) {
+        jobs.emplace_back(work);
+    }
+    work();
+
+    for (auto& job : jobs) {
+        job.join();
+    }
+}
+
+int asymmetricfs::save_manifest() {
+    /* Keep the counts of earlier mounts, even if they were not replayed. */
+    load_manifest();
+    const std::string text = accesses_.serialize(manifest_files_);
+
+    /* Write a new manifest alongside, so the old one is never torn. */
+    const std::string temporary = manifest_path_ + ".tmp";
+    const int fd = ::open(temporary.c_str(),
+        O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return errno;
+    }
+
+    internal file(*this, ::geteuid());
+    file.fd = fd;
+    file.flags = O_WRONLY;
+    file.path = manifest_path_;
+
+    int ret;
+    {
+        scoped_lock fl(file.mx);
+        file.buffer.write(text.size(), 0, text.data());
+        ret = file.encrypt(fd, 0);
+        file.buffer.wipe();
+
+        if (ret == 0 && ::fsync(fd) != 0) {
+            ret = errno;
+        }
+
+        const int close_ret = file.close();
+        if (ret == 0) {
+            ret = close_ret;
+        }
+    }
+
+    if (ret == 0 &&
+            ::rename(temporary.c_str(), manifest_path_.c_str()) != 0) {
+        ret = errno;
+    }
+    if (ret != 0) {
+        ::unlink(temporary.c_str());
+    }
+    return ret;
+}
+
+int asymmetricfs::watch_target() {
+    if (!(root_set_)) {
+        return EBADF;
+    }
+
+    return watcher_.start(root_);
+}
+
+/**
+ * Returns true if a and b describe the same version of the same file.
+ */
+static bool same_version(const struct stat& a, const struct stat& b) {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+        a.st_size == b.st_size &&
+        a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+        a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+        a.st_ctim.tv_sec == b.st_ctim.tv_sec &&
+        a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+void asymmetricfs::backing_changed(const std::string& relpath,
+        bool is_directory) {
+    const std::string path = "/" + relpath;
+    if (is_directory) {
+        /* Cached descriptors may now lead elsewhere. */
+        parents_.invalidate(path.c_str());
+        return;
+    }
+
+    struct stat s;
+    const bool exists =
+        ::fstatat(root_, relpath.c_str(), &s, AT_SYMLINK_NOFOLLOW) == 0;
+    if (exists) {
+        plaintext_.revalidate(s);
+    }
+
+    internal_ptr file;
+    {
+        scoped_lock l(mx_);
+        auto it = open_paths_.find(path_ref(path));
+        if (it != open_paths_.end()) {
+            auto jt = open_fds_.find(it->second);
+            assert(jt != open_fds_.end());
+            file = jt->second;
+        }
+    }
+
+    if (file && read_) {
+        scoped_lock fl(file->mx);
+        const bool cached = file->buffer_set || file->decrypting ||
+            file->persisted > 0;
+        /*
+         * Our own changes leave the backing file as we saw it last.  Unsaved
+         * changes are kept, and will overwrite the backing file.
+         */
+        if (file->is_open() && cached && !(file->dirty) &&
+                !(exists && same_version(s, file->seen))) {
+            file->discard();
+
+            struct stat current;
+            if (exists && ::fstat(file->fd, &current) == 0 &&
+                    current.st_ino != s.st_ino) {
+                /* The backing file was replaced, so follow it. */
+                const int fd = reopen(path, file->flags);
+                if (fd >= 0) {
+                    ::close(file->fd);
+                    file->fd = fd;
+                }
+            }
+        }
+    }
+}
+
+int asymmetricfs::reopen(const std::string& path, int flags) {
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path.c_str(), &r);
+    if (ret) {
+        errno = ret;
+        return -1;
+    }
+
+    flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
+    ret = ::openat(r.fd(), r.name(), make_rdwr(flags));
+    if (ret < 0 && errno == EACCES) {
+        ret = ::openat(r.fd(), r.name(), flags);
+    }
+    return ret;
+}
+
+void asymmetricfs::backing_overflowed() {
+    /* Changes went unreported, so trust nothing we kept. */
+    plaintext_.clear();
+    parents_.invalidate("/");
+
+    std::vector<std::string> paths;
+    {
+        scoped_lock l(mx_);
+        for (const auto& it : open_paths_) {
+            paths.push_back(std::string(it.first.data(), it.first.size()));
+        }
+    }
+
+    for (const auto& path : paths) {
+        backing_changed(path.substr(1), false);
+    }
+}
+
+void asymmetricfs::set_fsync_window(unsigned microseconds) {
+    syncs_.set_window(std::chrono::microseconds(microseconds));
 }
 
 void asymmetricfs::set_gpg(const std::string& gpg_path) {
     options_.gpg_path = gpg_path;
 }
 
+void asymmetricfs::set_gpg_arguments(
+        const std::vector<std::string>& arguments) {
+    options_.gpg_arguments = arguments;
+}
+
 void asymmetricfs::set_mlock(memory_lock m) {
     options_.mlock = m;
 }
 
-void asymmetricfs::set_read(bool r) {
-    read_ = r;
-}
+void asymmetricfs::set_raw_view(bool raw_view) {
+    raw_view_ = raw_view;
+}
+
+void asymmetricfs::set_directory_cache(size_t entries) {
+    parents_.set_capacity(entries);
+}
+
+void asymmetricfs::set_read(bool r) {
+    read_ = r;
+}
+
+void asymmetricfs::set_read_only(bool read_only) {
+    read_only_ = read_only;
+    if (read_only) {
+        read_ = true;
+    }
+}
+
+bool asymmetricfs::set_target(const std::string & target) {
+    if (target.empty()) {
+        return false;
+    }
+
+    if (root_set_) {
+        ::close(root_);
+        root_set_ = false;
+    }
+
+    root_ = ::open(target.c_str(), O_CLOEXEC | O_DIRECTORY);
+    parents_.reset(root_);
+    return (root_set_ = (root_ >= 0));
+}
+
+void asymmetricfs::set_recipients(
+        const std::vector<gpg_recipient> & recipients) {
+    /*
+     * We guarantee the lifetime of the recipient list to
+     * asymmetricfs::internal, so reject changes if there are outstanding
+     * files.
+     */
+    scoped_lock l(mx_);
+    if (!(open_fds_.empty()) || !(busy_paths_.empty())) {
+        throw std::runtime_error("Changing recipient list with open files.");
+    }
+
+    options_.recipients = recipients;
+    options_.trust_recipients = !(recipients.empty()) &&
+        std::all_of(recipients.begin(), recipients.end(),
+            [](const gpg_recipient& r) { return r.explicit_fingerprint(); });
+}
+
+int asymmetricfs::fgetattr(const char *path, struct stat *buf,
+        struct fuse_file_info *info) {
+    (void) path;
+
+    if (read_only_) {
+        if (!(buf)) {
+            return -EFAULT;
+        }
+
+        const shared_handle *h = find_shared(info);
+        struct stat s;
+        if (::fstat(h->file ? h->file->fd : h->raw_fd, &s) != 0) {
+            return -errno;
+        }
+
+        if (h->file) {
+            /* Report the version of the file this handle reads. */
+            h->file->adjust_size(&s);
+        }
+        clear_write_bits(&s);
+        *buf = s;
+        return 0;
+    }
+
+    scoped_lock l(mx_);
+    auto it = raw_fds_.find(info->fh);
+    if (it != raw_fds_.end()) {
+        if (!(buf)) {
+            return -EFAULT;
+        }
+
+        struct stat s;
+        const int ret = ::fstat(it->second, &s);
+        if (ret != 0) {
+            return -errno;
+        }
+
+        clear_write_bits(&s);
+        *buf = s;
+        return 0;
+    }
+
+    auto jit = open_fds_.find(info->fh);
+    if (jit == open_fds_.end()) {
+        return -EBADF;
+    }
+    internal_ptr file = jit->second;
+    l.unlock();
+
+    return stat_file(*file, buf);
+}
+
+int asymmetricfs::flush(const char *path, struct fuse_file_info *info) {
+    (void) path;
+    assert(info);
+
+    if (read_only_) {
+        return 0;
+    }
+
+    scoped_lock l(mx_);
+    if (raw_fds_.count(info->fh)) {
+        return 0;
+    }
+
+    auto it = open_fds_.find(info->fh);
+    if (it == open_fds_.end()) {
+        return -EBADF;
+    }
+    internal_ptr file = it->second;
+    l.unlock();
+
+    /*
+     * Encrypting as each descriptor is closed lets close(2) report failures,
+     * and leaves little for release to do.
+     */
+    scoped_lock fl(file->mx);
+    if (!(file->is_open())) {
+        return 0;
+    }
+
+    return -file->checkpoint(true);
+}
+
+int asymmetricfs::sync_parent(internal& file) {
+    if (file.replaced_in < 0) {
+        return 0;
+    }
+
+    if (::fsync(file.replaced_in) != 0) {
+        return errno;
+    }
+
+    ::close(file.replaced_in);
+    file.replaced_in = -1;
+    return 0;
+}
+
+int asymmetricfs::fsync(const char *path, int datasync,
+        struct fuse_file_info *info) {
+    (void) path;
+    assert(info);
 
-bool asymmetricfs::set_target(const std::string & target) {
-    if (target.empty()) {
-        return false;
+    if (read_only_) {
+        return 0;
     }
 
-    if (root_set_) {
-        ::close(root_);
-        root_set_ = false;
+    scoped_lock l(mx_);
+    if (raw_fds_.count(info->fh)) {
+        return 0;
     }
 
-    root_ = ::open(target.c_str(), O_CLOEXEC | O_DIRECTORY);
-    return (root_set_ = (root_ >= 0));
-}
+    auto it = open_fds_.find(info->fh);
+    if (it == open_fds_.end()) {
+        return -EBADF;
+    }
+    internal_ptr file = it->second;
+    l.unlock();
 
-void asymmetricfs::set_recipients(
-        const std::vector<gpg_recipient> & recipients) {
     /*
-     * We guarantee the lifetime of the recipient list to
-     * asymmetricfs::internal, so reject changes if there are outstanding
-     * files.
+     * Checkpoint the file, leaving it open.  Appending only what was written
+     * past the encrypted contents keeps this cheap for logs and journals.
      */
-    if (!(open_fds_.empty())) {
-        throw std::runtime_error("Changing recipient list with open files.");
+    scoped_lock fl(file->mx);
+    if (!(file->is_open())) {
+        /* release saved the file meanwhile. */
+        return 0;
     }
 
-    options_.recipients = recipients;
-}
+    /*
+     * Join the next group commit before encrypting, so the files fsynced
+     * concurrently are encrypted in parallel and then synced together.
+     */
+    group_commit::participant commit(syncs_);
 
-int asymmetricfs::fgetattr(const char *path, struct stat *buf,
-        struct fuse_file_info *info) {
-    (void) path;
+    int ret = file->checkpoint(false);
+    if (ret != 0) {
+        return -ret;
+    }
 
-    scoped_lock l(mx_);
-    return statfd(info->fh, buf);
+    ret = commit.sync(file->fd, datasync);
+    if (ret != 0) {
+        return -ret;
+    }
+
+    /* The rename replacing the backing file must be durable as well. */
+    ret = sync_parent(*file);
+    if (ret != 0) {
+        return -ret;
+    }
+
+    return 0;
 }
 
-int asymmetricfs::statfd(fd_t fd, struct stat *buf) {
+int asymmetricfs::stat_file(internal& file, struct stat *buf) {
     if (!(buf)) {
         return -EFAULT;
     }
 
-    auto it = open_fds_.find(fd);
-    if (it == open_fds_.end()) {
-        return -EBADF;
+    scoped_lock l(file.mx);
+    if (!(file.is_open())) {
+        return -ESTALE;
     }
 
     struct stat s;
-    const int ret = ::fstat(it->second->fd, &s);
+    const int ret = ::fstat(file.fd, &s);
     if (ret != 0) {
         return -errno;
     }
 
     if (read_) {
-        int lret = it->second->load_buffer();
+        int lret = file.load_buffer();
         if (lret != 0) {
             return -lret;
         }
     }
 
-    assert(!(read_) || it->second->buffer_set);
-    const size_t size = it->second->buffer.size();
-    if (it->second->buffer_set) {
-        s.st_size = static_cast<off_t>(size);
-    } else if (it->second->flags & O_APPEND) {
-        s.st_size += size;
-    } /* else: leave st_size as-is. */
+    assert(!(read_) || file.buffer_set);
+    file.adjust_size(&s);
 
     *buf = s;
     return 0;
 }
 
-int asymmetricfs::getattr(const char *path_, struct stat *buf) {
-    const std::string path(path_);
+int asymmetricfs::getattr(const char *path, struct stat *buf) {
+    std::string rawpath;
+    if (raw_path(path, &rawpath)) {
+        if (!(buf)) {
+            return -EFAULT;
+        }
+
+        struct stat s;
+        const int ret =
+            ::fstatat(root_, rawpath.c_str(), &s, AT_SYMLINK_NOFOLLOW);
+        if (ret != 0) {
+            return -errno;
+        }
+
+        clear_write_bits(&s);
+        *buf = s;
+        return 0;
+    }
 
     /**
      * If !read_, clear the appropriate bits unless the file is open.
      */
     scoped_lock l(mx_);
+    wait_idle(l, path);
     auto it = open_paths_.find(path);
     const bool is_open = it != open_paths_.end();
 
     if (is_open) {
-        return statfd(it->second, buf);
+        auto jit = open_fds_.find(it->second);
+        assert(jit != open_fds_.end());
+        internal_ptr file = jit->second;
+        l.unlock();
+
+        int ret = stat_file(*file, buf);
+        if (ret == -ESTALE) {
+            /* The file was closed meanwhile. */
+            return getattr(path, buf);
+        }
+        return ret;
     } else {
         if (!(buf)) {
             return -EFAULT;
         }
 
-        const std::string relpath("." + path);
+        directory_cache::resolved r;
+        int ret = parents_.resolve(path, &r);
+        if (ret) {
+            return -ret;
+        }
+
         struct stat s;
-        const int ret =
-            ::fstatat(root_, relpath.c_str(), &s, AT_SYMLINK_NOFOLLOW);
+        ret = ::fstatat(r.fd(), r.name(), &s, AT_SYMLINK_NOFOLLOW);
         if (ret != 0) {
             return -errno;
         }
@@ -505,6 +2298,9 @@ int asymmetricfs::getattr(const char *path_, struct stat *buf) {
         if (!(read_) && !(S_ISDIR(s.st_mode))) {
             s.st_mode = s.st_mode &
                 static_cast<mode_t>(~(S_IRUSR | S_IRGRP | S_IROTH));
+        } else if (read_only_) {
+            l.unlock();
+            shared_attributes(path_ref(path), &s);
         }
 
         *buf = s;
@@ -512,6 +2308,141 @@ int asymmetricfs::getattr(const char *path_, struct stat *buf) {
     }
 }
 
+int asymmetricfs::ioctl(const char *path, int cmd, void *arg,
+        struct fuse_file_info *info, unsigned int flags, void *data) {
+    (void) arg;
+    assert(info);
+
+    if (flags & FUSE_IOCTL_DIR) {
+        return -ENOTTY;
+    }
+
+    internal_ptr file;
+    if (read_only_) {
+        file = find_shared(info)->file;
+    } else {
+        scoped_lock l(mx_);
+        auto it = open_fds_.find(info->fh);
+        if (it != open_fds_.end()) {
+            file = it->second;
+        }
+    }
+
+    if (!(file)) {
+        /* Raw files have no plaintext to control. */
+        return -ENOTTY;
+    }
+
+    switch (static_cast<unsigned>(cmd)) {
+        case ASYMMETRICFS_PREFETCH:
+            return -hint_load(file);
+        case ASYMMETRICFS_EVICT:
+            return -evict(file);
+        case ASYMMETRICFS_FLUSH:
+            return flush(path, info);
+        case ASYMMETRICFS_QUERY:
+            return -query(file, static_cast<struct asymmetricfs_status *>(
+                data));
+        default:
+            return -ENOTTY;
+    }
+}
+
+int asymmetricfs::hint_load(const internal_ptr& file) {
+    if (!(read_)) {
+        return EACCES;
+    }
+
+    {
+        scoped_lock fl(file->mx);
+        if (!(file->is_open()) || file->buffer_set || file->loading) {
+            return 0;
+        }
+        file->loading = true;
+    }
+
+    prefetch_.requested([file]() { load_hinted(file); });
+    return 0;
+}
+
+void asymmetricfs::load_hinted(const internal_ptr& file) {
+    /*
+     * Decrypt a step at a time, so reads of the file need not wait for all
+     * of it, and continue the decryption themselves.
+     */
+    const size_t step = 1 << 20;
+
+    int ret = 0;
+    while (ret == 0) {
+        scoped_lock fl(file->mx);
+        if (!(file->is_open()) || file->buffer_set) {
+            break;
+        }
+
+        /* No request is waiting, so it is a background job. */
+        const bool speculative = file->speculative;
+        file->speculative = true;
+        ret = file->load_buffer(file->buffer.size() + step);
+        file->speculative = speculative;
+    }
+
+    scoped_lock fl(file->mx);
+    file->loading = false;
+}
+
+int asymmetricfs::evict(const internal_ptr& file) {
+    if (read_only_) {
+        /* Shared plaintext is read without taking the file's lock. */
+        return EBUSY;
+    } else if (!(read_)) {
+        return EACCES;
+    }
+
+    scoped_lock fl(file->mx);
+    if (!(file->is_open())) {
+        return 0;
+    } else if (file->dirty) {
+        return EBUSY;
+    }
+
+    file->discard();
+    return 0;
+}
+
+int asymmetricfs::query(const internal_ptr& file,
+        struct asymmetricfs_status *status) {
+    memset(status, 0, sizeof(*status));
+
+    const admission::statistics gpg = gpg_jobs_.stats();
+    status->gpg_running = gpg.running;
+    status->gpg_queued = static_cast<uint32_t>(gpg.queued);
+
+    scoped_lock fl(file->mx);
+    if (!(file->is_open())) {
+        return EBADF;
+    }
+
+    struct stat s;
+    if (::fstat(file->fd, &s) != 0) {
+        return errno;
+    }
+    status->ciphertext = static_cast<uint64_t>(s.st_size);
+    file->adjust_size(&s);
+    status->size = static_cast<uint64_t>(s.st_size);
+    status->buffered = file->buffer.size();
+
+    if (file->buffer_set) {
+        status->state |= ASYMMETRICFS_STATE_LOADED;
+    }
+    if (file->dirty) {
+        status->state |= ASYMMETRICFS_STATE_DIRTY;
+    }
+    if (file->decrypting || file->loading) {
+        status->state |= ASYMMETRICFS_STATE_LOADING;
+    }
+    return 0;
+}
+
 int asymmetricfs::link(const char *oldpath, const char *newpath) {
     (void) oldpath;
     (void) newpath;
@@ -521,30 +2452,46 @@ int asymmetricfs::link(const char *oldpath, const char *newpath) {
 }
 
 #ifdef HAS_XATTR
-int asymmetricfs::listxattr(const char *path_, char *buffer, size_t size) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::listxattr(const char *path, char *buffer, size_t size) {
+    int fd;
+    std::string rawpath;
+    if (raw_path(path, &rawpath)) {
+        fd = ::openat(root_, rawpath.c_str(), O_CLOEXEC | O_PATH);
+    } else {
+        directory_cache::resolved r;
+        int rret = parents_.resolve(path, &r);
+        if (rret) {
+            return -rret;
+        }
 
-    int fd = ::openat(root_, relpath.c_str(), O_CLOEXEC | O_PATH);
+        fd = ::openat(r.fd(), r.name(), O_CLOEXEC | O_PATH);
+    }
     if (fd < 0) {
-        return errno;
+        return -errno;
     }
 
     ssize_t ret = ::flistxattr(fd, buffer, size);
     ::close(fd);
-    if (ret != 0) {
+    if (ret < 0) {
         return -errno;
     }
 
-    return 0;
+    return int(ret);
 }
 #endif // HAS_XATTR
 
-int asymmetricfs::mkdir(const char *path_, mode_t mode) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::mkdir(const char *path, mode_t mode) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
 
-    int ret = ::mkdirat(root_, relpath.c_str(), mode);
+    ret = ::mkdirat(r.fd(), r.name(), mode);
     if (ret != 0) {
         return -errno;
     }
@@ -552,14 +2499,20 @@ int asymmetricfs::mkdir(const char *path_, mode_t mode) {
     return 0;
 }
 
-int asymmetricfs::open(const char *path_, struct fuse_file_info *info) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::open(const char *path, struct fuse_file_info *info) {
     assert(info);
     int flags = info->flags;
 
+    std::string rawpath;
+    if (raw_path(path, &rawpath)) {
+        return open_raw(rawpath, info);
+    } else if (read_only_) {
+        return open_shared(path, info);
+    }
+
     /* Determine if the file is already open. */
     scoped_lock l(mx_);
+    wait_idle(l, path);
 
     open_map_t::const_iterator it = open_paths_.find(path);
     if (it != open_paths_.end()) {
@@ -568,90 +2521,321 @@ int asymmetricfs::open(const char *path_, struct fuse_file_info *info) {
         auto jit = open_fds_.find(it->second);
         assert(jit != open_fds_.end());
         jit->second->references++;
+
+        l.unlock();
+        opened(path);
+        return 0;
+    }
+
+    const int  access_mode = flags & O_ACCMODE;
+    const bool for_reading = (access_mode == O_RDWR) ||
+                             (access_mode == O_RDONLY);
+    const bool for_writing = (access_mode == O_RDWR) ||
+                             (access_mode == O_WRONLY);
+    if (!(read_) && for_reading) {
+        if (flags & O_CREAT) {
+            /* Require that the file be created (i.e., it does not already
+             * exist. */
+            flags |= O_EXCL;
+        }
+    }
+    flags |= O_CLOEXEC;
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    while (true) {
+        ret = ::openat(r.fd(), r.name(), make_rdwr(flags));
+        if (ret >= 0) {
+            break;
+        }
+
+        if (read_ && !(for_writing) && errno == EACCES) {
+            ret = ::openat(r.fd(), r.name(), flags);
+            if (ret >= 0) {
+                break;
+            }
+        }
+
+        return -errno;
+    }
+
+    /* Update list of open files. */
+    const fd_t fd = next_fd();
+
+    internal_ptr data = std::make_shared<internal>(*this);
+    data->fd            = ret;
+    data->flags         = flags;
+    data->path          = path;
+    data->references    = 1;
+    open_paths_.insert(std::make_pair(path_ref(data->path), fd));
+
+    /**
+     * If we just created the file, it will be empty.  If so, treat the empty
+     * buffer as initialized.  Otherwise, defer decryption until we read the
+     * file.
+     *
+     * This is necessary so we can truncate empty files to non-zero size even
+     * in write-only mode.
+     */
+    struct stat buf;
+    int fstat_ret = fstat(ret, &buf);
+    if (fstat_ret == 0) {
+        data->buffer_set = buf.st_size == 0;
+        data->seen = buf;
+    } else {
+        /* An error occured, but treat it as nonfatal. */
+        data->buffer_set = false;
+    }
+
+    open_fds_  .insert(std::make_pair(fd, data));
+
+    info->fh = fd;
+
+    l.unlock();
+    opened(path);
+    return 0;
+}
+
+int asymmetricfs::open_raw(const std::string& relpath,
+        struct fuse_file_info *info) {
+    const int flags = info->flags;
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) {
+        return -EROFS;
+    }
+
+    int ret = ::openat(root_, relpath.c_str(), O_CLOEXEC | O_RDONLY);
+    if (ret < 0) {
+        return -errno;
+    }
+
+    if (read_only_) {
+        info->fh = reinterpret_cast<uintptr_t>(
+            new shared_handle{ret, internal_ptr()});
         return 0;
     }
 
-    const int  access_mode = flags & O_ACCMODE;
-    const bool for_reading = (access_mode == O_RDWR) ||
-                             (access_mode == O_RDONLY);
-    const bool for_writing = (access_mode == O_RDWR) ||
-                             (access_mode == O_WRONLY);
-    if (!(read_) && for_reading) {
-        if (flags & O_CREAT) {
-            /* Require that the file be created (i.e., it does not already
-             * exist. */
-            flags |= O_EXCL;
+    scoped_lock l(mx_);
+    const fd_t fd = next_fd();
+    raw_fds_.insert(std::make_pair(fd, ret));
+
+    info->fh = fd;
+    return 0;
+}
+
+int asymmetricfs::open_shared(const char *path,
+        struct fuse_file_info *info) {
+    const int flags = info->flags;
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    const int fd = ::openat(r.fd(), r.name(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    struct stat s;
+    if (::fstat(fd, &s) != 0) {
+        ret = errno;
+        ::close(fd);
+        return -ret;
+    }
+
+    /*
+     * Share the file already open at path, unless it has changed since.
+     * Handles open on an older version keep it to themselves.
+     */
+    internal_ptr file;
+    {
+        scoped_lock l(mx_);
+        auto it = shared_paths_.find(path_ref(path));
+        if (it != shared_paths_.end()) {
+            file = it->second;
+            file->references++;
+        }
+    }
+
+    bool shared = false;
+    if (file) {
+        /* This waits for the file to be decrypted, if it is being opened. */
+        {
+            scoped_lock fl(file->mx);
+            shared = same_version(s, file->seen);
+        }
+
+        if (!(shared)) {
+            release_shared(file);
+            file.reset();
+        }
+    }
+
+    if (shared) {
+        ::close(fd);
+    } else {
+        file = std::make_shared<internal>(*this);
+        file->fd         = fd;
+        file->flags      = O_RDONLY | O_CLOEXEC;
+        file->path       = path;
+        file->references = 1;
+        file->buffer_set = s.st_size == 0;
+        file->seen       = s;
+
+        scoped_lock l(mx_);
+        shared_paths_.erase(path_ref(path));
+        shared_paths_.insert(std::make_pair(path_ref(file->path), file));
+    }
+
+    /*
+     * The first handle decrypts the file, while any opened meanwhile wait
+     * for it.
+     */
+    {
+        scoped_lock fl(file->mx);
+        ret = file->load_buffer();
+    }
+    if (ret != 0) {
+        release_shared(file);
+        return -ret;
+    }
+
+    info->fh = reinterpret_cast<uintptr_t>(new shared_handle{-1, file});
+    /* The kernel's cached pages remain valid for the same version. */
+    info->keep_cache = shared;
+
+    opened(path);
+    return 0;
+}
+
+void asymmetricfs::release_shared(const internal_ptr& file) {
+    {
+        scoped_lock l(mx_);
+        if (--file->references > 0) {
+            return;
         }
-    }
-    flags |= O_CLOEXEC;
 
-    int ret;
-    while (true) {
-        ret = ::openat(root_, relpath.c_str(), make_rdwr(flags));
-        if (ret >= 0) {
-            break;
+        auto it = shared_paths_.find(path_ref(file->path));
+        if (it != shared_paths_.end() && it->second == file) {
+            shared_paths_.erase(it);
         }
+    }
 
-        if (read_ && !(for_writing) && errno == EACCES) {
-            ret = ::openat(root_, relpath.c_str(), flags);
-            if (ret >= 0) {
-                break;
-            }
+    /* Nothing was modified, so this only passes on the plaintext. */
+    scoped_lock fl(file->mx);
+    (void) file->close();
+}
+
+void asymmetricfs::shared_attributes(const path_ref& path,
+        struct stat *s) {
+    clear_write_bits(s);
+
+    internal_ptr file;
+    {
+        scoped_lock l(mx_);
+        auto it = shared_paths_.find(path);
+        if (it == shared_paths_.end()) {
+            return;
         }
+        file = it->second;
+    }
 
-        return -errno;
+    scoped_lock fl(file->mx);
+    if (file->is_open() && same_version(*s, file->seen)) {
+        file->adjust_size(s);
     }
+}
 
-    /* Update list of open files. */
-    const fd_t fd = next_fd();
-    open_paths_.insert(std::make_pair(path, fd));
+/**
+ * The state of an open directory handle:  its descriptor and the entries read
+ * from it with getdents64 but not yet returned to FUSE.
+ */
+class asymmetricfs::directory {
+public:
+    directory(int fd_, const std::string& path_, bool raw_);
+    ~directory();
 
-    internal * data = new internal(options_);
-    data->fd            = ret;
-    data->flags         = flags;
-    data->path          = path;
-    data->references    = 1;
+    /**
+     * This serializes listings of this directory.
+     */
+    std::mutex mx;
+
+    const int fd;
+    const std::string path;
+    const bool raw;
 
     /**
-     * If we just created the file, it will be empty.  If so, treat the empty
-     * buffer as initialized.  Otherwise, defer decryption until we read the
-     * file.
-     *
-     * This is necessary so we can truncate empty files to non-zero size even
-     * in write-only mode.
+     * entries[begin, end) holds records from getdents64 that have not yet
+     * been returned.  position is the offset of the first of them (or, if
+     * there are none, of the descriptor).
      */
-    struct stat buf;
-    int fstat_ret = fstat(ret, &buf);
-    if (fstat_ret == 0) {
-        data->buffer_set = buf.st_size == 0;
-    } else {
-        /* An error occured, but treat it as nonfatal. */
-        data->buffer_set = false;
-    }
+    std::vector<char> entries;
+    size_t begin;
+    size_t end;
+    off_t position;
 
-    open_fds_  .insert(std::make_pair(fd, data));
+    /**
+     * Some filesystems do not list . and .., even though they are valid
+     * names in any directory.  Those not yet listed since the listing
+     * started are listed once the backing directory is exhausted.
+     */
+    std::set<std::string> fill_in;
+private:
+    directory(const directory &) = delete;
+    const directory & operator=(const directory &) = delete;
+};
 
-    info->fh = fd;
+asymmetricfs::directory::directory(int fd_, const std::string& path_,
+        bool raw_) : fd(fd_), path(path_), raw(raw_), entries(1 << 15),
+    begin(0), end(0), position(0), fill_in{".", ".."} {}
 
-    return 0;
+asymmetricfs::directory::~directory() {
+    ::close(fd);
+}
+
+asymmetricfs::directory_ptr asymmetricfs::find_directory(uint64_t handle) {
+    scoped_lock l(dirs_mx_);
+    auto it = open_dirs_.find(handle);
+    if (it == open_dirs_.end()) {
+        return directory_ptr();
+    }
+
+    return it->second;
 }
 
-int asymmetricfs::opendir(const char *path_, struct fuse_file_info *info) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::opendir(const char *path, struct fuse_file_info *info) {
+    std::string rawpath;
+    const bool raw = raw_path(path, &rawpath);
+
+    int dirfd;
+    if (raw) {
+        dirfd = ::openat(root_, rawpath.c_str(), O_CLOEXEC | O_DIRECTORY);
+    } else {
+        directory_cache::resolved r;
+        int ret = parents_.resolve(path, &r);
+        if (ret) {
+            return -ret;
+        }
 
-    int dirfd = ::openat(root_, relpath.c_str(), O_CLOEXEC | O_DIRECTORY);
+        dirfd = ::openat(r.fd(), r.name(), O_CLOEXEC | O_DIRECTORY);
+    }
     if (dirfd < 0) {
         return -errno;
     }
 
-    DIR *dir = ::fdopendir(dirfd);
-    if (!(dir)) {
-        return -errno;
-    }
+    directory_ptr d(new directory(dirfd, path, raw));
 
-    info->fh = reinterpret_cast<uint64_t>(dir);
-    open_dirs_[info->fh] = relpath;
+    scoped_lock l(dirs_mx_);
+    info->fh = next_dir_++;
+    open_dirs_.insert(std::make_pair(info->fh, d));
     return 0;
 }
 
@@ -659,22 +2843,51 @@ int asymmetricfs::read(const char *path, void *buffer, size_t size,
         off_t offset_, struct fuse_file_info *info) {
     (void) path;
 
-    scoped_lock l(mx_);
-    open_fd_map_t::const_iterator it = open_fds_.find(info->fh);
-    if (it == open_fds_.end()) {
-        return -EBADF;
+    int raw_fd = -1;
+    internal_ptr file;
+    if (read_only_) {
+        const shared_handle *h = find_shared(info);
+        raw_fd = h->raw_fd;
+
+        if (raw_fd < 0 && offset_ >= 0) {
+            /*
+             * The file was decrypted in full when opened and is never
+             * modified, so it is read without taking any lock.
+             */
+            return static_cast<int>(h->file->buffer.read(size,
+                static_cast<size_t>(offset_), buffer));
+        }
+    } else {
+        scoped_lock l(mx_);
+        auto rit = raw_fds_.find(info->fh);
+        if (rit != raw_fds_.end()) {
+            raw_fd = rit->second;
+        } else {
+            open_fd_map_t::const_iterator it = open_fds_.find(info->fh);
+            if (it == open_fds_.end()) {
+                return -EBADF;
+            }
+            file = it->second;
+        }
     }
 
-    if (offset_ < 0) {
+    if (raw_fd >= 0) {
+        ssize_t ret = ::pread(raw_fd, buffer, size, offset_);
+        if (ret < 0) {
+            return -errno;
+        }
+        return static_cast<int>(ret);
+    } else if (offset_ < 0) {
         return 0;
     }
     const size_t offset = static_cast<size_t>(offset_);
 
+    scoped_lock fl(file->mx);
     if (!(read_)) {
-        if (!(it->second->buffer_set)) {
-            if (it->second->flags & O_APPEND) {
+        if (!(file->buffer_set)) {
+            if (file->flags & O_APPEND) {
                 return -EACCES;
-            } else if (!(it->second->flags & O_CREAT)) {
+            } else if (!(file->flags & O_CREAT)) {
                 /*
                  * O_CREAT implies O_EXCL, so if it was not set, the file
                  * already existed and cannot be read.
@@ -683,132 +2896,246 @@ int asymmetricfs::read(const char *path, void *buffer, size_t size,
             }
         }
     } else {
-        /* Read the buffer, as needed. */
-        int ret = it->second->load_buffer();
+        /* Decrypt as much of the file as this read needs. */
+        const size_t needed =
+            size > SIZE_MAX - offset ? SIZE_MAX : offset + size;
+        int ret = file->load_buffer(needed);
         if (ret != 0) {
             return -ret;
         }
-        assert(it->second->buffer_set);
     }
 
-    return static_cast<int>(it->second->buffer.read(size, offset, buffer));
+    return static_cast<int>(file->buffer.read(size, offset, buffer));
+}
+
+int asymmetricfs::read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *info) {
+    assert(bufp);
+
+    /* FUSE takes ownership of the vector and its buffer, releasing them with
+     * free(). */
+    struct fuse_bufvec *bufv =
+        static_cast<struct fuse_bufvec *>(malloc(sizeof(*bufv)));
+    if (!(bufv)) {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+
+    int raw_fd = -1;
+    if (read_only_) {
+        raw_fd = find_shared(info)->raw_fd;
+    } else {
+        scoped_lock l(mx_);
+        auto it = raw_fds_.find(info->fh);
+        if (it != raw_fds_.end()) {
+            raw_fd = it->second;
+        }
+    }
+
+    if (raw_fd >= 0) {
+        /* Hand back the backing descriptor so FUSE can splice the
+         * ciphertext without copying it through our address space. */
+        bufv->buf[0].flags =
+            static_cast<enum fuse_buf_flags>(
+                FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv->buf[0].fd = raw_fd;
+        bufv->buf[0].pos = offset;
+
+        *bufp = bufv;
+        return 0;
+    }
+
+    void *mem = malloc(size);
+    if (size > 0 && !(mem)) {
+        free(bufv);
+        return -ENOMEM;
+    }
+
+    int ret = read(path, mem, size, offset, info);
+    if (ret < 0) {
+        free(mem);
+        free(bufv);
+        return ret;
+    }
+
+    bufv->buf[0].mem = mem;
+    bufv->buf[0].size = static_cast<size_t>(ret);
+
+    *bufp = bufv;
+    return 0;
 }
 
+namespace {
+
+/**
+ * The record format returned by getdents64.  glibc only exposes a wrapper
+ * for the syscall in recent releases, so we call it directly.
+ */
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+}  // namespace
+
 int asymmetricfs::readdir(const char *path, void *buffer,
         fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info) {
     (void) path;
-    (void) offset;
-
-    DIR *dir = reinterpret_cast<DIR *>(info->fh);
 
     // Lookup path handle
-    auto it = open_dirs_.find(info->fh);
-    if (it == open_dirs_.end()) {
+    directory_ptr dp = find_directory(info->fh);
+    if (!(dp)) {
         return -EBADF;
     }
-    const std::string& relpath = it->second;
+    directory& d = *dp;
+    scoped_lock l(d.mx);
 
-    /**
-     * readdir is used preferentially over readdir_r here as the API for
-     * readdir_r exposes us to the potential problem of failing to allocate
-     * enough buffer space for the entry name.
+    /*
+     * We pass each entry's d_off to filler, which FUSE hands back to us as
+     * offset when it needs more entries.  Ordinarily, this is where the
+     * previous call stopped and the remaining entries are still buffered.
+     * Otherwise (e.g., offset 0 to restart the listing), we seek.
      */
-    struct dirent *result;
+    if (offset != d.position) {
+        if (::lseek(d.fd, offset, SEEK_SET) < 0) {
+            return -errno;
+        }
 
-    /**
-     * From the readdir man-page (release 3.44):
-     *
-     * "On success, readdir() returns a pointer to a dirent structure.  (This
-     *  structure may be statically allocated; do not attempt to free(3) it.)
-     *  If the end of the directory stream is reached, NULL is returned and
-     *  errno is not changed.  If an error occurs, NULL is returned and errno
-     *  is set appropriately."
-     *
-     * errno may be nonzero upon entry into the loop, so it must be cleared as
-     * to detect any errors that arise.
-     */
-    errno = 0;
+        d.begin = d.end = 0;
+        d.position = offset;
 
-    /**
-     * Per the GNU libc manual:
-     *   "Portability Note: On some systems readdir may not return entries for
-     *   . and .., even though these are always valid file names in any
-     *   directory."
-     *
-     * Therefore, we track whether we have seen . and .. and inject them
-     * accordingly.
-     */
-    std::set<std::string> fill_in{".", ".."};
+        /* Resuming elsewhere, . and .. were listed before, if at all. */
+        if (offset == 0) {
+            d.fill_in = {".", ".."};
+        } else {
+            d.fill_in.clear();
+        }
+    }
 
-    while ((result = ::readdir(dir)) != NULL) {
-        struct stat s;
-        memset(&s, 0, sizeof(s));
-        s.st_ino = result->d_ino;
-
-        bool skip = false;
-        unsigned d_type = result->d_type;
-        if (result->d_type == DT_UNKNOWN) {
-            // Perform stat on entry to get type.
-            struct stat t;
-            int ret = fstatat(
-                root_,
-                (relpath + result->d_name).c_str(),
-                &t, AT_SYMLINK_NOFOLLOW);
-            if (ret < 0) {
+    /* The files listed, so the prefetcher can follow a scan in order. */
+    const bool prefetching = prefetching_ && read_ && !(d.raw);
+    const bool first = offset == 0;
+    std::vector<std::string> files;
+
+    /*
+     * The kernel only uses the type of each entry, so we stat an entry only
+     * if the backing filesystem does not provide it.
+     */
+    while (true) {
+        if (d.begin == d.end) {
+            const long n = ::syscall(SYS_getdents64, d.fd, d.entries.data(),
+                d.entries.size());
+            if (n < 0) {
                 return -errno;
+            } else if (n == 0) {
+                break;
             }
-            d_type = IFTODT(t.st_mode);
-        }
 
-        switch (d_type) {
-            case DT_LNK:
-            case DT_REG:
-            case DT_DIR:
-                s.st_mode = DTTOIF(d_type);
-                break;
-            case DT_UNKNOWN:
-            case DT_BLK:
-            case DT_CHR:
-            case DT_FIFO:
-            case DT_SOCK:
-            default:
-                skip = true;
-                break;
+            d.begin = 0;
+            d.end = static_cast<size_t>(n);
         }
 
-        if (skip) {
-            continue;
-        }
+        while (d.begin < d.end) {
+            const struct linux_dirent64 *entry =
+                reinterpret_cast<const struct linux_dirent64 *>(
+                    d.entries.data() + d.begin);
+
+            struct stat s;
+            memset(&s, 0, sizeof(s));
+            s.st_ino = entry->d_ino;
+            s.st_mode = DTTOIF(entry->d_type);
+
+            if (entry->d_type == DT_UNKNOWN) {
+                int ret = ::fstatat(d.fd, entry->d_name, &s,
+                    AT_SYMLINK_NOFOLLOW);
+                if (ret != 0 && errno == ENOENT) {
+                    /* Removed since it was listed. */
+                    s.st_mode = 0;
+                } else if (ret != 0) {
+                    return -errno;
+                }
+            }
 
-        fill_in.erase(result->d_name);
-        int ret = filler(buffer, result->d_name, &s, 0);
-        if (ret) {
-            return 0;
+            /* Our temporary files are not part of the filesystem. */
+            bool skip = is_temporary(entry->d_name);
+            switch (IFTODT(s.st_mode)) {
+                case DT_LNK:
+                case DT_REG:
+                case DT_DIR:
+                    break;
+                case DT_UNKNOWN:
+                case DT_BLK:
+                case DT_CHR:
+                case DT_FIFO:
+                case DT_SOCK:
+                default:
+                    skip = true;
+                    break;
+            }
+
+            if (!(skip)) {
+                if (filler(buffer, entry->d_name, &s, entry->d_off)) {
+                    /* The reply is full.  Keep this entry for next time. */
+                    if (prefetching) {
+                        prefetch_.listed(d.path, files, first);
+                    }
+                    return 0;
+                }
+
+                if (entry->d_name[0] == '.') {
+                    d.fill_in.erase(entry->d_name);
+                }
+                if (prefetching && S_ISREG(s.st_mode)) {
+                    files.push_back(entry->d_name);
+                }
+            }
+
+            d.begin += entry->d_reclen;
+            d.position = entry->d_off;
         }
     }
 
-    // Fill in . and .., if they were not seen during the main loop.
-    for (const std::string& name : fill_in) {
+    if (prefetching) {
+        prefetch_.listed(d.path, files, first);
+    }
+
+    /*
+     * Fill in . and .., if they were not listed.  They share the offset of
+     * the end of the listing, so resuming there continues with them.
+     */
+    while (!(d.fill_in.empty())) {
         struct stat s;
         memset(&s, 0, sizeof(s));
         s.st_mode = S_IFDIR;
 
-        int ret = filler(buffer, name.c_str(), &s, 0);
-        if (ret) {
+        const std::string name = *d.fill_in.begin();
+        if (filler(buffer, name.c_str(), &s, d.position)) {
             return 0;
         }
+        d.fill_in.erase(d.fill_in.begin());
     }
-
-    return -errno;
+    return 0;
 }
 
-int asymmetricfs::readlink(const char *path_, char *buffer, size_t size) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
-
+int asymmetricfs::readlink(const char *path, char *buffer, size_t size) {
     size_t len = size > 0 ? size - 1 : 0;
 
-    ssize_t ret = ::readlinkat(root_, relpath.c_str(), buffer, len);
+    ssize_t ret;
+    std::string rawpath;
+    if (raw_path(path, &rawpath)) {
+        ret = ::readlinkat(root_, rawpath.c_str(), buffer, len);
+    } else {
+        directory_cache::resolved r;
+        int rret = parents_.resolve(path, &r);
+        if (rret) {
+            return -rret;
+        }
+
+        ret = ::readlinkat(r.fd(), r.name(), buffer, len);
+    }
     if (ret == -1) {
         return -errno;
     } else {
@@ -819,8 +3146,25 @@ int asymmetricfs::readlink(const char *path_, char *buffer, size_t size) {
 int asymmetricfs::release(const char *path, struct fuse_file_info *info) {
     (void) path;
 
+    if (read_only_) {
+        std::unique_ptr<shared_handle> h(find_shared(info));
+        if (h->file) {
+            release_shared(h->file);
+        } else {
+            ::close(h->raw_fd);
+        }
+        return 0 /* ignored */;
+    }
+
     scoped_lock l(mx_);
 
+    auto rit = raw_fds_.find(info->fh);
+    if (rit != raw_fds_.end()) {
+        ::close(rit->second);
+        raw_fds_.erase(rit);
+        return 0 /* ignored */;
+    }
+
     auto it = open_fds_.find(info->fh);
     if (it == open_fds_.end()) {
         return 0 /* ignored */;
@@ -828,11 +3172,27 @@ int asymmetricfs::release(const char *path, struct fuse_file_info *info) {
 
     const unsigned new_count = --it->second->references;
     if (new_count == 0) {
-        /* Close the file. */
-        open_paths_.erase(it->second->path);
-
-        delete it->second;
+        /*
+         * Close the file.  It is busy, rather than open, while it is
+         * encrypted, so we need not hold mx_ while gpg runs.
+         */
+        internal_ptr file = it->second;
+        open_paths_.erase(path_ref(file->path));
         open_fds_.erase(it);
+        busy_paths_.insert(std::make_pair(path_ref(file->path), file));
+        l.unlock();
+
+        {
+            scoped_lock fl(file->mx);
+            if (file->loading && read_) {
+                /* Finish a hinted load, so its plaintext can be cached. */
+                file->speculative = true;
+                (void) file->load_buffer();
+            }
+            (void) file->close();
+        }
+
+        finish_busy(file);
     }
 
     return 0 /* ignored */;
@@ -841,34 +3201,36 @@ int asymmetricfs::release(const char *path, struct fuse_file_info *info) {
 int asymmetricfs::releasedir(const char *path, struct fuse_file_info *info) {
     (void) path;
 
-    // Verify file handle.
-    auto fh = info->fh;
-    auto it = open_dirs_.find(fh);
+    // Verify file handle.  Concurrent listings may still hold a reference
+    // to the directory, in which case the last of them closes it.
+    scoped_lock l(dirs_mx_);
+    auto it = open_dirs_.find(info->fh);
     if (it == open_dirs_.end()) {
         return -EBADF;
     }
 
-    DIR *dir = reinterpret_cast<DIR *>(fh);
-    int ret = ::closedir(dir);
-    if (ret != 0) {
-        return -errno;
-    }
-
     open_dirs_.erase(it);
     return 0;
 }
 
 #ifdef HAS_XATTR
-int asymmetricfs::removexattr(const char *path_, const char *name) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::removexattr(const char *path, const char *name) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
 
-    int fd = ::openat(root_, relpath.c_str(), O_CLOEXEC | O_PATH);
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    int fd = ::openat(r.fd(), r.name(), O_CLOEXEC | O_PATH);
     if (fd < 0) {
         return -errno;
     }
 
-    int ret = ::fremovexattr(fd, name);
+    ret = ::fremovexattr(fd, name);
     ::close(fd);
     if (ret != 0) {
         return -errno;
@@ -878,12 +3240,20 @@ int asymmetricfs::removexattr(const char *path_, const char *name) {
 }
 #endif // HAS_XATTR
 
-int asymmetricfs::rename(const char *oldpath_, const char *newpath_) {
-    const std::string oldpath(oldpath_);
-    const std::string newpath(newpath_);
+int asymmetricfs::rename(const char *oldpath, const char *newpath) {
+    if (!(writable(oldpath)) || !(writable(newpath))) {
+        return -EROFS;
+    }
 
-    const std::string reloldpath("." + oldpath);
-    const std::string relnewpath("." + newpath);
+    directory_cache::resolved oldr, newr;
+    int ret = parents_.resolve(oldpath, &oldr);
+    if (ret) {
+        return -ret;
+    }
+    ret = parents_.resolve(newpath, &newr);
+    if (ret) {
+        return -ret;
+    }
 
     /*
      * Avoid races to rename as our metadata for open files will be manipulated
@@ -891,53 +3261,76 @@ int asymmetricfs::rename(const char *oldpath_, const char *newpath_) {
      */
     scoped_lock l(mx_);
 
-    int ret = ::renameat(root_, reloldpath.c_str(), root_, relnewpath.c_str());
+    ret = ::renameat(oldr.fd(), oldr.name(), newr.fd(), newr.name());
     if (ret != 0) {
         return -errno;
     }
 
+    /*
+     * Cached descriptors follow a renamed directory to its new location, and
+     * any directory replaced at newpath is gone.
+     */
+    parents_.invalidate(oldpath);
+    parents_.invalidate(newpath);
+
     open_map_t::iterator it = open_paths_.find(oldpath);
     if (it != open_paths_.end()) {
         /* Rename existing, open files. */
         const fd_t fd = it->second;
-
-        open_paths_.insert(std::make_pair(newpath, fd));
         open_paths_.erase(it);
 
+        /* The key refers to the path held by the file's data. */
         open_fd_map_t::iterator jit = open_fds_.find(fd);
         assert(jit != open_fds_.end());
         if (jit != open_fds_.end()) {
             jit->second->path = newpath;
+            open_paths_.insert(
+                std::make_pair(path_ref(jit->second->path), fd));
         }
     }
 
     return 0;
 }
 
-int asymmetricfs::rmdir(const char *path_) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::rmdir(const char *path) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
 
-    int ret = ::unlinkat(root_, relpath.c_str(), AT_REMOVEDIR);
+    ret = ::unlinkat(r.fd(), r.name(), AT_REMOVEDIR);
     if (ret != 0) {
         return -errno;
     }
 
+    parents_.invalidate(path);
     return 0;
 }
 
 #ifdef HAS_XATTR
-int asymmetricfs::setxattr(const char *path_, const char *name,
+int asymmetricfs::setxattr(const char *path, const char *name,
         const void *value, size_t size, int flags) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
 
-    int fd = ::openat(root_, relpath.c_str(), O_CLOEXEC | O_PATH);
+    int fd = ::openat(r.fd(), r.name(), O_CLOEXEC | O_PATH);
     if (fd < 0) {
         return -errno;
     }
 
-    int ret = ::fsetxattr(fd, name, value, size, flags);
+    ret = ::fsetxattr(fd, name, value, size, flags);
     ::close(fd);
     if (ret != 0) {
         return -errno;
@@ -955,14 +3348,24 @@ int asymmetricfs::statfs(const char *path, struct statvfs *buf) {
         return -errno;
     }
 
+    if (read_only_) {
+        buf->f_flag |= ST_RDONLY;
+    }
     return 0;
 }
 
-int asymmetricfs::symlink(const char *oldpath, const char *newpath_) {
-    const std::string newpath(newpath_);
-    const std::string relpath("." + newpath);
+int asymmetricfs::symlink(const char *oldpath, const char *newpath) {
+    if (!(writable(newpath))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(newpath, &r);
+    if (ret) {
+        return -ret;
+    }
 
-    int ret = ::symlinkat(oldpath, root_, relpath.c_str());
+    ret = ::symlinkat(oldpath, r.fd(), r.name());
     if (ret != 0) {
         return -errno;
     }
@@ -970,23 +3373,39 @@ int asymmetricfs::symlink(const char *oldpath, const char *newpath_) {
     return 0;
 }
 
-int asymmetricfs::truncate(const char *path_, off_t offset) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
-
+int asymmetricfs::truncate(const char *path, off_t offset) {
     if (offset < 0) {
         return -EINVAL;
+    } else if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int rret = parents_.resolve(path, &r);
+    if (rret) {
+        return -rret;
     }
 
     /* Determine if the file is already open. */
     scoped_lock l(mx_);
+    wait_idle(l, path);
 
     open_map_t::const_iterator it = open_paths_.find(path);
     const bool is_open = it != open_paths_.end();
     if (is_open) {
-        return truncatefd(it->second, offset);
+        auto jit = open_fds_.find(it->second);
+        assert(jit != open_fds_.end());
+        internal_ptr file = jit->second;
+        l.unlock();
+
+        int ret = truncate_file(*file, offset);
+        if (ret == -ESTALE) {
+            /* The file was closed meanwhile. */
+            return truncate(path, offset);
+        }
+        return ret;
     } else if (offset == 0) {
-        int fd = ::openat(root_, relpath.c_str(), O_CLOEXEC | O_WRONLY);
+        int fd = ::openat(r.fd(), r.name(), O_CLOEXEC | O_WRONLY);
         if (fd < 0) {
             return -errno;
         }
@@ -1001,32 +3420,38 @@ int asymmetricfs::truncate(const char *path_, off_t offset) {
     } else if (read_) {
         /* Decrypt, truncate, encrypt. */
         const int flags = O_RDWR;
-        int fd = ::openat(root_, relpath.c_str(), O_CLOEXEC | flags);
+        int fd = ::openat(r.fd(), r.name(), O_CLOEXEC | flags);
         if (fd < 0) {
             return -errno;
         }
 
-        internal data(options_);
-        data.fd         = fd;
-        data.flags      = flags;
-        data.path       = path;
-        /* data is transient and does not escape our scope. */
-        data.references = 0;
-
-        int load_ret = data.load_buffer();
-        if (load_ret != 0) {
-            return -load_ret;
+        /*
+         * data is transient and is never opened, but it is busy until it is
+         * reencrypted, so we need not hold mx_ while gpg runs.
+         */
+        internal_ptr data = std::make_shared<internal>(*this);
+        data->fd         = fd;
+        data->flags      = flags;
+        data->path       = path;
+        data->references = 0;
+        busy_paths_.insert(std::make_pair(path_ref(data->path), data));
+        l.unlock();
+
+        int ret;
+        {
+            scoped_lock fl(data->mx);
+            ret = data->load_buffer();
+            if (ret == 0) {
+                assert(data->buffer_set);
+                const size_t size = static_cast<size_t>(offset);
+                data->modified(std::min(size, data->buffer.size()));
+                data->buffer.resize(size);
+
+                ret = data->close();
+            }
         }
 
-        // Rewind, so when we write out the newly resized buffer, we clobber the
-        // old file contents.
-        ::lseek(fd, 0, SEEK_SET);
-
-        assert(data.buffer_set);
-        data.buffer.resize(static_cast<size_t>(offset));
-        data.dirty = true;
-
-        int ret = data.close();
+        finish_busy(data);
         if (ret == 0) {
             return 0;
         } else {
@@ -1041,11 +3466,13 @@ int asymmetricfs::write(const char *path_, const char *buffer, size_t size,
         off_t offset, struct fuse_file_info *info) {
     (void) path_;
 
-    scoped_lock l(mx_);
-
     assert(info);
-    auto it = open_fds_.find(info->fh);
-    if (it == open_fds_.end()) {
+    if (read_only_) {
+        return -EROFS;
+    }
+
+    internal_ptr file = find_file(info->fh);
+    if (!(file)) {
         return -EBADF;
     }
 
@@ -1057,29 +3484,63 @@ int asymmetricfs::write(const char *path_, const char *buffer, size_t size,
         return -EINVAL;
     }
 
-    it->second->buffer.write(size, static_cast<size_t>(offset), buffer);
-    it->second->dirty = true;
+    scoped_lock l(file->mx);
+    if (read_ && (!(file->flags & O_APPEND) || file->decrypting)) {
+        /*
+         * Decrypt the existing contents first, so the file is rewritten with
+         * them rather than clobbered by the bytes written.  Appending to a
+         * file partially decrypted by an earlier read finishes decrypting it,
+         * as the buffer already holds its first bytes.
+         */
+        int ret = file->load_buffer();
+        if (ret != 0) {
+            return -ret;
+        }
+    }
+
+    file->buffer.write(size, static_cast<size_t>(offset), buffer);
+    file->modified(static_cast<size_t>(offset));
 
     return static_cast<int>(size);
 }
 
-int asymmetricfs::unlink(const char *path_) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::unlink(const char *path) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
 
-    int ret = ::unlinkat(root_, relpath.c_str(), 0);
-    if (ret != 0) {
-        return -errno;
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
+
+    {
+        /* Files being replaced check that they were not unlinked under mx_. */
+        scoped_lock l(mx_);
+        ret = ::unlinkat(r.fd(), r.name(), 0);
+        if (ret != 0) {
+            return -errno;
+        }
     }
 
+    /* A cached descriptor may have been reached through a symlink. */
+    parents_.invalidate(path);
     return 0;
 }
 
-int asymmetricfs::utimens(const char *path_, const struct timespec tv[2]) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::utimens(const char *path, const struct timespec tv[2]) {
+    if (!(writable(path))) {
+        return -EROFS;
+    }
+
+    directory_cache::resolved r;
+    int ret = parents_.resolve(path, &r);
+    if (ret) {
+        return -ret;
+    }
 
-    int ret = utimensat(root_, relpath.c_str(), tv, 0);
+    ret = utimensat(r.fd(), r.name(), tv, 0);
     if (ret != 0) {
         return -errno;
     }
@@ -1087,9 +3548,23 @@ int asymmetricfs::utimens(const char *path_, const struct timespec tv[2]) {
     return 0;
 }
 
-int asymmetricfs::access(const char *path_, int mode) {
-    const std::string path(path_);
-    const std::string relpath("." + path);
+int asymmetricfs::access(const char *path, int mode) {
+    std::string relpath;
+
+    if (raw_path(path, &relpath)) {
+        if (mode & W_OK) {
+            return -EROFS;
+        }
+
+        int aret = ::faccessat(root_, relpath.c_str(), mode, 0);
+        if (aret == 0) {
+            return 0;
+        } else {
+            return -errno;
+        }
+    } else if (read_only_ && (mode & W_OK)) {
+        return -EROFS;
+    }
 
     int ret = 0;
     if ((mode & R_OK) && !(read_)) {
@@ -1122,7 +3597,13 @@ int asymmetricfs::access(const char *path_, int mode) {
         // Otherwise, fallthrough and check the underlying filesystem.
     }
 
-    int aret = ::faccessat(root_, relpath.c_str(), mode, 0);
+    directory_cache::resolved r;
+    int rret = parents_.resolve(path, &r);
+    if (rret) {
+        return -rret;
+    }
+
+    int aret = ::faccessat(r.fd(), r.name(), mode, 0);
     if (aret == 0) {
         return ret;
     } else {
@@ -21,11 +21,31 @@
 
 #define _FILE_OFFSET_BITS 64
 #define FUSE_USE_VERSION 29
+#include "access_manifest.h"
+#include "admission.h"
+#include <atomic>
+#include <chrono>
+#include "control.h"
+#include <cstdint>
+#include "directory_cache.h"
 #include <fuse.h>
 #include "gpg_recipient.h"
+#include "group_commit.h"
+#include <functional>
+#include <initializer_list>
+#include <condition_variable>
 #include "memory_lock.h"
+#include "memory_pressure.h"
+#include <memory>
 #include <mutex>
+#include "path_ref.h"
+#include "placement.h"
+#include "plaintext_cache.h"
+#include "prefetcher.h"
 #include <string>
+#include "subprocess.h"
+#include "target_watcher.h"
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -34,8 +54,18 @@ class asymmetricfs {
         options();
 
         std::vector<gpg_recipient> recipients;
+        /* Set if every recipient was chosen by its full fingerprint. */
+        bool trust_recipients;
         std::string gpg_path;
+        std::vector<std::string> gpg_arguments;
+
+        /* The arguments for running gpg with the given ones. */
+        std::vector<std::string> gpg_command(
+            std::initializer_list<std::string> arguments) const;
         memory_lock mlock;
+        /* Applied to gpg when decrypting and encrypting, respectively. */
+        subprocess::scheduling foreground;
+        subprocess::scheduling background;
     };
 public:
     asymmetricfs();
@@ -45,12 +75,24 @@ public:
      * Configuration.
      *
      * set_target returns true on success.
-     * set_recipients cannot be called if files are open.
+     * set_recipients cannot be called if files are open.  If every
+     * recipient is an explicit fingerprint (see gpg_recipient), gpg is told
+     * to trust their keys rather than consult its trust database.
      */
     bool set_target(const std::string & target);
     void set_read(bool read);
     void set_recipients(const std::vector<gpg_recipient> & recipients);
 
+    /**
+     * set_read_only serves the target without modifying it, which implies
+     * set_read(true).  Each file is decrypted once, in full, when first
+     * opened, and its plaintext is shared by every handle open on it until
+     * the last is closed.  Reads then take no locks.  A file changed since
+     * it was decrypted is decrypted again when next opened, while the
+     * handles already open keep reading what they opened.
+     */
+    void set_read_only(bool read_only);
+
     /**
      * set_mlock specifies the memory locking behavior to use.  If set_mlock is
      * not called before use, memory_lock_default is used.
@@ -61,8 +103,172 @@ public:
     /**
      * set_gpg specifies the path to the GPG binary.  If set_gpg is not called
      * before use, "gpg" in the normal search path is used.
+     *
+     * set_gpg_arguments passes arguments to every run of gpg, ahead of its
+     * others, such as those of a gpg_home.
      */
     void set_gpg(const std::string& gpg_path);
+    void set_gpg_arguments(const std::vector<std::string>& arguments);
+
+    /**
+     * set_raw_view exposes the backing ciphertext, read-only, beneath the
+     * virtual directory raw_view_prefix.  It is disabled by default.
+     */
+    static const char raw_view_prefix[];
+    void set_raw_view(bool raw_view);
+
+    /**
+     * set_directory_cache bounds the number of parent directory descriptors
+     * kept open to shorten path lookups.  If 0, none are kept.
+     */
+    static const size_t directory_cache_default;
+    void set_directory_cache(size_t entries);
+
+    /**
+     * Connection parameters negotiated with the kernel during init().
+     * max_write and max_readahead are upper bounds:  if zero, or larger than
+     * what the kernel and libfuse support, their limits are used instead.
+     * Capabilities are only requested if the kernel offers them.
+     */
+    struct connection_options {
+        connection_options();
+
+        unsigned max_write;
+        unsigned max_readahead;
+        bool async_read;
+        bool big_writes;
+        bool splice;
+    };
+    void set_connection_options(const connection_options& c);
+
+    /**
+     * set_flush_jobs bounds the number of files destroy encrypts at once.  If
+     * 0, the number of processors is used.
+     */
+    void set_flush_jobs(unsigned jobs);
+
+    /**
+     * The number of files destroy was unable to save.
+     */
+    size_t failed_flushes() const;
+
+    /**
+     * set_fsync_window bounds how long, in microseconds, an fsync waits for
+     * others still encrypting their files so that they can be synced
+     * together.
+     */
+    static const unsigned fsync_window_default;
+    void set_fsync_window(unsigned microseconds);
+
+    /**
+     * set_gpg_jobs bounds the number of gpg processes run at once, and the
+     * number run for any one user.  If jobs is 0, the number of processors
+     * is used; if per_user is 0, users are not limited individually.
+     */
+    void set_gpg_jobs(unsigned jobs, unsigned per_user);
+    admission::statistics gpg_statistics() const;
+
+    /**
+     * Files are decrypted in the foreground, as requests are waiting for
+     * them, while encryption happens in the background.  Queued foreground
+     * jobs are started first, and background jobs run gpg with nice added to
+     * its nice value and, if io_level is non-negative, at that best-effort
+     * I/O priority.
+     */
+    static const int background_nice_default;
+    static const int background_io_level_default;
+    void set_background_priority(int nice, int io_level);
+
+    /**
+     * Where gpg processes run.  Unless cgroup_path is empty, they join that
+     * cgroup v2 directory, which is created if needed, and whose cpu.weight
+     * and cpu.max are set unless cpu_weight is 0 or cpu_max is empty.
+     * Unless cpus (such as "0-3,6") is empty, they are pinned to those CPUs.
+     */
+    struct placement {
+        placement();
+
+        std::string cgroup_path;
+        unsigned cpu_weight;
+        std::string cpu_max;
+        std::string cpus;
+    };
+
+    /**
+     * set_placement places the gpg processes of foreground (decrypting) or
+     * background (encrypting) jobs.  Returns 0 on success, otherwise the
+     * corresponding standard error code.
+     */
+    int set_placement(admission::priority p, const placement& where);
+
+    /**
+     * set_requester registers a callback returning the user making the
+     * current request, to whom a file's gpg jobs are attributed.  By
+     * default, jobs are attributed to the effective user.
+     */
+    typedef std::function<uid_t()> requester;
+    void set_requester(const requester& callback);
+
+    /**
+     * set_interruption registers a callback returning true if the current
+     * request was interrupted, in which case decrypting a file for it is
+     * paused and the request fails with EINTR.
+     */
+    typedef std::function<bool()> interruption;
+    void set_interruption(const interruption& callback);
+
+    /**
+     * set_plaintext_cache keeps up to bytes of plaintext of closed files, each
+     * for up to ttl, so files reopened soon after need not be decrypted
+     * again.  If either is 0, nothing is kept.
+     */
+    void set_plaintext_cache(size_t bytes, std::chrono::milliseconds ttl);
+    plaintext_cache::statistics plaintext_statistics() const;
+
+    /**
+     * drop_plaintext discards the plaintext kept of closed files.
+     * watch_memory_pressure does so whenever tasks stall waiting on memory
+     * for stall of any 2 second window.  It returns 0 on success, otherwise
+     * the corresponding standard error code.
+     */
+    void drop_plaintext();
+    int watch_memory_pressure(std::chrono::milliseconds stall);
+
+    /**
+     * set_prefetch decrypts up to depth files ahead of a scan through a
+     * directory (see prefetcher) into the plaintext cache, as background
+     * jobs, keeping each for up to ttl unless it is opened.  If depth is 0,
+     * nothing is prefetched.  Files are only prefetched when reading.
+     */
+    void set_prefetch(unsigned depth, std::chrono::milliseconds ttl);
+    prefetcher::statistics prefetch_statistics() const;
+
+    /**
+     * set_warmup_manifest records which files are opened most in a manifest
+     * at path, encrypted to the recipients and saved by destroy, keeping up
+     * to files of them.  warm_up starts decrypting those files into the
+     * plaintext cache in the background, hottest first, keeping each for up
+     * to ttl unless it is opened.  It stops once the cache is full.  warm_up
+     * returns 0 on success, otherwise the corresponding standard error code.
+     * Files are only recorded and warmed up when reading.
+     */
+    void set_warmup_manifest(const std::string& path, size_t files);
+    int warm_up(std::chrono::milliseconds ttl);
+
+    /**
+     * watch_target watches the target for changes made by other processes,
+     * so what was decrypted of the files changed is discarded.  The kernel's
+     * cached attributes and entries are not invalidated; they expire only
+     * after the attr and entry timeouts.  Returns 0 on success, otherwise the
+     * corresponding standard error code.
+     */
+    int watch_target();
+
+    /**
+     * The number of decryptions stopped because the file was closed before
+     * it was read to the end.
+     */
+    uint64_t cancelled_decryptions() const;
 
     bool ready() const;
 
@@ -70,6 +276,12 @@ public:
      * Filesystem operations.
      */
     void* init(struct fuse_conn_info *conn);
+    /**
+     * destroy closes every file still open when the filesystem is unmounted,
+     * encrypting unsaved changes in parallel.  Progress and failures are
+     * reported on standard error.
+     */
+    void destroy(void *private_data);
 
     int access(const char *path, int mode);
     int chmod(const char *path, mode_t mode);
@@ -77,10 +289,18 @@ public:
     int create(const char *path, mode_t mode, struct fuse_file_info *info);
     int fgetattr(const char *path, struct stat *buf,
         struct fuse_file_info *info);
+    /**
+     * flush encrypts any unsaved changes to the file as each of its
+     * descriptors is closed.  fsync does so as well, appending only the bytes
+     * written past its encrypted contents where possible, and then syncs the
+     * ciphertext.  Neither closes the file.
+     */
     int flush(const char *path, struct fuse_file_info *info);
-    int fsync(const char *path, struct fuse_file_info *info);
+    int fsync(const char *path, int datasync, struct fuse_file_info *info);
     int ftruncate(const char *path, off_t offset, struct fuse_file_info *info);
     int getattr(const char *path, struct stat *s);
+    int ioctl(const char *path, int cmd, void *arg,
+        struct fuse_file_info *info, unsigned int flags, void *data);
     int link(const char *oldpath, const char *newpath);
     #ifdef HAS_XATTR
     int listxattr(const char *path, char *buffer, size_t size);
@@ -90,6 +310,8 @@ public:
     int opendir(const char *path, struct fuse_file_info *info);
     int read(const char *path, void *buffer, size_t size, off_t offset,
         struct fuse_file_info *info);
+    int read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+        off_t offset, struct fuse_file_info *info);
     int readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *info);
     int readlink(const char *path, char *buffer, size_t size);
@@ -116,41 +338,237 @@ private:
     fd_t next_fd();
 
     bool read_;
+    bool read_only_;
+    bool raw_view_;
     bool root_set_;
     int root_;
+    directory_cache parents_;
 
     options options_;
+    connection_options connection_;
+    unsigned flush_jobs_;
+    size_t failed_flushes_;
+    group_commit syncs_;
+    admission gpg_jobs_;
+    /* The limit on gpg jobs set_gpg_jobs put in place. */
+    unsigned gpg_job_limit_;
+    requester requester_;
+    interruption interrupted_;
+    std::atomic<uint64_t> cancelled_decryptions_;
+    /*
+     * Decryptions paused with gpg running, which are bounded by
+     * gpg_job_limit_.
+     */
+    std::atomic<unsigned> paused_decryptions_;
+    plaintext_cache plaintext_;
+    target_watcher watcher_;
+    memory_pressure pressure_;
+
+    bool prefetching_;
+    std::chrono::milliseconds prefetch_ttl_;
+    prefetcher prefetch_;
+
+    /**
+     * Decrypts path into the plaintext cache for user, unless it is open or
+     * cached already, keeping it for up to ttl.  Returns false if the
+     * plaintext did not fit.  list_files returns the regular files in dir.
+     */
+    bool prefetch(const std::string& path, uid_t user,
+        std::chrono::milliseconds ttl);
+    std::vector<std::string> list_files(const std::string& dir);
+
+    std::string manifest_path_;
+    size_t manifest_files_;
+    access_manifest accesses_;
+    /* Set once the saved manifest has been merged into accesses_. */
+    bool manifest_loaded_;
+    std::atomic<bool> warmup_stopping_;
+    std::thread warmup_;
+
+    /**
+     * load_manifest merges the saved manifest into accesses_, if it was not
+     * already.  replay warms up the files it lists, and save_manifest
+     * replaces it with accesses_.  save_manifest returns 0 on success,
+     * otherwise the corresponding standard error code.
+     */
+    void load_manifest();
+    void replay(std::chrono::milliseconds ttl);
+    int save_manifest();
+    void stop_warmup();
+
+    /**
+     * Reports path, just opened, to the prefetcher and the manifest.  The
+     * caller should not hold mx_.
+     */
+    void opened(const char *path);
+
+    /**
+     * Handle changes to the target reported by watcher_.  relpath is
+     * relative to the target.
+     */
+    void backing_changed(const std::string& relpath, bool is_directory);
+    void backing_overflowed();
+
+    /**
+     * Opens path again, as open did with flags, returning the new descriptor
+     * or -1, setting errno.
+     */
+    int reopen(const std::string& path, int flags);
+    cgroup foreground_cgroup_;
+    cgroup background_cgroup_;
 
     /**
-     * This protects all internal data structures.
+     * This protects all internal data structures, except the contents of each
+     * open file (see internal::mx).  Requests waiting on gpg to decrypt or
+     * encrypt a file hold only that file's lock, so requests for other files
+     * proceed meanwhile.  mx_ may be acquired while holding a file's lock,
+     * but not the reverse.
      */
-    std::mutex mx_;
+    mutable std::mutex mx_;
 
     fd_t next_;
-    typedef std::unordered_map<std::string, fd_t> open_map_t;
+    /**
+     * The keys of open_paths_ refer to internal::path of the corresponding
+     * open file.
+     */
+    typedef std::unordered_map<path_ref, fd_t, path_ref::hash> open_map_t;
     open_map_t open_paths_;
 
     class internal;
-    typedef std::unordered_map<fd_t, internal *> open_fd_map_t;
+    typedef std::shared_ptr<internal> internal_ptr;
+    typedef std::unordered_map<fd_t, internal_ptr> open_fd_map_t;
     open_fd_map_t open_fds_;
 
     /**
-     * A mapping from directory handles to their opened paths.
+     * Files whose ciphertext is being rewritten without mx_ held, on release
+     * or by truncating a file that is not open, keyed by internal::path.
+     * Operations that would otherwise observe partially written ciphertext
+     * wait on busy_cv_ until the file leaves busy_paths_.
+     */
+    typedef std::unordered_map<path_ref, internal_ptr, path_ref::hash>
+        busy_map_t;
+    busy_map_t busy_paths_;
+    std::condition_variable busy_cv_;
+
+    /**
+     * Blocks until path is not busy.  l must hold mx_.
+     */
+    void wait_idle(std::unique_lock<std::mutex>& l, const char *path);
+
+    /**
+     * Removes file from busy_paths_ and wakes any waiters.
+     */
+    void finish_busy(const internal_ptr& file);
+
+    /**
+     * Returns the open file for handle fd, or an empty pointer if there is
+     * none.
+     */
+    internal_ptr find_file(fd_t fd);
+
+    /**
+     * Handle the commands of control.h for ioctl.  hint_load queues file on
+     * the prefetcher, whose thread decrypts it with load_hinted.  They return
+     * 0 on success, otherwise the corresponding standard error code.
+     */
+    int hint_load(const internal_ptr& file);
+    static void load_hinted(const internal_ptr& file);
+    int evict(const internal_ptr& file);
+    int query(const internal_ptr& file, struct asymmetricfs_status *status);
+
+    /**
+     * In read-only mode, files are shared by their handles, and keyed here by
+     * internal::path until a newer version of the file is opened.
+     * internal::references counts the handles open on each.
+     */
+    typedef std::unordered_map<path_ref, internal_ptr, path_ref::hash>
+        shared_map_t;
+    shared_map_t shared_paths_;
+
+    /**
+     * In read-only mode, fuse_file_info::fh points to a shared_handle.
+     */
+    struct shared_handle;
+    static shared_handle* find_shared(const struct fuse_file_info *info);
+
+    /**
+     * Opens path, read-only, decrypting it unless it is already open.
+     */
+    int open_shared(const char *path, struct fuse_file_info *info);
+
+    /**
+     * Drops a handle's reference to file, closing it once it is unused.
+     */
+    void release_shared(const internal_ptr& file);
+
+    /**
+     * Adjusts the attributes s of path to match the version of it open in
+     * read-only mode, if any, and clears its write bits.
+     */
+    void shared_attributes(const path_ref& path, struct stat *s);
+
+    /**
+     * A mapping from handles opened beneath raw_view_prefix to the
+     * underlying, read-only file descriptors.
+     */
+    typedef std::unordered_map<fd_t, int> raw_fd_map_t;
+    raw_fd_map_t raw_fds_;
+
+    /**
+     * Returns true if path lies within the raw view.  If so, relpath is set to
+     * the corresponding path relative to root_.
+     */
+    bool raw_path(const char *path, std::string* relpath) const;
+
+    /**
+     * Returns false if path may not be modified, as it lies within the raw
+     * view or the filesystem is read-only.
      */
-    std::unordered_map<uint64_t, std::string> open_dirs_;
+    bool writable(const char *path) const;
 
     /**
-     * Stats an open internal fd.  The caller should hold a lock.
+     * Open directory handles.  dirs_mx_ protects only the table itself; each
+     * directory carries its own lock for the state of its listing, so
+     * concurrent scans of different directories do not contend.
      */
-    int statfd(fd_t fd, struct stat *buf);
+    class directory;
+    typedef std::shared_ptr<directory> directory_ptr;
+    std::mutex dirs_mx_;
+    uint64_t next_dir_;
+    std::unordered_map<uint64_t, directory_ptr> open_dirs_;
 
     /**
-     * Truncates an open internal fd.  The caller should hold a lock.
+     * Returns the directory for handle, or an empty pointer if it is not
+     * open.
      */
-    int truncatefd(fd_t fd, off_t offset);
+    directory_ptr find_directory(uint64_t handle);
+
+    /**
+     * Stats an open file.  The caller should not hold mx_ or the file's lock.
+     * Returns -ESTALE if the file was closed after it was looked up.
+     */
+    int stat_file(internal& file, struct stat *buf);
+
+    /**
+     * Truncates an open file.  The caller should not hold mx_ or the file's
+     * lock.  Returns -ESTALE if the file was closed after it was looked up.
+     */
+    int truncate_file(internal& file, off_t offset);
+
+    /**
+     * Syncs the directory file's backing file was replaced in, if it has
+     * been since last synced.  Returns 0 on success, otherwise the
+     * corresponding standard error code.  The caller should hold file.mx.
+     */
+    int sync_parent(internal& file);
 
     int make_rdwr(int flags) const;
 
+    /**
+     * Opens relpath, read-only, as a handle in the raw view.
+     */
+    int open_raw(const std::string& relpath, struct fuse_file_info *info);
+
     asymmetricfs(const asymmetricfs &) = delete;
     const asymmetricfs & operator=(const asymmetricfs &) = delete;
 };
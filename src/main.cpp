@@ -23,7 +23,11 @@
 namespace std { class type_info; }
 
 #include <boost/program_options.hpp>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
+#include "gpg_home.h"
 #include "implementation.h"
 #include <iostream>
 #include "memory_lock.h"
@@ -31,9 +35,17 @@ namespace std { class type_info; }
 #include <string>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <unistd.h>
 #include <vector>
 
 static asymmetricfs impl;
+/* Removed as we exit; daemonizing leaves with _exit. */
+static gpg_home private_home;
+/* Started from init, as threads do not survive daemonizing. */
+static bool watch_target = false;
+static unsigned memory_pressure_ms = 0;
+static bool warm_up = false;
+static std::chrono::milliseconds warmup_ttl(0);
 
 static int helper_access(const char *path, int mode) {
     return impl.access(path, mode);
@@ -52,6 +64,19 @@ static int helper_create(const char *path, mode_t mode,
     return impl.create(path, mode, info);
 }
 
+static void helper_destroy(void *private_data) {
+    impl.destroy(private_data);
+}
+
+static int helper_flush(const char *path, struct fuse_file_info *info) {
+    return impl.flush(path, info);
+}
+
+static int helper_fsync(const char *path, int datasync,
+        struct fuse_file_info *info) {
+    return impl.fsync(path, datasync, info);
+}
+
 static int helper_ftruncate(const char *path, off_t offset,
         struct fuse_file_info *info) {
     return impl.ftruncate(path, offset, info);
@@ -62,9 +87,39 @@ static int helper_getattr(const char *path, struct stat *s) {
 }
 
 static void* helper_init(struct fuse_conn_info *conn) {
+    if (watch_target) {
+        const int ret = impl.watch_target();
+        if (ret != 0) {
+            std::cerr << "asymmetricfs: unable to watch the target: "
+                      << strerror(ret) << std::endl;
+        }
+    }
+
+    if (memory_pressure_ms > 0) {
+        const int ret = impl.watch_memory_pressure(
+            std::chrono::milliseconds(memory_pressure_ms));
+        if (ret != 0) {
+            std::cerr << "asymmetricfs: unable to watch memory pressure: "
+                      << strerror(ret) << std::endl;
+        }
+    }
+
+    if (warm_up) {
+        const int ret = impl.warm_up(warmup_ttl);
+        if (ret != 0) {
+            std::cerr << "asymmetricfs: unable to warm up: "
+                      << strerror(ret) << std::endl;
+        }
+    }
+
     return impl.init(conn);
 }
 
+static int helper_ioctl(const char *path, int cmd, void *arg,
+        struct fuse_file_info *info, unsigned int flags, void *data) {
+    return impl.ioctl(path, cmd, arg, info, flags, data);
+}
+
 static int helper_link(const char *oldpath, const char *newpath) {
     return impl.link(oldpath, newpath);
 }
@@ -86,6 +141,11 @@ static int helper_read(const char *path, char *buffer, size_t size,
     return impl.read(path, buffer, size, offset, info);
 }
 
+static int helper_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *info) {
+    return impl.read_buf(path, bufp, size, offset, info);
+}
+
 static int helper_readdir(const char *path, void * v, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info * info) {
     return impl.readdir(path, v, filler, offset, info);
@@ -160,22 +220,153 @@ int main(int argc, char **argv) {
     typedef std::vector<gpg_recipient> RecipientList;
     RecipientList recipients;
     std::string gpg_path;
+    std::string private_gpg_home;
     std::string target;
     std::string mount_point;
     memory_lock mlock_value;
+    asymmetricfs::connection_options connection;
+    double attr_timeout = 0, entry_timeout = 0, negative_timeout = 0;
+    size_t directory_cache = 0;
+    size_t plaintext_cache_mb = 0;
+    double plaintext_cache_ttl = 0;
+    unsigned memory_pressure = 0;
+    unsigned prefetch = 0;
+    double prefetch_ttl = 0;
+    std::string warmup_manifest;
+    size_t warmup_files = 0;
+    double warmup_ttl_s = 0;
+    unsigned flush_jobs = 0;
+    unsigned fsync_window = 0;
+    unsigned gpg_jobs = 0, gpg_jobs_per_user = 0;
+    int background_nice = 0, background_io_level = 0;
+    asymmetricfs::placement encrypt_placement, decrypt_placement;
 
     po::options_description visible("Options");
     visible.add_options()
         ("help",    "Provides this help message.")
         ("rw",          po::value<bool>()->zero_tokens(), "Read-write mode.")
         ("wo",          po::value<bool>()->zero_tokens(), "Write-only mode.")
+        ("read-only",   po::value<bool>()->zero_tokens(),
+            "Serve decrypted files without allowing changes.")
         ("gpg-binary",
             po::value<std::string>(&gpg_path)->default_value(STR(GPG_PATH)),
             "Path to GPG binary.")
+        ("private-gpg-home",
+            po::value<std::string>(&private_gpg_home)->implicit_value(""),
+            "Run gpg with only the keys needed, from a directory made "
+            "beneath this one ($XDG_RUNTIME_DIR or /dev/shm if omitted).")
+        ("raw-view",    po::value<bool>()->zero_tokens(),
+            "Expose ciphertext read-only beneath /.raw.")
+        ("watch-target", po::value<bool>()->zero_tokens(),
+            "Notice changes made to the target by other processes.")
         ("memory-lock",
             po::value<memory_lock>(&mlock_value)->
                 default_value(asymmetricfs::memory_lock_default),
             "Memory locking behavior (all|buffers|none)")
+        ("directory-cache",
+            po::value<size_t>(&directory_cache)->
+                default_value(asymmetricfs::directory_cache_default),
+            "Number of directory descriptors cached for path lookups.")
+        ("plaintext-cache",
+            po::value<size_t>(&plaintext_cache_mb)->default_value(0),
+            "MiB of plaintext kept for closed files; 0 disables.")
+        ("plaintext-cache-ttl",
+            po::value<double>(&plaintext_cache_ttl)->default_value(5.0),
+            "Seconds plaintext of a closed file is kept.")
+        ("prefetch",
+            po::value<unsigned>(&prefetch)->default_value(0),
+            "Files decrypted ahead of directory scans; 0 disables.")
+        ("prefetch-ttl",
+            po::value<double>(&prefetch_ttl)->default_value(1.0),
+            "Seconds a prefetched file is kept unless opened.")
+        ("warmup-manifest",
+            po::value<std::string>(&warmup_manifest),
+            "Record the files opened most here, and decrypt them at mount.")
+        ("warmup-files",
+            po::value<size_t>(&warmup_files)->default_value(256),
+            "Number of files the warm-up manifest keeps.")
+        ("warmup-ttl",
+            po::value<double>(&warmup_ttl_s)->default_value(300.0),
+            "Seconds a warmed-up file is kept unless opened.")
+        ("memory-pressure",
+            po::value<unsigned>(&memory_pressure)->default_value(200),
+            "Drop cached plaintext when memory stalls exceed this many ms "
+            "in 2 s; 0 disables.")
+        ("max-write",
+            po::value<unsigned>(&connection.max_write)->
+                default_value(connection.max_write),
+            "Largest write request accepted from the kernel, in bytes.")
+        ("max-readahead",
+            po::value<unsigned>(&connection.max_readahead)->
+                default_value(connection.max_readahead),
+            "Largest readahead requested by the kernel, in bytes.")
+        ("async-read",
+            po::value<bool>(&connection.async_read)->
+                default_value(connection.async_read),
+            "Allow the kernel to issue concurrent read requests.")
+        ("big-writes",
+            po::value<bool>(&connection.big_writes)->
+                default_value(connection.big_writes),
+            "Allow write requests larger than a page.")
+        ("splice",
+            po::value<bool>(&connection.splice)->
+                default_value(connection.splice),
+            "Use splice to transfer data to and from the kernel.")
+        ("attr-timeout",
+            po::value<double>(&attr_timeout)->default_value(1.0),
+            "Seconds the kernel may cache file attributes.")
+        ("entry-timeout",
+            po::value<double>(&entry_timeout)->default_value(1.0),
+            "Seconds the kernel may cache name lookups.")
+        ("negative-timeout",
+            po::value<double>(&negative_timeout)->default_value(0.0),
+            "Seconds the kernel may cache failed name lookups.")
+        ("flush-jobs",
+            po::value<unsigned>(&flush_jobs)->default_value(0),
+            "Files encrypted at once when unmounting (0: one per CPU).")
+        ("gpg-jobs",
+            po::value<unsigned>(&gpg_jobs)->default_value(0),
+            "gpg processes run at once (0: one per CPU).")
+        ("gpg-jobs-per-user",
+            po::value<unsigned>(&gpg_jobs_per_user)->default_value(0),
+            "gpg processes run at once for any one user (0: no limit).")
+        ("background-nice",
+            po::value<int>(&background_nice)->
+                default_value(asymmetricfs::background_nice_default),
+            "Added to the nice value of gpg when encrypting.")
+        ("background-io-level",
+            po::value<int>(&background_io_level)->
+                default_value(asymmetricfs::background_io_level_default),
+            "Best-effort I/O priority (0-7) of gpg when encrypting "
+            "(-1: unchanged).")
+        ("encrypt-cgroup",
+            po::value<std::string>(&encrypt_placement.cgroup_path),
+            "cgroup v2 directory gpg joins when encrypting.")
+        ("encrypt-cpu-weight",
+            po::value<unsigned>(&encrypt_placement.cpu_weight),
+            "cpu.weight of --encrypt-cgroup (1-10000).")
+        ("encrypt-cpu-max",
+            po::value<std::string>(&encrypt_placement.cpu_max),
+            "cpu.max of --encrypt-cgroup (\"$MAX $PERIOD\").")
+        ("encrypt-cpus",
+            po::value<std::string>(&encrypt_placement.cpus),
+            "CPUs gpg runs on when encrypting (e.g., 0-3,6).")
+        ("decrypt-cgroup",
+            po::value<std::string>(&decrypt_placement.cgroup_path),
+            "cgroup v2 directory gpg joins when decrypting.")
+        ("decrypt-cpu-weight",
+            po::value<unsigned>(&decrypt_placement.cpu_weight),
+            "cpu.weight of --decrypt-cgroup (1-10000).")
+        ("decrypt-cpu-max",
+            po::value<std::string>(&decrypt_placement.cpu_max),
+            "cpu.max of --decrypt-cgroup (\"$MAX $PERIOD\").")
+        ("decrypt-cpus",
+            po::value<std::string>(&decrypt_placement.cpus),
+            "CPUs gpg runs on when decrypting (e.g., 0-3,6).")
+        ("fsync-window",
+            po::value<unsigned>(&fsync_window)->
+                default_value(asymmetricfs::fsync_window_default),
+            "Microseconds an fsync waits to be synced with others.")
         ("recipient,r",
             po::value<RecipientList>(&recipients)->required(),
             "Key to encrypt to.");
@@ -204,10 +395,9 @@ int main(int argc, char **argv) {
         po::store(parsed, vm);
         po::notify(vm);
 
-        // Validate recipients now that gpg_path has been parsed.
-        for (const auto& r : recipients) {
-            r.validate(gpg_path);
-        }
+        // Validate recipients now that gpg_path has been parsed, pinning
+        // each to its key's fingerprint.
+        recipients = gpg_recipient::resolve(recipients, gpg_path);
 
         unrecognized =
             collect_unrecognized(parsed.options, po::exclude_positional);
@@ -216,17 +406,103 @@ int main(int argc, char **argv) {
         errors.push_back(ex.what());
     }
 
-    const bool read = vm.count("rw");
-    const bool wo   = vm.count("wo");
-    if (read && wo) {
-        errors.push_back("--rw and --wo are mutually exclusive.");
-    } else if (!(read || wo)) {
-        errors.push_back("--rw or --wo must be specified.");
+    const bool read      = vm.count("rw");
+    const bool wo        = vm.count("wo");
+    const bool read_only = vm.count("read-only");
+    if (int(read) + int(wo) + int(read_only) > 1) {
+        errors.push_back("--rw, --wo and --read-only are mutually "
+            "exclusive.");
+    } else if (!(read || wo || read_only)) {
+        errors.push_back("--rw, --wo or --read-only must be specified.");
     }
 
     impl.set_gpg(gpg_path);
     impl.set_mlock(mlock_value);
     impl.set_read(read);
+    impl.set_read_only(read_only);
+    impl.set_raw_view(vm.count("raw-view"));
+    watch_target = vm.count("watch-target");
+    impl.set_directory_cache(directory_cache);
+    if (plaintext_cache_ttl < 0) {
+        errors.push_back("--plaintext-cache-ttl must not be negative.");
+    } else {
+        impl.set_plaintext_cache(plaintext_cache_mb << 20,
+            std::chrono::milliseconds(
+                static_cast<int64_t>(plaintext_cache_ttl * 1000)));
+    }
+    if (prefetch > 0 && plaintext_cache_mb == 0) {
+        errors.push_back("--prefetch requires --plaintext-cache.");
+    } else if (prefetch > 0 && wo) {
+        errors.push_back("--prefetch requires --rw or --read-only.");
+    } else if (prefetch_ttl < 0) {
+        errors.push_back("--prefetch-ttl must not be negative.");
+    } else {
+        impl.set_prefetch(prefetch, std::chrono::milliseconds(
+            static_cast<int64_t>(prefetch_ttl * 1000)));
+    }
+    if (warmup_manifest.empty()) {
+        /* Nothing is recorded or replayed. */
+    } else if (plaintext_cache_mb == 0) {
+        errors.push_back("--warmup-manifest requires --plaintext-cache.");
+    } else if (wo) {
+        errors.push_back("--warmup-manifest requires --rw or --read-only.");
+    } else if (warmup_ttl_s < 0) {
+        errors.push_back("--warmup-ttl must not be negative.");
+    } else {
+        /* Daemonizing changes the working directory. */
+        char cwd[PATH_MAX];
+        if (warmup_manifest[0] != '/' && getcwd(cwd, sizeof(cwd))) {
+            warmup_manifest = std::string(cwd) + "/" + warmup_manifest;
+        }
+
+        impl.set_warmup_manifest(warmup_manifest, warmup_files);
+        warm_up = true;
+        warmup_ttl = std::chrono::milliseconds(
+            static_cast<int64_t>(warmup_ttl_s * 1000));
+    }
+    if (memory_pressure > 2000) {
+        errors.push_back("--memory-pressure must not exceed 2000.");
+    } else if (plaintext_cache_mb > 0) {
+        /* Only cached plaintext can be dropped. */
+        memory_pressure_ms = memory_pressure;
+    }
+    impl.set_flush_jobs(flush_jobs);
+    impl.set_fsync_window(fsync_window);
+    impl.set_gpg_jobs(gpg_jobs, gpg_jobs_per_user);
+    impl.set_background_priority(background_nice, background_io_level);
+    if (errors.empty()) {
+        int ret = impl.set_placement(admission::priority::background,
+            encrypt_placement);
+        if (ret) {
+            errors.push_back(std::string("Unable to place gpg for "
+                "encryption: ") + strerror(ret));
+        }
+
+        ret = impl.set_placement(admission::priority::foreground,
+            decrypt_placement);
+        if (ret) {
+            errors.push_back(std::string("Unable to place gpg for "
+                "decryption: ") + strerror(ret));
+        }
+    }
+    impl.set_requester([]() { return fuse_get_context()->uid; });
+    impl.set_interruption([]() { return fuse_interrupted() != 0; });
+    impl.set_connection_options(connection);
+    if (errors.empty() && !(usage) && vm.count("private-gpg-home")) {
+        std::string parent = private_gpg_home;
+        if (parent.empty()) {
+            const char *runtime = getenv("XDG_RUNTIME_DIR");
+            parent = runtime ? runtime : "/dev/shm";
+        }
+
+        const int ret = private_home.create(parent, gpg_path, recipients);
+        if (ret) {
+            errors.push_back(std::string("Unable to create a private gpg "
+                "home: ") + strerror(ret));
+        } else {
+            impl.set_gpg_arguments(private_home.arguments());
+        }
+    }
     impl.set_recipients(recipients);
     if (errors.empty()) {
         if (target.empty()) {
@@ -258,6 +534,16 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* Kernel caching is configured through FUSE's own mount options. */
+    unrecognized.push_back("-oattr_timeout=" + std::to_string(attr_timeout));
+    unrecognized.push_back("-oentry_timeout=" + std::to_string(entry_timeout));
+    unrecognized.push_back(
+        "-onegative_timeout=" + std::to_string(negative_timeout));
+    if (read_only) {
+        /* The kernel then refuses changes before they reach us. */
+        unrecognized.push_back("-oro");
+    }
+
     /* Build argument list to pass into FUSE. */
     std::vector<char *> fuse_argv;
     const size_t n_unrecognized = unrecognized.size();
@@ -282,14 +568,19 @@ int main(int argc, char **argv) {
     ops.chmod       = helper_chmod;
     ops.chown       = helper_chown;
     ops.create      = helper_create;
+    ops.destroy     = helper_destroy;
+    ops.flush       = helper_flush;
+    ops.fsync       = helper_fsync;
     ops.ftruncate   = helper_ftruncate;
     ops.getattr     = helper_getattr;
     ops.init        = helper_init;
+    ops.ioctl       = helper_ioctl;
     ops.link        = helper_link;
     ops.mkdir       = helper_mkdir;
     ops.open        = helper_open;
     ops.opendir     = helper_opendir;
     ops.read        = helper_read;
+    ops.read_buf    = helper_read_buf;
     ops.readdir     = helper_readdir;
     ops.readlink    = helper_readlink;
     ops.release     = helper_release;
@@ -342,5 +633,14 @@ int main(int argc, char **argv) {
             break;
     }
 
-    return fuse_main(fuse_argc, fuse_argv.data(), &ops, NULL);
+    int ret = fuse_main(fuse_argc, fuse_argv.data(), &ops, NULL);
+    if (ret == 0 && impl.failed_flushes() > 0) {
+        /*
+         * Modified files were lost on unmount.  Unless run with -f, fuse_main
+         * daemonized and whoever started us has long since seen 0; the
+         * failures are logged to syslog for that case.
+         */
+        ret = 1;
+    }
+    return ret;
 }
@@ -0,0 +1,98 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <fcntl.h>
+#include "memory_pressure.h"
+#include <poll.h>
+#include <string>
+#include <unistd.h>
+
+memory_pressure::memory_pressure(const handler& relieve) :
+        relieve_(relieve), trigger_(-1) {
+    wake_[0] = -1;
+    wake_[1] = -1;
+}
+
+memory_pressure::~memory_pressure() {
+    stop();
+}
+
+int memory_pressure::start(std::chrono::microseconds stall,
+        std::chrono::microseconds window) {
+    stop();
+
+    if (stall.count() <= 0 || stall > window) {
+        return EINVAL;
+    }
+
+    /* The trigger stays registered for as long as the file is open. */
+    const std::string trigger = "some " + std::to_string(stall.count()) +
+        " " + std::to_string(window.count());
+    trigger_ = ::open("/proc/pressure/memory",
+        O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    int ret = 0;
+    if (trigger_ < 0 || pipe2(wake_, O_CLOEXEC) != 0 ||
+            ::write(trigger_, trigger.c_str(), trigger.size() + 1) < 0) {
+        ret = errno;
+    }
+
+    if (ret != 0) {
+        stop();
+        return ret;
+    }
+
+    thread_ = std::thread(&memory_pressure::run, this);
+    return 0;
+}
+
+void memory_pressure::stop() {
+    if (thread_.joinable()) {
+        (void) ::write(wake_[1], "", 1);
+        thread_.join();
+    }
+
+    for (int *fd : {&trigger_, &wake_[0], &wake_[1]}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void memory_pressure::run() {
+    struct pollfd fds[2];
+    fds[0].fd = trigger_;
+    fds[0].events = POLLPRI;
+    fds[1].fd = wake_[0];
+    fds[1].events = POLLIN;
+
+    while (true) {
+        const int ret = poll(fds, 2, -1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0 || fds[1].revents) {
+            return;
+        } else if (fds[0].revents & POLLERR) {
+            /* The kernel no longer monitors pressure for us. */
+            return;
+        } else if (fds[0].revents & POLLPRI) {
+            relieve_();
+        }
+    }
+}
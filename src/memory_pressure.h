@@ -0,0 +1,64 @@
+#ifndef __ASYMMETRICFS__MEMORY_PRESSURE_H__
+#define __ASYMMETRICFS__MEMORY_PRESSURE_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <functional>
+#include <thread>
+
+/**
+ * memory_pressure reports when the system runs short of memory, using the
+ * kernel's pressure stall information:  whenever tasks spend at least stall
+ * of any window waiting on memory, relieve is called from a background
+ * thread.
+ */
+class memory_pressure {
+public:
+    typedef std::function<void()> handler;
+
+    explicit memory_pressure(const handler& relieve);
+    ~memory_pressure();
+
+    /**
+     * Starts watching.  Unprivileged processes may only use windows that are
+     * multiples of 2 seconds.  Returns 0 on success, otherwise the
+     * corresponding standard error code.
+     */
+    int start(std::chrono::microseconds stall,
+        std::chrono::microseconds window);
+
+    /**
+     * Stops watching, once any report in progress has been handled.
+     */
+    void stop();
+private:
+    void run();
+
+    handler relieve_;
+
+    int trigger_;
+    int wake_[2];
+    std::thread thread_;
+
+    memory_pressure(const memory_pressure &) = delete;
+    const memory_pressure & operator=(const memory_pressure &) = delete;
+};
+
+#endif // __ASYMMETRICFS__MEMORY_PRESSURE_H__
@@ -392,3 +392,29 @@ void page_buffer::clear() {
     page_allocations_.clear();
     buffer_size_ = 0;
 }
+
+void page_buffer::wipe() {
+    for (auto& it : page_allocations_) {
+        void *ptr = it.second.ptr();
+        memset(ptr, 0, it.second.size());
+        /* Keep the compiler from eliding the memset before munmap. */
+        __asm__ __volatile__("" : : "r"(ptr) : "memory");
+    }
+
+    clear();
+}
+
+void page_buffer::swap(page_buffer& other) {
+    assert(page_size_ == other.page_size_);
+
+    page_allocations_.swap(other.page_allocations_);
+    std::swap(buffer_size_, other.buffer_size_);
+}
+
+size_t page_buffer::allocated() const {
+    size_t total = 0;
+    for (const auto& it : page_allocations_) {
+        total += it.second.size();
+    }
+    return total;
+}
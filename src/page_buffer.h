@@ -86,6 +86,23 @@ public:
      */
     void clear();
 
+    /**
+     * Zeroes the buffer's pages before clearing it, so their contents do not
+     * outlive it in memory.
+     */
+    void wipe();
+
+    /**
+     * Exchanges the contents of this buffer with other's.  Each keeps its
+     * memory locking strategy for the pages it allocates later.
+     */
+    void swap(page_buffer& other);
+
+    /**
+     * Returns the number of bytes of pages allocated.
+     */
+    size_t allocated() const;
+
     /**
      * Splices the contents of the page_buffer into the specified file
      * descriptor, fd.  It falls back to using write() when processing partial
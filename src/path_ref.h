@@ -0,0 +1,73 @@
+#ifndef __ASYMMETRICFS__PATH_REF_H__
+#define __ASYMMETRICFS__PATH_REF_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * path_ref refers to a path it does not own, so the paths FUSE passes to each
+ * operation can be looked up in containers keyed by path without copying
+ * them.  Containers using path_ref keys must keep the referenced storage
+ * alive, and unchanged, for as long as the key is present.
+ */
+class path_ref {
+public:
+    path_ref(const char *data) : data_(data), size_(strlen(data)) {}
+    path_ref(const char *data, size_t size) : data_(data), size_(size) {}
+    path_ref(const std::string& s) : data_(s.data()), size_(s.size()) {}
+
+    const char *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool operator==(const path_ref& rhs) const {
+        return size_ == rhs.size_ && memcmp(data_, rhs.data_, size_) == 0;
+    }
+
+    bool operator!=(const path_ref& rhs) const {
+        return !(*this == rhs);
+    }
+
+    /**
+     * FNV-1a, as std::hash cannot hash characters it does not own in C++11.
+     */
+    struct hash {
+        size_t operator()(const path_ref& p) const {
+            uint64_t h = 14695981039346656037ull;
+            for (size_t i = 0; i < p.size_; i++) {
+                h ^= static_cast<unsigned char>(p.data_[i]);
+                h *= 1099511628211ull;
+            }
+            return static_cast<size_t>(h);
+        }
+    };
+private:
+    const char *data_;
+    size_t size_;
+};
+
+#endif // __ASYMMETRICFS__PATH_REF_H__
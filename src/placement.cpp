@@ -0,0 +1,159 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include "placement.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+cgroup::cgroup() : dir_(-1), procs_(-1) {}
+
+cgroup::~cgroup() {
+    if (procs_ >= 0) {
+        ::close(procs_);
+    }
+    if (dir_ >= 0) {
+        ::close(dir_);
+    }
+}
+
+int cgroup::open(const std::string& path) {
+    if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        return errno;
+    }
+
+    int dir = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) {
+        return errno;
+    }
+
+    int procs = ::openat(dir, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (procs < 0) {
+        const int ret = errno;
+        ::close(dir);
+        return ret;
+    }
+
+    if (procs_ >= 0) {
+        ::close(procs_);
+    }
+    if (dir_ >= 0) {
+        ::close(dir_);
+    }
+
+    path_ = path;
+    dir_ = dir;
+    procs_ = procs;
+    return 0;
+}
+
+int cgroup::procs() const {
+    return procs_;
+}
+
+int cgroup::write_file(const char *name, const std::string& value) {
+    if (dir_ < 0) {
+        return EBADF;
+    }
+
+    int fd = ::openat(dir_, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+
+    int ret = 0;
+    if (::write(fd, value.data(), value.size()) !=
+            static_cast<ssize_t>(value.size())) {
+        ret = errno;
+    }
+    ::close(fd);
+    return ret;
+}
+
+void cgroup::enable_cpu() {
+    /*
+     * The cpu controller's files only appear once the parent delegates the
+     * controller.  This fails harmlessly if it already does, or if we may
+     * not, in which case writing the files reports the error.
+     */
+    int fd = ::openat(dir_, "../cgroup.subtree_control",
+        O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        (void) ::write(fd, "+cpu", 4);
+        ::close(fd);
+    }
+}
+
+int cgroup::set_cpu_weight(unsigned weight) {
+    if (weight < 1 || weight > 10000) {
+        return EINVAL;
+    }
+
+    enable_cpu();
+    return write_file("cpu.weight", std::to_string(weight));
+}
+
+int cgroup::set_cpu_max(const std::string& max) {
+    enable_cpu();
+    return write_file("cpu.max", max);
+}
+
+int parse_cpu_list(const std::string& list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+
+    const char *p = list.c_str();
+    while (*p) {
+        char *end;
+        errno = 0;
+        const unsigned long first = strtoul(p, &end, 10);
+        if (end == p || errno != 0) {
+            return EINVAL;
+        }
+        p = end;
+
+        unsigned long last = first;
+        if (*p == '-') {
+            p++;
+            last = strtoul(p, &end, 10);
+            if (end == p || errno != 0 || last < first) {
+                return EINVAL;
+            }
+            p = end;
+        }
+
+        if (last >= CPU_SETSIZE) {
+            return EINVAL;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+
+        if (*p == ',') {
+            p++;
+            if (!(*p)) {
+                return EINVAL;
+            }
+        } else if (*p) {
+            return EINVAL;
+        }
+    }
+
+    return CPU_COUNT(cpus) > 0 ? 0 : EINVAL;
+}
@@ -0,0 +1,71 @@
+#ifndef __ASYMMETRICFS__PLACEMENT_H__
+#define __ASYMMETRICFS__PLACEMENT_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sched.h>
+#include <string>
+
+/**
+ * cgroup refers to a cgroup v2 directory, into which processes can be moved
+ * by writing to its cgroup.procs.
+ */
+class cgroup {
+public:
+    cgroup();
+    ~cgroup();
+
+    /**
+     * Opens the cgroup at path, creating it if it does not exist.  Returns 0
+     * on success, otherwise the corresponding standard error code.
+     */
+    int open(const std::string& path);
+
+    /**
+     * Sets cpu.weight (1-10000) or cpu.max ("$MAX $PERIOD") of the cgroup,
+     * enabling the cpu controller of its parent as needed.  Returns 0 on
+     * success, otherwise the corresponding standard error code.
+     */
+    int set_cpu_weight(unsigned weight);
+    int set_cpu_max(const std::string& max);
+
+    /**
+     * A descriptor for the cgroup's cgroup.procs, open for writing, or -1 if
+     * no cgroup is open.  A process joins the cgroup by writing "0" to it.
+     */
+    int procs() const;
+private:
+    int write_file(const char *name, const std::string& value);
+    void enable_cpu();
+
+    std::string path_;
+    int dir_;
+    int procs_;
+
+    cgroup(const cgroup &) = delete;
+    const cgroup & operator=(const cgroup &) = delete;
+};
+
+/**
+ * Parses a list of CPUs, such as "0-3,6", into *cpus.  Returns 0 on success,
+ * otherwise EINVAL.
+ */
+int parse_cpu_list(const std::string& list, cpu_set_t *cpus);
+
+#endif // __ASYMMETRICFS__PLACEMENT_H__
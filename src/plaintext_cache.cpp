@@ -0,0 +1,250 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include "page_buffer.h"
+#include "plaintext_cache.h"
+
+typedef std::unique_lock<std::mutex> scoped_lock;
+typedef std::chrono::steady_clock clock_type;
+
+struct plaintext_cache::entry {
+    inode id;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+
+    std::unique_ptr<page_buffer> contents;
+    size_t bytes;
+    clock_type::time_point deadline;
+    bool prefetched;
+};
+
+static bool same_time(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+plaintext_cache::statistics::statistics() : hits(0), misses(0),
+    insertions(0), evictions(0), expirations(0), invalidations(0),
+    entries(0), bytes(0), prefetched(0), prefetch_hits(0),
+    prefetch_wasted(0) {}
+
+plaintext_cache::plaintext_cache(size_t capacity,
+    std::chrono::milliseconds ttl) : capacity_(capacity), ttl_(ttl),
+    stopping_(false) {}
+
+plaintext_cache::~plaintext_cache() {
+    {
+        scoped_lock l(mx_);
+        stopping_ = true;
+        cv_.notify_all();
+    }
+
+    if (reaper_.joinable()) {
+        reaper_.join();
+    }
+
+    while (!(entries_.empty())) {
+        drop(entries_.begin());
+    }
+}
+
+void plaintext_cache::set_limits(size_t capacity,
+        std::chrono::milliseconds ttl) {
+    scoped_lock l(mx_);
+    capacity_ = capacity;
+    ttl_ = ttl;
+
+    while (stats_.bytes > capacity_) {
+        drop(entries_.begin());
+        stats_.evictions++;
+    }
+
+    /* Deadlines already set stand; the reaper rechecks them. */
+    cv_.notify_all();
+}
+
+void plaintext_cache::insert(const struct stat& s, page_buffer& buffer) {
+    (void) add(s, buffer, std::chrono::milliseconds(0), false);
+}
+
+bool plaintext_cache::insert_prefetched(const struct stat& s,
+        page_buffer& buffer, std::chrono::milliseconds ttl) {
+    return add(s, buffer, ttl, true);
+}
+
+bool plaintext_cache::add(const struct stat& s, page_buffer& buffer,
+        std::chrono::milliseconds ttl, bool prefetched) {
+    std::unique_ptr<page_buffer> contents(new page_buffer(memory_lock::none));
+    contents->swap(buffer);
+    const size_t bytes = contents->allocated();
+
+    scoped_lock l(mx_);
+    if (!(prefetched)) {
+        ttl = ttl_;
+    }
+    if (capacity_ == 0 || bytes > capacity_ || ttl.count() <= 0) {
+        contents->wipe();
+        return false;
+    }
+
+    const inode id(s.st_dev, s.st_ino);
+    auto it = index_.find(id);
+    if (prefetched && (it != index_.end() ||
+            stats_.bytes + bytes > capacity_)) {
+        /* Speculation makes way for nothing. */
+        contents->wipe();
+        stats_.prefetched++;
+        stats_.prefetch_wasted++;
+        return it != index_.end();
+    } else if (it != index_.end()) {
+        drop(it->second);
+    }
+
+    while (stats_.bytes + bytes > capacity_) {
+        drop(entries_.begin());
+        stats_.evictions++;
+    }
+
+    entries_.push_back(entry{id, s.st_size, s.st_mtim, s.st_ctim,
+        std::move(contents), bytes, clock_type::now() + ttl, prefetched});
+    index_[id] = std::prev(entries_.end());
+
+    stats_.insertions++;
+    if (prefetched) {
+        stats_.prefetched++;
+    }
+    stats_.entries = entries_.size();
+    stats_.bytes += bytes;
+
+    if (!(reaper_.joinable())) {
+        reaper_ = std::thread(&plaintext_cache::reaper, this);
+    }
+    cv_.notify_all();
+    return true;
+}
+
+bool plaintext_cache::take(const struct stat& s, page_buffer& buffer) {
+    scoped_lock l(mx_);
+    expire(clock_type::now());
+
+    auto it = index_.find(inode(s.st_dev, s.st_ino));
+    if (it == index_.end()) {
+        stats_.misses++;
+        return false;
+    }
+
+    const entry& e = *it->second;
+    if (!(current(e, s))) {
+        /* The ciphertext changed since. */
+        drop(it->second);
+        stats_.invalidations++;
+        stats_.misses++;
+        return false;
+    }
+
+    assert(buffer.size() == 0);
+    buffer.swap(*e.contents);
+    if (e.prefetched) {
+        stats_.prefetch_hits++;
+    }
+
+    stats_.bytes -= e.bytes;
+    entries_.erase(it->second);
+    index_.erase(it);
+    stats_.entries = entries_.size();
+    stats_.hits++;
+    return true;
+}
+
+bool plaintext_cache::contains(const struct stat& s) const {
+    scoped_lock l(mx_);
+    auto it = index_.find(inode(s.st_dev, s.st_ino));
+    return it != index_.end() && current(*it->second, s);
+}
+
+void plaintext_cache::revalidate(const struct stat& s) {
+    scoped_lock l(mx_);
+
+    auto it = index_.find(inode(s.st_dev, s.st_ino));
+    if (it != index_.end() && !(current(*it->second, s))) {
+        drop(it->second);
+        stats_.invalidations++;
+    }
+}
+
+void plaintext_cache::clear() {
+    scoped_lock l(mx_);
+    while (!(entries_.empty())) {
+        drop(entries_.begin());
+        stats_.invalidations++;
+    }
+}
+
+bool plaintext_cache::current(const entry& e, const struct stat& s) {
+    return e.size == s.st_size && same_time(e.mtime, s.st_mtim) &&
+        same_time(e.ctime, s.st_ctim);
+}
+
+plaintext_cache::statistics plaintext_cache::stats() const {
+    scoped_lock l(mx_);
+    return stats_;
+}
+
+void plaintext_cache::drop(entry_list::iterator it) {
+    it->contents->wipe();
+    if (it->prefetched) {
+        stats_.prefetch_wasted++;
+    }
+
+    assert(stats_.bytes >= it->bytes);
+    stats_.bytes -= it->bytes;
+    index_.erase(it->id);
+    entries_.erase(it);
+    stats_.entries = entries_.size();
+}
+
+void plaintext_cache::expire(clock_type::time_point now) {
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+        auto next = std::next(it);
+        if (it->deadline <= now) {
+            drop(it);
+            stats_.expirations++;
+        }
+        it = next;
+    }
+}
+
+void plaintext_cache::reaper() {
+    scoped_lock l(mx_);
+    while (!(stopping_)) {
+        expire(clock_type::now());
+
+        if (entries_.empty()) {
+            cv_.wait(l);
+            continue;
+        }
+
+        const auto earliest = std::min_element(entries_.begin(),
+            entries_.end(), [](const entry& a, const entry& b) {
+                return a.deadline < b.deadline;
+            });
+        cv_.wait_until(l, earliest->deadline);
+    }
+}
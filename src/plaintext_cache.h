@@ -0,0 +1,153 @@
+#ifndef __ASYMMETRICFS__PLAINTEXT_CACHE_H__
+#define __ASYMMETRICFS__PLAINTEXT_CACHE_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+#include <utility>
+
+class page_buffer;
+
+/**
+ * plaintext_cache keeps the plaintext of recently closed files, so reopening
+ * one need not decrypt it again.  Entries are keyed by the inode of the
+ * ciphertext and only returned while its size, mtime and ctime are unchanged.
+ * They expire ttl after they were added, and the least recently added are
+ * evicted to keep the pages held within capacity bytes.  Evicted and expired
+ * entries are zeroed before their memory is released.
+ */
+class plaintext_cache {
+    struct entry;
+public:
+    /* If capacity is 0, nothing is cached. */
+    plaintext_cache(size_t capacity, std::chrono::milliseconds ttl);
+    ~plaintext_cache();
+
+    void set_limits(size_t capacity, std::chrono::milliseconds ttl);
+
+    /**
+     * Takes the contents of buffer, which hold the plaintext of the
+     * ciphertext described by s, leaving buffer empty.
+     */
+    void insert(const struct stat& s, page_buffer& buffer);
+
+    /**
+     * Like insert, but for plaintext decrypted before any file asked for it.
+     * It expires after ttl, and never displaces other entries:  if it does
+     * not fit, it is dropped and false is returned.
+     */
+    bool insert_prefetched(const struct stat& s, page_buffer& buffer,
+        std::chrono::milliseconds ttl);
+
+    /**
+     * Returns true if the plaintext of the ciphertext s describes is cached.
+     */
+    bool contains(const struct stat& s) const;
+
+    /**
+     * If the plaintext of the ciphertext described by s is cached, moves it
+     * into buffer, which should be empty, and returns true.
+     */
+    bool take(const struct stat& s, page_buffer& buffer);
+
+    /**
+     * Drops the plaintext cached for the inode of s, unless it is of the
+     * ciphertext s describes.  clear drops every entry.
+     */
+    void revalidate(const struct stat& s);
+    void clear();
+
+    struct statistics {
+        statistics();
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t insertions;
+        /* Entries dropped for capacity, for age, and as out of date. */
+        uint64_t evictions;
+        uint64_t expirations;
+        uint64_t invalidations;
+
+        /* The entries held now, and the bytes of pages they hold. */
+        size_t entries;
+        size_t bytes;
+
+        /*
+         * Prefetched entries added, and how many of them were taken or were
+         * dropped without ever being taken.
+         */
+        uint64_t prefetched;
+        uint64_t prefetch_hits;
+        uint64_t prefetch_wasted;
+    };
+    statistics stats() const;
+private:
+    typedef std::list<entry> entry_list;
+    typedef std::pair<dev_t, ino_t> inode;
+
+    /*
+     * drop wipes and removes an entry, and expire drops those past their
+     * TTL.  The caller should hold mx_.
+     */
+    void drop(entry_list::iterator it);
+    void expire(std::chrono::steady_clock::time_point now);
+
+    /*
+     * Adds an entry for insert and insert_prefetched, returning false if it
+     * was dropped for want of room.
+     */
+    bool add(const struct stat& s, page_buffer& buffer,
+        std::chrono::milliseconds ttl, bool prefetched);
+
+    /* Returns true if e holds the plaintext of the ciphertext s describes. */
+    static bool current(const entry& e, const struct stat& s);
+
+    /* Expires entries in the background, as they reach their TTL. */
+    void reaper();
+
+    mutable std::mutex mx_;
+    std::condition_variable cv_;
+
+    size_t capacity_;
+    std::chrono::milliseconds ttl_;
+
+    /* Entries, from least to most recently added. */
+    entry_list entries_;
+    std::map<inode, entry_list::iterator> index_;
+
+    statistics stats_;
+
+    bool stopping_;
+    std::thread reaper_;
+
+    plaintext_cache(const plaintext_cache &) = delete;
+    const plaintext_cache & operator=(const plaintext_cache &) = delete;
+};
+
+#endif // __ASYMMETRICFS__PLAINTEXT_CACHE_H__
@@ -0,0 +1,262 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "prefetcher.h"
+
+typedef std::unique_lock<std::mutex> scoped_lock;
+
+/* The directories whose scans are followed at once. */
+static const size_t max_directories = 64;
+
+struct prefetcher::directory {
+    explicit directory(const std::string& path_);
+
+    std::string path;
+
+    /*
+     * The files of the directory, if it was listed, in the order they are
+     * expected to be opened.  Those from next onwards have not been queued.
+     * cursor is where the last file opened was found.
+     */
+    std::vector<std::string> names;
+    bool listed;
+    size_t next;
+    size_t cursor;
+
+    /* The last file opened, and whether a scan was spotted. */
+    std::string last;
+    bool scanning;
+};
+
+prefetcher::directory::directory(const std::string& path_) : path(path_),
+    listed(false), next(0), cursor(0), scanning(false) {}
+
+prefetcher::statistics::statistics() : scans(0), queued(0), fetched(0),
+    dropped(0) {}
+
+prefetcher::prefetcher(const fetch_handler& fetch, const list_handler& list) :
+    fetch_(fetch), list_(list), depth_(0), jobs_(1), stopping_(false) {}
+
+prefetcher::~prefetcher() {
+    stop();
+}
+
+void prefetcher::set_limits(unsigned depth, unsigned jobs) {
+    scoped_lock l(mx_);
+    depth_ = depth;
+    jobs_ = std::max(1u, jobs);
+}
+
+prefetcher::statistics prefetcher::stats() const {
+    scoped_lock l(mx_);
+    return stats_;
+}
+
+prefetcher::directory& prefetcher::find(const std::string& dir) {
+    auto it = std::find_if(directories_.begin(), directories_.end(),
+        [&dir](const directory& d) { return d.path == dir; });
+    if (it != directories_.end()) {
+        directories_.splice(directories_.begin(), directories_, it);
+    } else {
+        directories_.emplace_front(dir);
+        if (directories_.size() > max_directories) {
+            directories_.pop_back();
+        }
+    }
+
+    return directories_.front();
+}
+
+void prefetcher::listed(const std::string& dir,
+        const std::vector<std::string>& names, bool first) {
+    scoped_lock l(mx_);
+    if (depth_ == 0 || stopping_) {
+        return;
+    }
+
+    directory& d = find(dir);
+    if (first || !(d.listed)) {
+        d.names.clear();
+        d.next = 0;
+        d.cursor = 0;
+    }
+    d.names.insert(d.names.end(), names.begin(), names.end());
+    d.listed = true;
+}
+
+void prefetcher::opened(const std::string& path, uid_t user) {
+    const size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        return;
+    }
+    const std::string dir = slash == 0 ? "/" : path.substr(0, slash);
+    const std::string name = path.substr(slash + 1);
+
+    scoped_lock l(mx_);
+    if (depth_ == 0 || stopping_) {
+        return;
+    }
+
+    /* The file is wanted now, so it need not be fetched ahead. */
+    if (pending_paths_.erase(path)) {
+        pending_.erase(std::find_if(pending_.begin(), pending_.end(),
+            [&path](const std::pair<std::string, uid_t>& p) {
+                return p.first == path;
+            }));
+    }
+
+    directory *d = &find(dir);
+    const bool scanning = d->listed ||
+        (!(d->last.empty()) && d->last != name);
+    d->last = name;
+    if (!(scanning)) {
+        return;
+    }
+
+    if (!(d->listed)) {
+        /* List the directory without holding up other requests. */
+        l.unlock();
+        std::vector<std::string> names = list_(dir);
+        std::sort(names.begin(), names.end());
+        l.lock();
+
+        if (stopping_) {
+            return;
+        }
+
+        d = &find(dir);
+        if (!(d->listed)) {
+            d->names.swap(names);
+            d->listed = true;
+            d->next = 0;
+            d->cursor = 0;
+        }
+    }
+
+    if (!(d->scanning)) {
+        d->scanning = true;
+        stats_.scans++;
+    }
+
+    /* Scans are usually in order, so look where the last file was first. */
+    const size_t n = d->names.size();
+    for (size_t i = 0; i < n; i++) {
+        const size_t index = (d->cursor + i) % n;
+        if (d->names[index] == name) {
+            d->cursor = index;
+            queue(*d, index, user);
+            break;
+        }
+    }
+}
+
+void prefetcher::queue(directory& d, size_t index, uid_t user) {
+    const size_t end = std::min(d.names.size(), index + 1 + depth_);
+    for (size_t i = std::max(d.next, index + 1); i < end; i++) {
+        const std::string path =
+            (d.path == "/" ? "" : d.path) + "/" + d.names[i];
+        if (pending_paths_.insert(path).second) {
+            pending_.push_back(std::make_pair(path, user));
+            stats_.queued++;
+        }
+    }
+    d.next = std::max(d.next, end);
+
+    /* Fetches queued long ago are the least likely to be of use. */
+    const size_t limit = 4 * size_t(depth_);
+    while (pending_.size() > limit) {
+        pending_paths_.erase(pending_.front().first);
+        pending_.pop_front();
+        stats_.dropped++;
+    }
+
+    start();
+}
+
+void prefetcher::requested(const request_handler& request) {
+    scoped_lock l(mx_);
+    if (stopping_) {
+        return;
+    }
+
+    requests_.push_back(request);
+    start();
+}
+
+void prefetcher::start() {
+    /* Threads are started on demand, as they do not survive daemonizing. */
+    while (!(pending_.empty() && requests_.empty()) &&
+            workers_.size() < jobs_) {
+        workers_.emplace_back(&prefetcher::worker, this);
+    }
+    cv_.notify_all();
+}
+
+void prefetcher::worker() {
+    scoped_lock l(mx_);
+    while (true) {
+        while (!(stopping_) && pending_.empty() && requests_.empty()) {
+            cv_.wait(l);
+        }
+        if (stopping_) {
+            return;
+        }
+
+        if (!(requests_.empty())) {
+            const request_handler request = requests_.front();
+            requests_.pop_front();
+
+            l.unlock();
+            request();
+            l.lock();
+            continue;
+        }
+
+        const std::pair<std::string, uid_t> job = pending_.front();
+        pending_.pop_front();
+        pending_paths_.erase(job.first);
+
+        l.unlock();
+        fetch_(job.first, job.second);
+        l.lock();
+
+        stats_.fetched++;
+    }
+}
+
+void prefetcher::stop() {
+    std::vector<std::thread> workers;
+    {
+        scoped_lock l(mx_);
+        stopping_ = true;
+        pending_.clear();
+        pending_paths_.clear();
+        requests_.clear();
+        workers.swap(workers_);
+        cv_.notify_all();
+    }
+
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    scoped_lock l(mx_);
+    directories_.clear();
+    stopping_ = false;
+}
@@ -0,0 +1,145 @@
+#ifndef __ASYMMETRICFS__PREFETCHER_H__
+#define __ASYMMETRICFS__PREFETCHER_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * prefetcher spots directories being scanned, file by file, and fetches the
+ * files a scan is expected to open next before it does.  A directory is
+ * being scanned once a file is opened in it after it was listed, or once two
+ * different files are opened in it in a row.  Its files are then fetched in
+ * the order they were listed, or in name order if it was not, up to depth
+ * files ahead of the last opened.
+ */
+class prefetcher {
+    struct directory;
+public:
+    /**
+     * fetch is called, from one of the prefetcher's threads, with the path
+     * of each file to fetch and the user whose scan it belongs to.  list
+     * returns the names of the files in a directory.
+     */
+    typedef std::function<void(const std::string& path, uid_t user)>
+        fetch_handler;
+    typedef std::function<std::vector<std::string>(const std::string& dir)>
+        list_handler;
+    typedef std::function<void()> request_handler;
+
+    prefetcher(const fetch_handler& fetch, const list_handler& list);
+    ~prefetcher();
+
+    /**
+     * Fetches up to depth files ahead of each scan, using up to jobs threads.
+     * If depth is 0, nothing is fetched.
+     */
+    void set_limits(unsigned depth, unsigned jobs);
+
+    /**
+     * Reports that names were listed from dir, continuing its listing unless
+     * first is set.
+     */
+    void listed(const std::string& dir, const std::vector<std::string>& names,
+        bool first);
+
+    /**
+     * Reports that user opened path.
+     */
+    void opened(const std::string& path, uid_t user);
+
+    /**
+     * Runs request on one of the prefetcher's threads, ahead of the files
+     * queued for scans.  Requests are run even if depth is 0.
+     */
+    void requested(const request_handler& request);
+
+    /**
+     * Discards pending fetches and requests and stops, once those in
+     * progress finish.
+     */
+    void stop();
+
+    struct statistics {
+        statistics();
+
+        /* Scans spotted, and files queued to be fetched. */
+        uint64_t scans;
+        uint64_t queued;
+        /* Files fetched, and those dropped as the queue was full. */
+        uint64_t fetched;
+        uint64_t dropped;
+    };
+    statistics stats() const;
+private:
+    typedef std::list<directory> directory_list;
+
+    /*
+     * Returns the state of dir, most recently used first, creating it if
+     * needed.  The caller should hold mx_.
+     */
+    directory& find(const std::string& dir);
+
+    /* Queues the files of d after index.  The caller should hold mx_. */
+    void queue(directory& d, size_t index, uid_t user);
+
+    /* Starts threads for pending work.  The caller should hold mx_. */
+    void start();
+
+    void worker();
+
+    fetch_handler fetch_;
+    list_handler list_;
+
+    mutable std::mutex mx_;
+    std::condition_variable cv_;
+
+    unsigned depth_;
+    unsigned jobs_;
+    bool stopping_;
+    std::vector<std::thread> workers_;
+
+    /* Directories seen recently, most recently first. */
+    directory_list directories_;
+
+    /* Files to fetch, oldest first, and the paths among them. */
+    std::deque<std::pair<std::string, uid_t> > pending_;
+    std::set<std::string> pending_paths_;
+
+    /* Requests to run, oldest first. */
+    std::deque<request_handler> requests_;
+
+    statistics stats_;
+
+    prefetcher(const prefetcher &) = delete;
+    const prefetcher & operator=(const prefetcher &) = delete;
+};
+
+#endif // __ASYMMETRICFS__PREFETCHER_H__
@@ -17,24 +17,44 @@
  */
 
 #include <algorithm>
+#include <climits>
 #include <cstdio>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdexcept>
 #include <string>
 #include "subprocess.h"
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
 
+/* glibc does not wrap ioprio_set. */
+static const int ioprio_who_process = 1;
+static const int ioprio_class_be = 2;
+static const int ioprio_class_shift = 13;
+
+subprocess::scheduling::scheduling() : nice(0), io_level(-1),
+        cgroup_procs(-1), pin(false) {
+    CPU_ZERO(&cpus);
+}
+
 subprocess::subprocess(int fd_in, int fd_out, const std::string& file,
-        const std::vector<std::string>& argv) : finished_(false) {
+        const std::vector<std::string>& argv, const scheduling& sched) :
+        finished_(false) {
     fflush(stdout);
 
+    /*
+     * Other children, started while this one runs, must not inherit our ends
+     * of its pipes, or it would not see the end of its input.
+     */
     int pipes_in[2];
-    pipe(pipes_in);
+    pipe2(pipes_in, O_CLOEXEC);
 
     int pipes_out[2];
-    pipe(pipes_out);
+    pipe2(pipes_out, O_CLOEXEC);
 
     pid_ = fork();
     if (pid_ == -1) {
@@ -70,6 +90,22 @@ subprocess::subprocess(int fd_in, int fd_out, const std::string& file,
         close(pipes_out[0]);
         close(pipes_out[1]);
 
+        /* Failing to place or deprioritize the child is not fatal. */
+        if (sched.cgroup_procs >= 0) {
+            (void) write(sched.cgroup_procs, "0", 1);
+        }
+        if (sched.pin) {
+            (void) sched_setaffinity(0, sizeof(sched.cpus), &sched.cpus);
+        }
+        if (sched.nice != 0) {
+            (void) setpriority(PRIO_PROCESS, 0,
+                getpriority(PRIO_PROCESS, 0) + sched.nice);
+        }
+        if (sched.io_level >= 0) {
+            (void) syscall(SYS_ioprio_set, ioprio_who_process, 0,
+                (ioprio_class_be << ioprio_class_shift) | sched.io_level);
+        }
+
         std::vector<char *> argptrs;
         for (const auto& v : argv) {
             argptrs.push_back(const_cast<char *>(v.c_str()));
@@ -143,6 +179,12 @@ int subprocess::wait() {
     }
 }
 
+void subprocess::kill(int sig) {
+    if (!(finished_)) {
+        (void) ::kill(pid_, sig);
+    }
+}
+
 int subprocess::communicate(void *read_buffer_, size_t *read_size,
         const void *write_buffer_, size_t *write_size) {
           char *read_buffer  = static_cast<      char *>(read_buffer_);
@@ -156,7 +198,8 @@ int subprocess::communicate(void *read_buffer_, size_t *read_size,
         return EINVAL;
     }
 
-    while (read_remaining || write_remaining) {
+    const bool reading = read_remaining > 0;
+    while ((reading && read_remaining) || (!(reading) && write_remaining)) {
         FD_ZERO(&read_fds);
         FD_ZERO(&write_fds);
 
@@ -181,7 +224,12 @@ int subprocess::communicate(void *read_buffer_, size_t *read_size,
         }
 
         if (write_remaining && FD_ISSET(in_, &write_fds)) {
-            ssize_t wret = write(in_, write_buffer, write_remaining);
+            /*
+             * Only PIPE_BUF bytes are sure not to block, and the child may be
+             * waiting for us to read its output before it reads more.
+             */
+            ssize_t wret = write(in_, write_buffer,
+                std::min(write_remaining, size_t(PIPE_BUF)));
             if (wret < 0 && errno != EINTR) {
                 return errno;
             } else if (wret > 0) {
@@ -19,11 +19,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sched.h>
 #include <string>
 #include <vector>
 
 class subprocess {
 public:
+    /**
+     * Scheduling adjustments made to the child before it runs its command.
+     */
+    struct scheduling {
+        scheduling();
+
+        /* Added to the nice value inherited by the child. */
+        int nice;
+        /*
+         * If non-negative, the child is placed in the best-effort I/O
+         * scheduling class at this level (0-7, lower is favored).
+         */
+        int io_level;
+        /*
+         * If non-negative, a descriptor for the cgroup.procs of the cgroup
+         * the child joins.  It is not owned.
+         */
+        int cgroup_procs;
+        /* If pin, the child may only run on cpus. */
+        bool pin;
+        cpu_set_t cpus;
+    };
+
     /**
      * file specifies a command to run (via execvp) and its arguments in argv.
      *
@@ -32,7 +56,8 @@ public:
      * created.  The pipe is owned by the instance.
      */
     subprocess(int fd_in, int fd_out, const std::string& file,
-        const std::vector<std::string>& argv);
+        const std::vector<std::string>& argv,
+        const scheduling& sched = scheduling());
     ~subprocess();
 
     /**
@@ -52,6 +77,10 @@ public:
      *
      * It is an error (EINVAL) to specify a write_buffer when subprocess was
      * created with an external (non-pipe) file descriptor.
+     *
+     * This returns once read_buffer is full, even if some of write_buffer
+     * remains, so the caller can drain the output of a process that is
+     * blocked writing it.
      */
     int communicate(void *read_buffer, size_t *read_size,
         const void *write_buffer, size_t *write_size);
@@ -61,6 +90,11 @@ public:
      * if the program exited normally, otherwise -1.
      */
     int wait();
+
+    /**
+     * Sends sig to the process, unless it has already been waited for.
+     */
+    void kill(int sig);
 private:
     pid_t pid_;
     bool finished_;
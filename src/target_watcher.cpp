@@ -0,0 +1,218 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "target_watcher.h"
+#include <unistd.h>
+
+/*
+ * Directories are watched through /proc/self/fd, whose links must be
+ * followed, so symbolic links are excluded when the directory is opened.
+ */
+static const uint32_t watch_mask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_EXCL_UNLINK | IN_ONLYDIR;
+
+static std::string join(const std::string& dir, const char *name) {
+    return dir.empty() ? std::string(name) : dir + "/" + name;
+}
+
+target_watcher::target_watcher(const change_handler& changed,
+        const overflow_handler& overflowed) : changed_(changed),
+        overflowed_(overflowed), root_(-1), inotify_(-1) {
+    wake_[0] = -1;
+    wake_[1] = -1;
+}
+
+target_watcher::~target_watcher() {
+    stop();
+}
+
+int target_watcher::start(int root) {
+    stop();
+
+    int ret = 0;
+    root_ = ::fcntl(root, F_DUPFD_CLOEXEC, 0);
+    inotify_ = inotify_init1(IN_CLOEXEC);
+    if (root_ < 0 || inotify_ < 0 || pipe2(wake_, O_CLOEXEC) != 0) {
+        ret = errno;
+    } else {
+        ret = add_tree("");
+    }
+
+    if (ret != 0) {
+        stop();
+        return ret;
+    }
+
+    thread_ = std::thread(&target_watcher::run, this);
+    return 0;
+}
+
+void target_watcher::stop() {
+    if (thread_.joinable()) {
+        (void) ::write(wake_[1], "", 1);
+        thread_.join();
+    }
+
+    for (int *fd : {&root_, &inotify_, &wake_[0], &wake_[1]}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    paths_.clear();
+}
+
+int target_watcher::add_tree(const std::string& path) {
+    const int dir = path.empty() ?
+        ::fcntl(root_, F_DUPFD_CLOEXEC, 0) :
+        ::openat(root_, path.c_str(),
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir < 0) {
+        return errno;
+    }
+
+    /* inotify only takes paths, but the descriptor pins the directory. */
+    const std::string proc = "/proc/self/fd/" + std::to_string(dir);
+    const int wd = inotify_add_watch(inotify_, proc.c_str(), watch_mask);
+    if (wd < 0) {
+        const int ret = errno;
+        ::close(dir);
+        return ret;
+    }
+    paths_[wd] = path;
+
+    DIR *d = fdopendir(dir);
+    if (!(d)) {
+        const int ret = errno;
+        ::close(dir);
+        return ret;
+    }
+
+    int ret = 0;
+    while (struct dirent *entry = readdir(d)) {
+        const std::string name(entry->d_name);
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        bool directory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat s;
+            directory = fstatat(dirfd(d), entry->d_name, &s,
+                AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(s.st_mode);
+        }
+
+        if (directory) {
+            const int subtree = add_tree(join(path, entry->d_name));
+            /* A directory may be removed as we go. */
+            if (subtree != 0 && subtree != ENOENT && ret == 0) {
+                ret = subtree;
+            }
+        }
+    }
+
+    closedir(d);
+    return ret;
+}
+
+void target_watcher::remove_tree(const std::string& path) {
+    for (auto it = paths_.begin(); it != paths_.end(); ) {
+        const std::string& p = it->second;
+        if (p.compare(0, path.size(), path) == 0 &&
+                (p.size() == path.size() || p[path.size()] == '/')) {
+            (void) inotify_rm_watch(inotify_, it->first);
+            it = paths_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void target_watcher::handle(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        overflowed_();
+        return;
+    }
+
+    auto it = paths_.find(event->wd);
+    if (it == paths_.end()) {
+        return;
+    } else if (event->mask & IN_IGNORED) {
+        paths_.erase(it);
+        return;
+    } else if (event->len == 0) {
+        /* Changes to a watched directory are reported by its parent. */
+        return;
+    }
+
+    const std::string path = join(it->second, event->name);
+    const bool directory = event->mask & IN_ISDIR;
+    if (directory) {
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            remove_tree(path);
+        }
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            /* Without a watch, later changes beneath it go unnoticed. */
+            (void) add_tree(path);
+        }
+    }
+
+    changed_(path, directory);
+}
+
+void target_watcher::run() {
+    alignas(struct inotify_event) char buffer[1 << 16];
+
+    struct pollfd fds[2];
+    fds[0].fd = inotify_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_[0];
+    fds[1].events = POLLIN;
+
+    while (true) {
+        const int ret = poll(fds, 2, -1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0 || fds[1].revents) {
+            return;
+        } else if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        const ssize_t n = ::read(inotify_, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return;
+        }
+
+        for (ssize_t offset = 0; offset < n; ) {
+            const struct inotify_event *event =
+                reinterpret_cast<const struct inotify_event *>(
+                    buffer + offset);
+            handle(event);
+            offset += ssize_t(sizeof(*event) + event->len);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef __ASYMMETRICFS__TARGET_WATCHER_H__
+#define __ASYMMETRICFS__TARGET_WATCHER_H__
+
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2013 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+
+/**
+ * target_watcher reports changes made beneath a directory by any process,
+ * using inotify.  Every directory in the tree is watched, so the tree should
+ * fit within fs.inotify.max_user_watches.
+ */
+class target_watcher {
+public:
+    /**
+     * changed is called with the path, relative to the directory watched, of
+     * each file or directory created, removed, renamed, or written and
+     * closed, or whose attributes changed.  If the kernel drops events,
+     * overflowed is called instead, as anything may have changed.  Both are
+     * called from the watching thread.
+     */
+    typedef std::function<void(const std::string& path, bool directory)>
+        change_handler;
+    typedef std::function<void()> overflow_handler;
+
+    target_watcher(const change_handler& changed,
+        const overflow_handler& overflowed);
+    ~target_watcher();
+
+    /**
+     * Starts watching the directory root, which is not owned, in the
+     * background.  Returns 0 on success, otherwise the corresponding standard
+     * error code.
+     */
+    int start(int root);
+
+    /**
+     * Stops watching, once any change being reported has been.
+     */
+    void stop();
+private:
+    void run();
+    void handle(const struct inotify_event *event);
+
+    /* Watches path, relative to root_, and the directories beneath it. */
+    int add_tree(const std::string& path);
+    void remove_tree(const std::string& path);
+
+    change_handler changed_;
+    overflow_handler overflowed_;
+
+    int root_;
+    int inotify_;
+    int wake_[2];
+    std::thread thread_;
+
+    /* The path watched by each watch descriptor. */
+    std::map<int, std::string> paths_;
+
+    target_watcher(const target_watcher &) = delete;
+    const target_watcher & operator=(const target_watcher &) = delete;
+};
+
+#endif // __ASYMMETRICFS__TARGET_WATCHER_H__
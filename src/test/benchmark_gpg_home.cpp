@@ -0,0 +1,97 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This program measures how long gpg takes to encrypt an empty file, which is
+// dominated by its startup, from the user's home (GNUPGHOME or ~/.gnupg) and
+// from a private gpg_home holding only the keys needed.
+//
+// Usage: benchmark_gpg_home recipient [runs]
+
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include "gpg_home.h"
+#include "gpg_recipient.h"
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include "subprocess.h"
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+void report(const std::string& name, clock_type::duration d, int runs) {
+    const double ms = std::chrono::duration<double, std::milli>(d).count();
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(10) << std::fixed << std::setprecision(1)
+              << ms / runs << " ms" << std::endl;
+}
+
+clock_type::duration encrypt(const std::vector<std::string>& arguments,
+        const std::string& recipient, int runs) {
+    std::vector<std::string> argv{"gpg"};
+    argv.insert(argv.end(), arguments.begin(), arguments.end());
+    argv.insert(argv.end(), {"--batch", "--no-tty", "-e", "-r", recipient});
+
+    const int in = open("/dev/null", O_RDONLY);
+    const int out = open("/dev/null", O_WRONLY);
+
+    const auto start = clock_type::now();
+    for (int i = 0; i < runs; i++) {
+        subprocess s(in, out, "gpg", argv);
+        if (s.wait() != 0) {
+            std::cerr << "gpg failed." << std::endl;
+            exit(1);
+        }
+    }
+    const auto elapsed = clock_type::now() - start;
+
+    close(in);
+    close(out);
+    return elapsed;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " recipient [runs]" << std::endl;
+        return 1;
+    }
+
+    const std::vector<gpg_recipient> recipients =
+        gpg_recipient::resolve({gpg_recipient(argv[1])}, "gpg");
+    const std::string recipient = recipients.front();
+    const int runs = argc > 2 ? atoi(argv[2]) : 20;
+
+    gpg_home home;
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    const int ret = home.create(runtime ? runtime : "/dev/shm", "gpg",
+        recipients);
+    if (ret != 0) {
+        std::cerr << "Unable to create a private home." << std::endl;
+        return 1;
+    }
+
+    report("user's home", encrypt({}, recipient, runs), runs);
+    report("private home", encrypt(home.arguments(), recipient, runs), runs);
+    return 0;
+}
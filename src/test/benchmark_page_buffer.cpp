@@ -0,0 +1,180 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// This program measures page_buffer throughput for the request patterns
+// selected by the connection options negotiated in asymmetricfs::init():
+//
+// * --big-writes / --max-write:  the size of each write() into the buffer.
+// * --max-readahead:  the size of each read() from the buffer.
+// * --async-read:  whether reads arrive from several threads at once.
+// * --splice:  whether the contents reach a pipe by vmsplice or by copying.
+//
+// Usage: benchmark_page_buffer [size in MiB]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include "memory_lock.h"
+#include "page_buffer.h"
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+const std::vector<size_t> request_sizes{
+    1 << 12, 1 << 15, 1 << 17, 1 << 20};
+
+void report(const std::string& name, size_t bytes, clock_type::duration d) {
+    const double seconds = std::chrono::duration<double>(d).count();
+    const double mib = double(bytes) / double(1 << 20);
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(10) << std::fixed << std::setprecision(1)
+              << mib / seconds << " MiB/s" << std::endl;
+}
+
+void fill(page_buffer* buffer, size_t total, size_t request) {
+    const std::string data(request, 'x');
+    for (size_t offset = 0; offset < total; offset += request) {
+        buffer->write(std::min(request, total - offset), offset, data.data());
+    }
+}
+
+void benchmark_writes(size_t total) {
+    for (size_t request : request_sizes) {
+        page_buffer buffer(memory_lock::none);
+
+        auto start = clock_type::now();
+        fill(&buffer, total, request);
+        auto end = clock_type::now();
+
+        report("write, " + std::to_string(request) + " byte requests", total,
+            end - start);
+    }
+}
+
+void read_range(const page_buffer* buffer, size_t begin, size_t end,
+        size_t request) {
+    std::string out(request, '\0');
+    for (size_t offset = begin; offset < end; offset += request) {
+        buffer->read(std::min(request, end - offset), offset, &out[0]);
+    }
+}
+
+void benchmark_reads(size_t total) {
+    page_buffer buffer(memory_lock::none);
+    fill(&buffer, total, 1 << 20);
+
+    for (size_t request : request_sizes) {
+        auto start = clock_type::now();
+        read_range(&buffer, 0, total, request);
+        auto end = clock_type::now();
+
+        report("read, " + std::to_string(request) + " byte requests", total,
+            end - start);
+    }
+
+    // Asynchronous reads let the kernel keep several requests in flight.
+    const unsigned n_threads =
+        std::max(2u, std::min(4u, std::thread::hardware_concurrency()));
+    const size_t request = 1 << 17;
+    const size_t stride = total / n_threads;
+
+    auto start = clock_type::now();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < n_threads; i++) {
+        const size_t begin = i * stride;
+        const size_t end = i + 1 == n_threads ? total : begin + stride;
+        threads.emplace_back(read_range, &buffer, begin, end, request);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = clock_type::now();
+
+    report("read, " + std::to_string(request) + " byte requests, " +
+        std::to_string(n_threads) + " threads", total, end - start);
+}
+
+// Drains fd until EOF.
+void drain(int fd) {
+    std::string sink(1 << 16, '\0');
+    while (::read(fd, &sink[0], sink.size()) > 0) {}
+}
+
+void benchmark_splice(size_t total) {
+    page_buffer buffer(memory_lock::none);
+    fill(&buffer, total, 1 << 20);
+
+    for (bool use_splice : {false, true}) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            std::cerr << "Unable to create pipe." << std::endl;
+            exit(1);
+        }
+        std::thread reader(drain, fds[0]);
+
+        auto start = clock_type::now();
+        if (use_splice) {
+            buffer.splice(fds[1], 0);
+        } else {
+            const size_t request = 1 << 17;
+            std::string out(request, '\0');
+            for (size_t offset = 0; offset < total; offset += request) {
+                size_t n = buffer.read(request, offset, &out[0]);
+                for (size_t written = 0; written < n; ) {
+                    ssize_t ret =
+                        ::write(fds[1], out.data() + written, n - written);
+                    if (ret <= 0) {
+                        break;
+                    }
+                    written += static_cast<size_t>(ret);
+                }
+            }
+        }
+        ::close(fds[1]);
+        reader.join();
+        auto end = clock_type::now();
+        ::close(fds[0]);
+
+        report(use_splice ? "pipe, vmsplice" : "pipe, read and write", total,
+            end - start);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    size_t mib = 256;
+    if (argc > 1) {
+        mib = static_cast<size_t>(std::max(1, atoi(argv[1])));
+    }
+    const size_t total = mib << 20;
+
+    std::cout << "page_buffer throughput over " << mib << " MiB" << std::endl;
+    benchmark_writes(total);
+    benchmark_reads(total);
+    benchmark_splice(total);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "access_manifest.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+TEST(AccessManifest, Hottest) {
+    access_manifest m(16);
+    for (const char *path : {"/b", "/a", "/c", "/a", "/b", "/a"}) {
+        m.record(path);
+    }
+
+    EXPECT_EQ(std::vector<std::string>({"/a", "/b"}), m.hottest(2));
+    EXPECT_EQ("3 /a\n2 /b\n1 /c\n", m.serialize(10));
+}
+
+TEST(AccessManifest, Merge) {
+    access_manifest m(16);
+    m.record("/a");
+
+    // Saved counts are halved, and those reaching 0 are forgotten.
+    EXPECT_TRUE(m.merge("8 /b\n2 /a\n1 /c\n"));
+    EXPECT_EQ("4 /b\n2 /a\n", m.serialize(10));
+
+    EXPECT_TRUE(m.merge(""));
+    EXPECT_EQ("4 /b\n2 /a\n", m.serialize(10));
+}
+
+TEST(AccessManifest, Malformed) {
+    access_manifest m(16);
+    EXPECT_FALSE(m.merge("4 /a\nb\n"));
+    EXPECT_FALSE(m.merge("4 /a"));
+    EXPECT_FALSE(m.merge("x /a\n"));
+    EXPECT_FALSE(m.merge("4 a\n"));
+
+    // Nothing was added.
+    EXPECT_EQ("", m.serialize(10));
+}
+
+TEST(AccessManifest, Capacity) {
+    access_manifest m(2);
+    for (const char *path : {"/a", "/b", "/c", "/c", "/a"}) {
+        m.record(path);
+    }
+
+    // Files beyond the capacity are not counted, nor are unwritable paths.
+    m.record("/new\nline");
+    EXPECT_EQ("2 /a\n1 /b\n", m.serialize(10));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,181 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "admission.h"
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Waits until n jobs are queued.
+static void wait_for_queue(const admission& a, size_t n) {
+    while (a.stats().queued != n) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+TEST(AdmissionTest, Unlimited) {
+    admission a(0, 0);
+
+    std::vector<std::unique_ptr<admission::slot>> slots;
+    for (int i = 0; i < 16; i++) {
+        slots.emplace_back(new admission::slot(a, 0));
+    }
+
+    admission::statistics s = a.stats();
+    EXPECT_EQ(16u, s.running);
+    EXPECT_EQ(16u, s.admitted);
+    EXPECT_EQ(0u, s.waited);
+}
+
+TEST(AdmissionTest, Limit) {
+    admission a(2, 0);
+
+    // Hold both slots until every thread is queued, so each has to wait.
+    std::unique_ptr<admission::slot> first(new admission::slot(a, 0));
+    std::unique_ptr<admission::slot> second(new admission::slot(a, 0));
+
+    std::atomic<unsigned> running(0), most(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 6; i++) {
+        threads.emplace_back([&]() {
+            admission::slot slot(a, 0);
+            unsigned now = ++running;
+            unsigned prior = most;
+            while (now > prior && !most.compare_exchange_weak(prior, now)) {}
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            running--;
+        });
+    }
+
+    wait_for_queue(a, 6);
+    first.reset();
+    second.reset();
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    EXPECT_GE(2u, most);
+    admission::statistics s = a.stats();
+    EXPECT_EQ(0u, s.running);
+    EXPECT_EQ(0u, s.queued);
+    EXPECT_EQ(8u, s.admitted);
+    EXPECT_EQ(6u, s.waited);
+    EXPECT_LT(0, s.max_wait.count());
+    EXPECT_LE(s.max_wait, s.total_wait);
+}
+
+TEST(AdmissionTest, FIFO) {
+    admission a(1, 0);
+
+    std::vector<int> order;
+    std::unique_ptr<admission::slot> held(new admission::slot(a, 0));
+
+    std::thread first([&]() {
+        admission::slot slot(a, 0);
+        order.push_back(1);
+    });
+    wait_for_queue(a, 1);
+
+    std::thread second([&]() {
+        admission::slot slot(a, 0);
+        order.push_back(2);
+    });
+    wait_for_queue(a, 2);
+    EXPECT_EQ(2u, a.stats().max_queued);
+
+    held.reset();
+    first.join();
+    second.join();
+
+    EXPECT_EQ((std::vector<int>{1, 2}), order);
+}
+
+TEST(AdmissionTest, Priority) {
+    admission a(1, 0);
+
+    std::vector<int> order;
+    std::unique_ptr<admission::slot> held(new admission::slot(a, 0));
+
+    std::thread background([&]() {
+        admission::slot slot(a, 0, admission::priority::background);
+        order.push_back(2);
+    });
+    wait_for_queue(a, 1);
+    EXPECT_EQ(1u, a.stats().background_queued);
+
+    // The foreground job overtakes the background job queued before it.
+    std::thread foreground([&]() {
+        admission::slot slot(a, 0, admission::priority::foreground);
+        order.push_back(1);
+    });
+    wait_for_queue(a, 2);
+
+    held.reset();
+    foreground.join();
+    background.join();
+
+    EXPECT_EQ((std::vector<int>{1, 2}), order);
+    admission::statistics s = a.stats();
+    EXPECT_EQ(1u, s.background_admitted);
+    EXPECT_EQ(1u, s.background_waited);
+    EXPECT_EQ(0u, s.background_queued);
+}
+
+TEST(AdmissionTest, PerUser) {
+    admission a(4, 1);
+
+    std::unique_ptr<admission::slot> held(new admission::slot(a, 1000));
+    std::thread waiting([&]() {
+        admission::slot slot(a, 1000);
+    });
+    wait_for_queue(a, 1);
+
+    // Another user is not held up behind the waiting job.
+    {
+        admission::slot other(a, 1001);
+        EXPECT_EQ(2u, a.stats().running);
+    }
+
+    EXPECT_EQ(1u, a.stats().queued);
+    held.reset();
+    waiting.join();
+}
+
+TEST(AdmissionTest, RaiseLimit) {
+    admission a(1, 0);
+
+    admission::slot held(a, 0);
+    std::thread waiting([&]() {
+        admission::slot slot(a, 0);
+    });
+    wait_for_queue(a, 1);
+
+    a.set_limits(2, 0);
+    waiting.join();
+    EXPECT_EQ(0u, a.stats().queued);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
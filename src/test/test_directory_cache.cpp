@@ -0,0 +1,163 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include "directory_cache.h"
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include "test/temporary_directory.h"
+#include <unistd.h>
+
+class DirectoryCacheTest : public ::testing::Test {
+protected:
+    void SetUp() {
+        root = ::open(dir.path().c_str(), O_CLOEXEC | O_DIRECTORY);
+        ASSERT_LE(0, root);
+    }
+
+    void TearDown() {
+        ::close(root);
+    }
+
+    void make_directory(const std::string& path) {
+        ASSERT_EQ(0, ::mkdirat(root, ("." + path).c_str(), 0700));
+    }
+
+    // Verifies that path exists, using the cache.
+    bool exists(directory_cache* cache, const char* path) {
+        directory_cache::resolved r;
+        if (cache->resolve(path, &r) != 0) {
+            return false;
+        }
+
+        struct stat s;
+        return ::fstatat(r.fd(), r.name(), &s, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    temporary_directory dir;
+    int root;
+};
+
+TEST_F(DirectoryCacheTest, TopLevel) {
+    directory_cache cache(root, 4);
+
+    directory_cache::resolved r;
+    ASSERT_EQ(0, cache.resolve("/a", &r));
+    EXPECT_EQ(root, r.fd());
+    EXPECT_STREQ("a", r.name());
+
+    ASSERT_EQ(0, cache.resolve("/", &r));
+    EXPECT_EQ(root, r.fd());
+    EXPECT_STREQ(".", r.name());
+
+    EXPECT_EQ(0u, cache.size());
+    EXPECT_EQ(EINVAL, cache.resolve("a", &r));
+}
+
+TEST_F(DirectoryCacheTest, Nested) {
+    make_directory("/a");
+    make_directory("/a/b");
+    make_directory("/a/b/c");
+
+    directory_cache cache(root, 4);
+    EXPECT_TRUE(exists(&cache, "/a/b/c"));
+    EXPECT_EQ(1u, cache.size());
+    EXPECT_TRUE(exists(&cache, "/a/b/c"));
+    EXPECT_EQ(1u, cache.size());
+    EXPECT_FALSE(exists(&cache, "/a/b/d"));
+
+    directory_cache::resolved r;
+    EXPECT_EQ(ENOENT, cache.resolve("/a/x/y", &r));
+
+    int fd = ::openat(root, "./a/f", O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+    ASSERT_LE(0, fd);
+    ::close(fd);
+    EXPECT_EQ(ENOTDIR, cache.resolve("/a/f/x", &r));
+}
+
+TEST_F(DirectoryCacheTest, Eviction) {
+    make_directory("/a");
+    make_directory("/b");
+    make_directory("/c");
+
+    directory_cache cache(root, 2);
+    EXPECT_TRUE(exists(&cache, "/a/."));
+    EXPECT_TRUE(exists(&cache, "/b/."));
+
+    // Resolutions hold their descriptors across evictions.
+    directory_cache::resolved r;
+    ASSERT_EQ(0, cache.resolve("/a/.", &r));
+    EXPECT_TRUE(exists(&cache, "/c/."));
+    EXPECT_EQ(2u, cache.size());
+
+    struct stat s;
+    EXPECT_EQ(0, ::fstatat(r.fd(), r.name(), &s, 0));
+}
+
+TEST_F(DirectoryCacheTest, Disabled) {
+    make_directory("/a");
+
+    directory_cache cache(root, 0);
+    EXPECT_TRUE(exists(&cache, "/a/."));
+    EXPECT_EQ(0u, cache.size());
+}
+
+TEST_F(DirectoryCacheTest, Rename) {
+    make_directory("/a");
+    make_directory("/a/b");
+    make_directory("/ab");
+
+    directory_cache cache(root, 4);
+    EXPECT_TRUE(exists(&cache, "/a/b"));
+    EXPECT_TRUE(exists(&cache, "/a/b/."));
+    EXPECT_TRUE(exists(&cache, "/ab/."));
+    EXPECT_EQ(3u, cache.size());
+
+    ASSERT_EQ(0, ::renameat(root, "./a", root, "./c"));
+
+    // The cached descriptors follow the directory to its new name.
+    EXPECT_TRUE(exists(&cache, "/a/b"));
+
+    cache.invalidate("/a");
+    EXPECT_EQ(1u, cache.size());
+    EXPECT_FALSE(exists(&cache, "/a/b"));
+    EXPECT_FALSE(exists(&cache, "/a/b/."));
+    EXPECT_TRUE(exists(&cache, "/c/b/."));
+}
+
+TEST_F(DirectoryCacheTest, Remove) {
+    make_directory("/a");
+    make_directory("/a/b");
+
+    directory_cache cache(root, 4);
+    EXPECT_TRUE(exists(&cache, "/a/b/."));
+
+    ASSERT_EQ(0, ::unlinkat(root, "./a/b", AT_REMOVEDIR));
+    cache.invalidate("/a/b");
+    make_directory("/a/b");
+    make_directory("/a/b/c");
+
+    EXPECT_TRUE(exists(&cache, "/a/b/c"));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
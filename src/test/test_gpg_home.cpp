@@ -0,0 +1,73 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <boost/filesystem.hpp>
+#include <cstdlib>
+#include "gpg_home.h"
+#include <gtest/gtest.h>
+#include <string>
+#include "test/gpg_helper.h"
+#include "test/temporary_directory.h"
+#include <vector>
+
+TEST(GPGHome, Create) {
+    gnupg_key key(key_specification{1024, "Testing", "test@example.com", ""});
+    setenv("GNUPGHOME", key.home().string().c_str(), 1);
+
+    temporary_directory parent;
+    std::string path;
+    {
+        gpg_home home;
+        EXPECT_TRUE(home.arguments().empty());
+
+        ASSERT_EQ(0, home.create(parent.path().string(), "gpg",
+            {key.thumbprint()}));
+        path = home.path();
+        EXPECT_TRUE(boost::filesystem::is_directory(path));
+
+        const std::vector<std::string> args = home.arguments();
+        ASSERT_LE(2u, args.size());
+        EXPECT_EQ("--homedir", args[0]);
+        EXPECT_EQ(path, args[1]);
+    }
+
+    // The home is removed with the gpg_home.
+    EXPECT_FALSE(boost::filesystem::exists(path));
+
+    unsetenv("GNUPGHOME");
+}
+
+TEST(GPGHome, UnknownRecipient) {
+    gnupg_key key(key_specification{1024, "Testing", "test@example.com", ""});
+    setenv("GNUPGHOME", key.home().string().c_str(), 1);
+
+    // Nothing is left behind on failure.
+    temporary_directory parent;
+    gpg_home home;
+    EXPECT_NE(0, home.create(parent.path().string(), "gpg",
+        {gpg_recipient("nobody@example.com")}));
+    EXPECT_TRUE(home.path().empty());
+    EXPECT_TRUE(boost::filesystem::is_empty(parent.path()));
+
+    unsetenv("GNUPGHOME");
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
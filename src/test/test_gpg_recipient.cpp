@@ -18,7 +18,10 @@
 
 #include "gpg_recipient.h"
 #include <gtest/gtest.h>
+#include <string>
 #include "test/file_descriptors.h"
+#include "test/gpg_helper.h"
+#include <vector>
 
 TEST(GPGRecipientTest, NoDescriptorsLeaked) {
     // Verify we do not leak descriptors when using gpg_recipient.
@@ -35,3 +38,29 @@ TEST(GPGRecipientTest, NoDescriptorsLeaked) {
     // Verify open file descriptors are unchanged.
     EXPECT_EQ(starting, ending);
 }
+
+TEST(GPGRecipientTest, Resolve) {
+    gnupg_key key(key_specification{1024, "Testing", "test@example.com", ""});
+    setenv("GNUPGHOME", key.home().string().c_str(), 1);
+
+    // Names and key IDs are replaced by the key's fingerprint.
+    const std::vector<gpg_recipient> given{gpg_recipient("TEST@example.com"),
+        key.thumbprint(), gpg_recipient(key.fingerprint())};
+    const std::vector<gpg_recipient> resolved =
+        gpg_recipient::resolve(given, "gpg");
+    ASSERT_EQ(given.size(), resolved.size());
+    for (const auto& r : resolved) {
+        EXPECT_EQ(key.fingerprint(), static_cast<std::string>(r));
+    }
+
+    // Only the fingerprint given as such was chosen explicitly.
+    EXPECT_FALSE(resolved[0].explicit_fingerprint());
+    EXPECT_FALSE(resolved[1].explicit_fingerprint());
+    EXPECT_TRUE(resolved[2].explicit_fingerprint());
+
+    // Any unknown recipient fails the lot.
+    EXPECT_THROW(gpg_recipient::resolve({gpg_recipient("test@example.com"),
+        gpg_recipient("nobody@example.com")}, "gpg"), invalid_gpg_recipient);
+
+    unsetenv("GNUPGHOME");
+}
@@ -0,0 +1,214 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include "group_commit.h"
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include "test/temporary_directory.h"
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+class GroupCommitTest : public ::testing::Test {
+protected:
+    void TearDown() {
+        for (int fd : fds) {
+            ::close(fd);
+        }
+    }
+
+    int make_file(const std::string& name) {
+        const std::string path = (dir.path() / name).string();
+        int fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+        EXPECT_LE(0, fd);
+        EXPECT_EQ(1, ::write(fd, "x", 1));
+        fds.push_back(fd);
+        return fd;
+    }
+
+    temporary_directory dir;
+    std::vector<int> fds;
+};
+
+TEST_F(GroupCommitTest, Single) {
+    group_commit group(std::chrono::microseconds(0));
+    const int fd = make_file("a");
+
+    {
+        group_commit::participant p(group);
+        EXPECT_EQ(0, p.sync(fd, true));
+    }
+    {
+        group_commit::participant p(group);
+        EXPECT_EQ(0, p.sync(fd, false));
+    }
+
+    EXPECT_EQ(2u, group.batches());
+    EXPECT_EQ(2u, group.syncs());
+}
+
+TEST_F(GroupCommitTest, InvalidDescriptor) {
+    group_commit group(std::chrono::microseconds(0));
+
+    group_commit::participant p(group);
+    EXPECT_EQ(EBADF, p.sync(-1, true));
+}
+
+TEST_F(GroupCommitTest, Batch) {
+    // The window is long enough that the leader waits for everyone.
+    group_commit group(std::chrono::seconds(60));
+
+    const size_t n = 8;
+    std::vector<std::unique_ptr<group_commit::participant>> participants;
+    for (size_t i = 0; i < n; i++) {
+        participants.emplace_back(new group_commit::participant(group));
+    }
+
+    std::vector<int> results(n, -1);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < n; i++) {
+        const int fd = make_file(std::to_string(i));
+        threads.emplace_back([&, i, fd]() {
+            results[i] = participants[i]->sync(fd, true);
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        EXPECT_EQ(0, results[i]);
+    }
+    EXPECT_EQ(1u, group.batches());
+    EXPECT_EQ(n, group.syncs());
+}
+
+TEST_F(GroupCommitTest, Filesystems) {
+    // A second filesystem, if /dev/shm is one.
+    char other[] = "/dev/shm/group_commit.XXXXXX";
+    if (!(::mkdtemp(other))) {
+        return;
+    }
+
+    struct stat here, there;
+    ASSERT_EQ(0, ::stat(dir.path().string().c_str(), &here));
+    ASSERT_EQ(0, ::stat(other, &there));
+
+    std::vector<std::string> other_files;
+    auto make_other_file = [&](const std::string& name) {
+        const std::string path = std::string(other) + "/" + name;
+        other_files.push_back(path);
+        int fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+        EXPECT_LE(0, fd);
+        fds.push_back(fd);
+        return fd;
+    };
+
+    // Each file is synced, whichever filesystem it is on.
+    group_commit group(std::chrono::seconds(60));
+    auto sync_all = [&](const std::vector<int>& batch) {
+        std::vector<std::unique_ptr<group_commit::participant>> participants;
+        for (size_t i = 0; i < batch.size(); i++) {
+            participants.emplace_back(new group_commit::participant(group));
+        }
+
+        std::vector<int> results(batch.size(), -1);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < batch.size(); i++) {
+            threads.emplace_back([&, i]() {
+                results[i] = participants[i]->sync(batch[i], true);
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        for (int result : results) {
+            EXPECT_EQ(0, result);
+        }
+    };
+
+    const int a = make_file("a");
+    const int b = make_file("b");
+    const int c = make_other_file("c");
+    const int d = make_other_file("d");
+
+    // c is alone on its filesystem, so is synced by itself.
+    sync_all({a, b, c});
+    EXPECT_EQ(1u, group.filesystems());
+
+    sync_all({a, b, c, d});
+    EXPECT_EQ(here.st_dev == there.st_dev ? 2u : 3u, group.filesystems());
+    EXPECT_EQ(2u, group.batches());
+    EXPECT_EQ(7u, group.syncs());
+
+    for (const auto& path : other_files) {
+        ::unlink(path.c_str());
+    }
+    ::rmdir(other);
+}
+
+TEST_F(GroupCommitTest, Leave) {
+    group_commit group(std::chrono::seconds(60));
+    const int fd = make_file("a");
+
+    // A participant that leaves without syncing does not hold up the rest.
+    std::unique_ptr<group_commit::participant> p(
+        new group_commit::participant(group));
+    group_commit::participant q(group);
+
+    std::thread t([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        p.reset();
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(0, q.sync(fd, true));
+    EXPECT_GT(std::chrono::seconds(60),
+              std::chrono::steady_clock::now() - start);
+    EXPECT_EQ(1u, group.batches());
+
+    t.join();
+}
+
+TEST_F(GroupCommitTest, Window) {
+    // The leader gives up on participants still preparing after the window.
+    group_commit group(std::chrono::milliseconds(10));
+    const int fd = make_file("a");
+
+    group_commit::participant slow(group);
+    {
+        group_commit::participant p(group);
+        EXPECT_EQ(0, p.sync(fd, true));
+    }
+    EXPECT_EQ(1u, group.batches());
+
+    EXPECT_EQ(0, slow.sync(fd, true));
+    EXPECT_EQ(2u, group.batches());
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
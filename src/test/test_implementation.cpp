@@ -17,19 +17,42 @@
  */
 
 #include <gtest/gtest.h>
+#include <csignal>
+#include <dirent.h>
+#include <fstream>
+#include "gpg_home.h"
 #include "implementation.h"
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <sys/wait.h>
 #include "test/file_descriptors.h"
 #include "test/gpg_helper.h"
 #include "test/temporary_directory.h"
+#include <thread>
 #include <time.h>
+#include <unistd.h>
 
 static constexpr auto invalid_file_handle =
     std::numeric_limits<decltype(fuse_file_info::fh)>::max();
 
+// Lists the entries of a directory outside of the filesystem.
+static std::set<std::string> list_directory(const std::string& path) {
+    std::set<std::string> names;
+    DIR *d = ::opendir(path.c_str());
+    EXPECT_TRUE(d != nullptr);
+    if (d) {
+        while (struct dirent *entry = ::readdir(d)) {
+            names.insert(entry->d_name);
+        }
+        ::closedir(d);
+    }
+    return names;
+}
+
 enum class IOMode {
     ReadWrite,
     WriteOnly
@@ -175,9 +198,22 @@ public:
         return fs_.ftruncate(nullptr, offset, &info);
     }
 
-    void write(const std::string& data) {
+    void write(const std::string& data, off_t offset = 0) {
         ASSERT_EQ(data.size(),
-                  fs_.write(nullptr, data.data(), data.size(), 0, &info));
+                  fs_.write(nullptr, data.data(), data.size(), offset, &info));
+    }
+
+    int fsync() {
+        return fs_.fsync(nullptr, 0, &info);
+    }
+
+    int flush() {
+        return fs_.flush(nullptr, &info);
+    }
+
+    int ioctl(unsigned long cmd, void *data = nullptr) {
+        return fs_.ioctl(nullptr, static_cast<int>(cmd), nullptr, &info, 0,
+            data);
     }
 
     ~scoped_file() {
@@ -1295,6 +1331,1098 @@ TEST_P(IOTest, CorruptedFileMultiplePackets) {
     }
 }
 
+namespace {
+
+// Collects directory entries, along with their offsets, until limit entries
+// have been seen.
+struct limited_listing {
+    size_t limit;
+    std::vector<std::pair<std::string, off_t>> entries;
+
+    static int filler(void *buf, const char *name, const struct stat *stbuf,
+            off_t off) {
+        (void) stbuf;
+
+        auto listing = static_cast<limited_listing*>(buf);
+        if (listing->entries.size() >= listing->limit) {
+            return 1;
+        }
+
+        listing->entries.push_back(std::make_pair(std::string(name), off));
+        return 0;
+    }
+};
+
+}  // namespace
+
+TEST_P(IOTest, ReaddirOffsets) {
+    const std::vector<std::string> names{"a", "b", "c", "d", "e"};
+    for (const auto& name : names) {
+        scoped_file f(fs, "/" + name, O_CREAT | O_WRONLY);
+    }
+
+    struct fuse_file_info info;
+    ASSERT_EQ(0, fs.opendir("/", &info));
+
+    // Read the directory two entries at a time, resuming from the offset of
+    // the last entry accepted.
+    std::set<std::string> seen;
+    off_t offset = 0;
+    for (int calls = 0; ; calls++) {
+        ASSERT_GT(16, calls);
+
+        limited_listing listing;
+        listing.limit = 2;
+        ASSERT_EQ(0, fs.readdir(nullptr, &listing, limited_listing::filler,
+            offset, &info));
+        if (listing.entries.empty()) {
+            break;
+        }
+
+        for (const auto& entry : listing.entries) {
+            EXPECT_NE(0, entry.second);
+            EXPECT_TRUE(seen.insert(entry.first).second) << entry.first;
+        }
+        offset = listing.entries.back().second;
+    }
+
+    EXPECT_EQ(names.size() + 2, seen.size());
+    for (const auto& name : names) {
+        EXPECT_EQ(1u, seen.count(name));
+    }
+    EXPECT_EQ(1u, seen.count("."));
+    EXPECT_EQ(1u, seen.count(".."));
+
+    // Offset 0 restarts the listing.
+    limited_listing listing;
+    listing.limit = 64;
+    ASSERT_EQ(0, fs.readdir(nullptr, &listing, limited_listing::filler, 0,
+        &info));
+    EXPECT_EQ(names.size() + 2, listing.entries.size());
+
+    EXPECT_EQ(0, fs.releasedir(nullptr, &info));
+}
+
+TEST_P(IOTest, ReaddirConcurrent) {
+    const size_t n_files = 64;
+    for (size_t i = 0; i < n_files; i++) {
+        scoped_file f(fs, "/" + std::to_string(i), O_CREAT | O_WRONLY);
+    }
+
+    // Several threads list the directory, a few entries at a time, through
+    // their own handles.
+    const size_t n_threads = 4;
+    std::vector<size_t> counts(n_threads, 0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; t++) {
+        threads.emplace_back([this, t, &counts] {
+            struct fuse_file_info info;
+            if (fs.opendir("/", &info) != 0) {
+                return;
+            }
+
+            off_t offset = 0;
+            while (true) {
+                limited_listing listing;
+                listing.limit = 3;
+                if (fs.readdir(nullptr, &listing, limited_listing::filler,
+                        offset, &info) != 0 || listing.entries.empty()) {
+                    break;
+                }
+
+                counts[t] += listing.entries.size();
+                offset = listing.entries.back().second;
+            }
+
+            fs.releasedir(nullptr, &info);
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t t = 0; t < n_threads; t++) {
+        EXPECT_EQ(n_files + 2, counts[t]);
+    }
+}
+
+TEST_P(IOTest, ConcurrentFiles) {
+    // Each thread repeatedly writes and closes its own file, so encryptions
+    // overlap with one another and with lookups of the files being closed.
+    const size_t n_threads = 4;
+    const size_t n_rounds = 4;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; t++) {
+        threads.emplace_back([this, t] {
+            const std::string filename("/" + std::to_string(t));
+            for (size_t i = 0; i < n_rounds; i++) {
+                const std::string contents(filename + std::to_string(i));
+                {
+                    scoped_file f(fs, filename, O_CREAT | O_TRUNC | O_RDWR);
+                    f.write(contents);
+                }
+
+                struct stat buf;
+                EXPECT_EQ(0, getattr(filename, &buf));
+
+                if (GetParam() == IOMode::ReadWrite) {
+                    scoped_file f(fs, filename, O_RDONLY);
+                    EXPECT_EQ(contents, f.read());
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+TEST_P(IOTest, GpgJobs) {
+    // Files closed at once are encrypted one after another.
+    fs.set_gpg_jobs(1, 0);
+
+    const size_t n_threads = 4;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; t++) {
+        threads.emplace_back([this, t] {
+            const std::string filename("/" + std::to_string(t));
+            scoped_file f(fs, filename, O_CREAT | O_RDWR);
+            f.write(filename);
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const admission::statistics s = fs.gpg_statistics();
+    EXPECT_EQ(0u, s.running);
+    EXPECT_EQ(0u, s.queued);
+    EXPECT_EQ(n_threads, s.admitted);
+    EXPECT_GT(n_threads, s.max_queued);
+
+    for (size_t t = 0; t < n_threads; t++) {
+        const std::string filename("/" + std::to_string(t));
+        EXPECT_NE(0u, file_size(filename));
+    }
+}
+
+TEST_P(IOTest, PartialRead) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string filename("/test");
+    std::string contents;
+    for (size_t i = 0; contents.size() < (3 << 20); i++) {
+        contents += std::to_string(i) + "\n";
+    }
+    {
+        scoped_file f(fs, filename, O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+
+    // Reading the start of the file leaves the rest undecrypted, which is
+    // abandoned once the file is closed.
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ(contents.substr(0, 4096), f.read(off_t(0), 4096));
+    }
+    EXPECT_EQ(1u, fs.cancelled_decryptions());
+
+    // Later reads resume the decryption.
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ(contents.substr(0, 4096), f.read(off_t(0), 4096));
+        EXPECT_EQ(contents.substr(2 << 20, 4096), f.read(2 << 20, 4096));
+        EXPECT_EQ(contents.size(), f.file_size());
+        EXPECT_EQ(contents.substr(contents.size() - 10),
+                  f.read(off_t(contents.size() - 10)));
+    }
+    EXPECT_EQ(1u, fs.cancelled_decryptions());
+
+    // Writing to a partially decrypted file preserves the rest.
+    {
+        scoped_file f(fs, filename, O_RDWR);
+        EXPECT_EQ(contents.substr(0, 4096), f.read(off_t(0), 4096));
+        f.write("abc");
+    }
+    contents.replace(0, 3, "abc");
+    EXPECT_EQ(1u, fs.cancelled_decryptions());
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ(contents.size(), f.file_size());
+        EXPECT_EQ(contents.substr(0, 4096), f.read(off_t(0), 4096));
+    }
+}
+
+TEST_P(IOTest, TruncatePartiallyRead) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string filename("/test");
+    std::string contents;
+    for (size_t i = 0; contents.size() < (3 << 20); i++) {
+        contents += std::to_string(i) + "\n";
+    }
+    {
+        scoped_file f(fs, filename, O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+
+    // Truncating discards what remained to be decrypted.
+    {
+        scoped_file f(fs, filename, O_RDWR);
+        EXPECT_EQ(contents.substr(0, 4096), f.read(off_t(0), 4096));
+        EXPECT_EQ(0, f.truncate(0));
+        f.write("abc");
+    }
+    EXPECT_EQ(1u, fs.cancelled_decryptions());
+
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ(3u, f.file_size());
+        EXPECT_EQ("abc", f.read());
+    }
+}
+
+TEST_P(IOTest, PausedDecryptionLimit) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    fs.set_gpg_jobs(1, 0);
+
+    std::string contents;
+    for (size_t i = 0; contents.size() < (3 << 20); i++) {
+        contents += std::to_string(i) + "\n";
+    }
+    for (const char *filename : {"/a", "/b"}) {
+        scoped_file f(fs, filename, O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+
+    // Only one decryption may be paused, so the other is read to the end.
+    {
+        scoped_file a(fs, "/a", O_RDONLY);
+        scoped_file b(fs, "/b", O_RDONLY);
+        EXPECT_EQ(contents.substr(0, 4096), a.read(off_t(0), 4096));
+        EXPECT_EQ(contents.substr(0, 4096), b.read(off_t(0), 4096));
+    }
+    EXPECT_EQ(1u, fs.cancelled_decryptions());
+}
+
+TEST_P(IOTest, TruncateBackingPartiallyRead) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string filename("/test");
+    std::string contents;
+    for (size_t i = 0; contents.size() < (3 << 20); i++) {
+        contents += std::to_string(i) + "\n";
+    }
+    {
+        scoped_file f(fs, filename, O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+    // Appending leaves the ciphertext with a second block.
+    {
+        scoped_file f(fs, filename, O_WRONLY | O_APPEND);
+        f.write("abc");
+    }
+
+    // Another process truncates the ciphertext beneath a paused decryption,
+    // which fails rather than reading past the end of the file.
+    const std::string backing_file = (backing.path() / filename).string();
+    scoped_file f(fs, filename, O_RDONLY);
+    EXPECT_EQ(contents.substr(0, 4096), f.read(off_t(0), 4096));
+    ASSERT_EQ(0, ::truncate(backing_file.c_str(), 4096));
+
+    std::string buffer;
+    EXPECT_EQ(-ESTALE, f.read(&buffer, 2 << 20, 4096));
+    EXPECT_EQ(1u, fs.cancelled_decryptions());
+}
+
+TEST_P(IOTest, InterruptedRead) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string filename("/test");
+    const std::string contents("abcdefg");
+    {
+        scoped_file f(fs, filename, O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+
+    bool interrupted = true;
+    fs.set_interruption([&interrupted]() { return interrupted; });
+
+    scoped_file f(fs, filename, O_RDONLY);
+    std::string buffer;
+    EXPECT_EQ(-EINTR, f.read(&buffer));
+
+    interrupted = false;
+    EXPECT_EQ(contents, f.read());
+}
+
+TEST_P(IOTest, PlaintextCache) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    fs.set_plaintext_cache(1 << 20, std::chrono::milliseconds(60000));
+
+    const std::string filename("/test");
+    const std::string backing_file = (backing.path() / filename).string();
+    {
+        scoped_file f(fs, filename, O_CREAT | O_RDWR);
+        f.write("abcdefg");
+    }
+
+    // Reopening the file takes its plaintext from the cache.
+    {
+        scoped_file f(fs, filename, O_RDWR);
+        EXPECT_EQ("abcdefg", f.read());
+        f.write("xyz");
+    }
+    EXPECT_EQ(1u, fs.plaintext_statistics().hits);
+
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ("xyzdefg", f.read());
+    }
+    EXPECT_EQ(2u, fs.plaintext_statistics().hits);
+
+    // Changes to the ciphertext made elsewhere invalidate the entry.
+    const struct timespec times[2] = {{0, UTIME_NOW}, {1, 0}};
+    ASSERT_EQ(0, utimensat(AT_FDCWD, backing_file.c_str(), times, 0));
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ("xyzdefg", f.read());
+    }
+
+    const plaintext_cache::statistics stats = fs.plaintext_statistics();
+    EXPECT_EQ(2u, stats.hits);
+    EXPECT_EQ(1u, stats.invalidations);
+    EXPECT_EQ(1u, stats.entries);
+}
+
+TEST_P(IOTest, ExternalChange) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    fs.set_plaintext_cache(1 << 20, std::chrono::milliseconds(60000));
+    ASSERT_EQ(0, fs.watch_target());
+
+    {
+        scoped_file f(fs, "/test", O_CREAT | O_RDWR);
+        f.write("abcdefg");
+    }
+    {
+        scoped_file f(fs, "/other", O_CREAT | O_RDWR);
+        f.write("uvwxyz");
+    }
+
+    scoped_file f(fs, "/test", O_RDONLY);
+    EXPECT_EQ("abcdefg", f.read());
+
+    // Another process replaces the ciphertext.
+    const std::string test_path = (backing.path() / "test").string();
+    const std::string other_path = (backing.path() / "other").string();
+    ASSERT_EQ(0, ::rename(other_path.c_str(), test_path.c_str()));
+
+    std::string contents;
+    for (int i = 0; i < 5000; i++) {
+        contents = f.read();
+        if (contents != "abcdefg") {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ("uvwxyz", contents);
+    EXPECT_EQ(6u, f.file_size());
+}
+
+TEST_P(IOTest, ReadOnly) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string contents("abcdefg");
+    {
+        scoped_file f(fs, "/test", O_CREAT | O_RDWR);
+        f.write(contents);
+    }
+    {
+        scoped_file f(fs, "/other", O_CREAT | O_RDWR);
+        f.write("uvwxyz");
+    }
+
+    fs.set_read_only(true);
+
+    // Nothing can be changed.
+    struct fuse_file_info info;
+    info.flags = O_RDWR;
+    EXPECT_EQ(-EROFS, fs.open("/test", &info));
+    info.flags = O_CREAT | O_WRONLY;
+    EXPECT_EQ(-EROFS, fs.create("/new", 0600, &info));
+    EXPECT_EQ(-EROFS, fs.unlink("/test"));
+    EXPECT_EQ(-EROFS, fs.mkdir("/directory", 0700));
+    EXPECT_EQ(-EROFS, fs.rename("/test", "/renamed"));
+    EXPECT_EQ(-EROFS, truncate("/test", 0));
+    EXPECT_EQ(-EROFS, access("/test", W_OK));
+
+    struct statvfs vfs;
+    ASSERT_EQ(0, fs.statfs("/", &vfs));
+    EXPECT_TRUE(vfs.f_flag & ST_RDONLY);
+
+    // The file is decrypted once for every handle open on it.
+    const uint64_t admitted = fs.gpg_statistics().admitted;
+    scoped_file f(fs, "/test", O_RDONLY);
+    {
+        scoped_file g(fs, "/test", O_RDONLY);
+        EXPECT_EQ(contents, g.read());
+        EXPECT_EQ(contents.size(), g.file_size());
+    }
+    EXPECT_EQ(admitted + 1, fs.gpg_statistics().admitted);
+    EXPECT_EQ(-EROFS, f.truncate(0));
+    EXPECT_EQ(0, f.flush());
+
+    struct stat buf;
+    ASSERT_EQ(0, getattr("/test", &buf));
+    EXPECT_EQ(contents.size(), buf.st_size);
+    EXPECT_EQ(0, buf.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&f, &contents]() {
+            for (int j = 0; j < 100; j++) {
+                std::string data(contents.size(), '\0');
+                EXPECT_EQ(int(contents.size()), f.read(&data, 0,
+                    contents.size()));
+                EXPECT_EQ(contents, data);
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    // Handles opened after the ciphertext changes read the new version,
+    // while those already open keep reading the old.
+    const std::string test_path = (backing.path() / "test").string();
+    const std::string other_path = (backing.path() / "other").string();
+    ASSERT_EQ(0, ::rename(other_path.c_str(), test_path.c_str()));
+    {
+        scoped_file g(fs, "/test", O_RDONLY);
+        EXPECT_EQ("uvwxyz", g.read());
+    }
+    EXPECT_EQ(contents, f.read());
+    EXPECT_EQ(contents.size(), f.file_size());
+}
+
+TEST_P(IOTest, DropPlaintext) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    fs.set_plaintext_cache(1 << 20, std::chrono::milliseconds(60000));
+    {
+        scoped_file f(fs, "/test", O_CREAT | O_RDWR);
+        f.write("abcdefg");
+    }
+    EXPECT_EQ(1u, fs.plaintext_statistics().entries);
+
+    fs.drop_plaintext();
+    EXPECT_EQ(0u, fs.plaintext_statistics().entries);
+    EXPECT_EQ(0u, fs.plaintext_statistics().bytes);
+
+    scoped_file f(fs, "/test", O_RDONLY);
+    EXPECT_EQ("abcdefg", f.read());
+    EXPECT_EQ(0u, fs.plaintext_statistics().hits);
+}
+
+TEST_P(IOTest, Prefetch) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    fs.set_plaintext_cache(1 << 20, std::chrono::milliseconds(60000));
+    fs.set_prefetch(2, std::chrono::milliseconds(60000));
+
+    EXPECT_EQ(0, fs.mkdir("/directory", 0700));
+    for (const char *name : {"a", "b", "c", "d"}) {
+        scoped_file f(fs, std::string("/directory/") + name,
+            O_CREAT | O_RDWR);
+        f.write(name);
+    }
+    fs.drop_plaintext();
+
+    // Opening files one after another in a directory prefetches those after
+    // them, in name order.
+    for (const char *name : {"a", "b"}) {
+        scoped_file f(fs, std::string("/directory/") + name, O_RDONLY);
+        EXPECT_EQ(name, f.read());
+    }
+    for (int i = 0; i < 10000; i++) {
+        if (fs.plaintext_statistics().prefetched >= 2) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    {
+        scoped_file f(fs, "/directory/c", O_RDONLY);
+        EXPECT_EQ("c", f.read());
+    }
+
+    const plaintext_cache::statistics stats = fs.plaintext_statistics();
+    EXPECT_LE(2u, stats.prefetched);
+    EXPECT_LE(1u, stats.prefetch_hits);
+    EXPECT_EQ(1u, fs.prefetch_statistics().scans);
+}
+
+TEST_P(IOTest, WarmUp) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    temporary_directory state;
+    const std::string manifest = state.path().string() + "/manifest";
+    const std::chrono::milliseconds ttl(60000);
+    fs.set_plaintext_cache(1 << 20, ttl);
+    fs.set_warmup_manifest(manifest, 16);
+
+    for (const char *name : {"/hot", "/cold"}) {
+        scoped_file f(fs, name, O_CREAT | O_RDWR);
+        f.write(name);
+    }
+    for (int i = 0; i < 2; i++) {
+        scoped_file f(fs, "/hot", O_RDONLY);
+        EXPECT_EQ("/hot", f.read());
+    }
+
+    // Unmounting saves the manifest, encrypted.
+    fs.destroy(nullptr);
+    {
+        std::ifstream in(manifest);
+        const std::string contents((std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+        EXPECT_NE(std::string::npos, contents.find("BEGIN PGP MESSAGE"));
+        EXPECT_EQ(std::string::npos, contents.find("/hot"));
+    }
+
+    // The next mount decrypts the hottest file before it is opened.
+    asymmetricfs other;
+    other.set_target(backing.path().string() + "/");
+    other.set_read(true);
+    other.set_recipients({key.thumbprint()});
+    other.set_plaintext_cache(1 << 20, ttl);
+    other.set_warmup_manifest(manifest, 1);
+    other.init(nullptr);
+    ASSERT_EQ(0, other.warm_up(ttl));
+
+    for (int i = 0; i < 10000; i++) {
+        if (other.plaintext_statistics().prefetched >= 1) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    {
+        scoped_file f(other, "/hot", O_RDONLY);
+        EXPECT_EQ("/hot", f.read());
+    }
+
+    const plaintext_cache::statistics stats = other.plaintext_statistics();
+    EXPECT_EQ(1u, stats.prefetched);
+    EXPECT_EQ(1u, stats.prefetch_hits);
+}
+
+TEST_P(IOTest, RenameNestedDirectory) {
+    EXPECT_EQ(0, fs.mkdir("/a", 0700));
+    EXPECT_EQ(0, fs.mkdir("/a/b", 0700));
+    {
+        scoped_file f(fs, "/a/b/file", O_CREAT | O_WRONLY);
+    }
+
+    struct stat buf;
+    EXPECT_EQ(0, getattr("/a/b/file", &buf));
+
+    // Lookups beneath the old name must not reach the renamed directory.
+    EXPECT_EQ(0, fs.rename("/a", "/c"));
+    EXPECT_EQ(-ENOENT, getattr("/a/b/file", &buf));
+    EXPECT_EQ(0, getattr("/c/b/file", &buf));
+
+    // A directory recreated under the old name is empty.
+    EXPECT_EQ(0, fs.mkdir("/a", 0700));
+    EXPECT_EQ(0, fs.mkdir("/a/b", 0700));
+    EXPECT_EQ(-ENOENT, getattr("/a/b/file", &buf));
+
+    EXPECT_EQ(0, fs.unlink("/c/b/file"));
+    EXPECT_EQ(0, fs.rmdir("/c/b"));
+    EXPECT_EQ(0, fs.mkdir("/c/b", 0700));
+    EXPECT_EQ(-ENOENT, getattr("/c/b/file", &buf));
+}
+
+TEST_P(IOTest, Control) {
+    const std::string contents("abcdefg");
+    asymmetricfs_status status;
+    {
+        scoped_file f(fs, "/file", O_CREAT | O_RDWR);
+        f.write(contents);
+
+        ASSERT_EQ(0, f.ioctl(ASYMMETRICFS_QUERY, &status));
+        EXPECT_NE(0u, status.state & ASYMMETRICFS_STATE_DIRTY);
+        EXPECT_EQ(contents.size(), status.size);
+        EXPECT_EQ(0u, status.ciphertext);
+
+        // Flushing encrypts the changes while the file stays open.
+        EXPECT_EQ(0, f.ioctl(ASYMMETRICFS_FLUSH));
+        ASSERT_EQ(0, f.ioctl(ASYMMETRICFS_QUERY, &status));
+        EXPECT_EQ(0u, status.state & ASYMMETRICFS_STATE_DIRTY);
+        EXPECT_LT(0u, status.ciphertext);
+
+        EXPECT_EQ(-ENOTTY, f.ioctl(_IO(ASYMMETRICFS_IOCTL_MAGIC, 0)));
+    }
+
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    // Prefetching decrypts the file in the background.
+    scoped_file f(fs, "/file", O_RDONLY);
+    EXPECT_EQ(0, f.ioctl(ASYMMETRICFS_PREFETCH));
+    for (int i = 0; i < 10000; i++) {
+        ASSERT_EQ(0, f.ioctl(ASYMMETRICFS_QUERY, &status));
+        if (status.state & ASYMMETRICFS_STATE_LOADED) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_NE(0u, status.state & ASYMMETRICFS_STATE_LOADED);
+    EXPECT_EQ(contents.size(), status.buffered);
+
+    // Evicted plaintext is decrypted again when next read.
+    EXPECT_EQ(0, f.ioctl(ASYMMETRICFS_EVICT));
+    ASSERT_EQ(0, f.ioctl(ASYMMETRICFS_QUERY, &status));
+    EXPECT_EQ(0u, status.state & ASYMMETRICFS_STATE_LOADED);
+    EXPECT_EQ(0u, status.buffered);
+    EXPECT_EQ(contents, f.read());
+}
+
+TEST_P(IOTest, FingerprintRecipients) {
+    // Keys chosen by fingerprint are trusted without the trust database.
+    fs.set_recipients({gpg_recipient(key.fingerprint())});
+
+    const std::string contents("abcdefg");
+    {
+        scoped_file f(fs, "/file", O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+    EXPECT_LT(0u, file_size("/file"));
+
+    if (GetParam() == IOMode::ReadWrite) {
+        scoped_file f(fs, "/file", O_RDONLY);
+        EXPECT_EQ(contents, f.read());
+    }
+}
+
+TEST_P(IOTest, PrivateGpgHome) {
+    const std::string before("written from the user's home");
+    {
+        scoped_file f(fs, "/before", O_CREAT | O_WRONLY);
+        f.write(before);
+    }
+
+    temporary_directory parent;
+    gpg_home home;
+    ASSERT_EQ(0, home.create(parent.path().string(), "gpg",
+        {key.thumbprint()}));
+    fs.set_gpg_arguments(home.arguments());
+
+    const std::string after("written from the private home");
+    {
+        scoped_file f(fs, "/after", O_CREAT | O_WRONLY);
+        f.write(after);
+    }
+    EXPECT_LT(0u, file_size("/after"));
+
+    if (GetParam() == IOMode::ReadWrite) {
+        // Secret keys remain available through the user's agent.
+        scoped_file b(fs, "/before", O_RDONLY);
+        EXPECT_EQ(before, b.read());
+        scoped_file a(fs, "/after", O_RDONLY);
+        EXPECT_EQ(after, a.read());
+    }
+}
+
+TEST_P(IOTest, Destroy) {
+    fs.set_flush_jobs(2);
+
+    const size_t n_files = 5;
+    {
+        std::vector<std::unique_ptr<scoped_file>> files;
+        for (size_t i = 0; i < n_files; i++) {
+            const std::string filename("/" + std::to_string(i));
+            files.emplace_back(
+                new scoped_file(fs, filename, O_CREAT | O_WRONLY));
+            files.back()->write(filename);
+        }
+        scoped_file unmodified(fs, "/unmodified", O_CREAT | O_WRONLY);
+
+        // Unmount with the files still open.  Releasing them afterwards has
+        // no effect.
+        fs.destroy(nullptr);
+        EXPECT_EQ(0u, fs.failed_flushes());
+    }
+
+    for (size_t i = 0; i < n_files; i++) {
+        const std::string filename("/" + std::to_string(i));
+        EXPECT_NE(0u, file_size(filename));
+
+        if (GetParam() == IOMode::ReadWrite) {
+            scoped_file f(fs, filename, O_RDONLY);
+            EXPECT_EQ(filename, f.read());
+        }
+    }
+    EXPECT_EQ(0u, file_size("/unmodified"));
+}
+
+TEST_P(IOTest, DestroyFailure) {
+    // gpg exits before reading the plaintext.
+    sighandler_t previous = signal(SIGPIPE, SIG_IGN);
+
+    {
+        scoped_file f(fs, "/file", O_CREAT | O_WRONLY);
+        f.write("contents");
+
+        fs.set_gpg("/bin/false");
+        fs.destroy(nullptr);
+    }
+    EXPECT_EQ(1u, fs.failed_flushes());
+
+    signal(SIGPIPE, previous);
+}
+
+TEST_P(IOTest, Fsync) {
+    const std::string filename("/test");
+    const std::string backing_file = (backing.path() / filename).string();
+
+    // Decrypts the backing file with a second instance, as if after a crash.
+    auto saved = [&]() {
+        asymmetricfs other;
+        other.set_target(backing.path().string() + "/");
+        other.set_read(true);
+        other.set_recipients({key.thumbprint()});
+        other.init(nullptr);
+
+        scoped_file f(other, filename, O_RDONLY);
+        return f.read();
+    };
+
+    // Counts the blocks in the backing file.
+    auto blocks = [&]() {
+        std::ifstream in(backing_file);
+        std::string line;
+        size_t n = 0;
+        while (std::getline(in, line)) {
+            n += line == "-----END PGP MESSAGE-----";
+        }
+        return n;
+    };
+
+    {
+        scoped_file f(fs, filename, O_CREAT | O_RDWR);
+        f.write("abc");
+        EXPECT_EQ(0, f.fsync());
+        EXPECT_EQ("abc", saved());
+        EXPECT_EQ(1u, blocks());
+
+        // Only the bytes past those saved are encrypted.
+        f.write("def", 3);
+        EXPECT_EQ(0, f.fsync());
+        EXPECT_EQ("abcdef", saved());
+        EXPECT_EQ(2u, blocks());
+
+        // Modifying saved bytes rewrites the file.
+        f.write("X");
+        EXPECT_EQ(0, f.fsync());
+        EXPECT_EQ("Xbcdef", saved());
+        EXPECT_EQ(1u, blocks());
+
+        // A clean file is left as-is.
+        EXPECT_EQ(0, f.fsync());
+        EXPECT_EQ(1u, blocks());
+
+        f.write("ghi", 6);
+        EXPECT_EQ(0, f.flush());
+        EXPECT_EQ("Xbcdefghi", saved());
+        EXPECT_EQ(1u, blocks());
+
+        EXPECT_EQ("Xbcdefghi", f.read());
+    }
+
+    EXPECT_EQ("Xbcdefghi", saved());
+}
+
+TEST_P(IOTest, FsyncInvalidDescriptor) {
+    struct fuse_file_info info;
+    info.fh = invalid_file_handle;
+
+    EXPECT_EQ(-EBADF, fs.fsync(nullptr, 0, &info));
+    EXPECT_EQ(-EBADF, fs.flush(nullptr, &info));
+}
+
+TEST_P(IOTest, Overwrite) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string filename("/test");
+    {
+        scoped_file f(fs, filename, O_CREAT | O_RDWR);
+        f.write("abcdef");
+    }
+
+    // Overwrite the start of the file after reading it.
+    {
+        scoped_file f(fs, filename, O_RDWR);
+        EXPECT_EQ("abcdef", f.read());
+        f.write("XY");
+    }
+
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ("XYcdef", f.read());
+    }
+
+    // Overwrite it without reading it first.
+    {
+        scoped_file f(fs, filename, O_WRONLY);
+        f.write("Z");
+    }
+
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ("ZYcdef", f.read());
+    }
+}
+
+TEST_P(IOTest, ReplaceBackingFile) {
+    // Only files whose plaintext is known are rewritten.
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string filename("/test");
+    const std::string backing_file = (backing.path() / filename).string();
+    {
+        scoped_file f(fs, filename, O_CREAT | O_RDWR);
+        f.write("abcdef");
+    }
+    ASSERT_EQ(0, fs.chmod(filename.c_str(), 0640));
+
+    // Read the old ciphertext while the file is rewritten.
+    int old_fd = ::open(backing_file.c_str(), O_RDONLY | O_CLOEXEC);
+    ASSERT_LE(0, old_fd);
+    struct stat old_stat;
+    ASSERT_EQ(0, ::fstat(old_fd, &old_stat));
+    std::string old_ciphertext(size_t(old_stat.st_size), '\0');
+    ASSERT_EQ(old_stat.st_size,
+        ::pread(old_fd, &old_ciphertext[0], old_ciphertext.size(), 0));
+
+    {
+        scoped_file f(fs, filename, O_RDWR);
+        f.write("uvwxyz0123456789");
+    }
+
+    // The old ciphertext is intact, and the new one is a different file.
+    struct stat buf;
+    ASSERT_EQ(0, ::fstat(old_fd, &buf));
+    EXPECT_EQ(old_stat.st_size, buf.st_size);
+    std::string after(old_ciphertext.size(), '\0');
+    ASSERT_EQ(buf.st_size, ::pread(old_fd, &after[0], after.size(), 0));
+    EXPECT_EQ(old_ciphertext, after);
+    ::close(old_fd);
+
+    ASSERT_EQ(0, ::stat(backing_file.c_str(), &buf));
+    EXPECT_NE(old_stat.st_ino, buf.st_ino);
+    EXPECT_EQ(0640u, buf.st_mode & 07777);
+
+    {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ("uvwxyz0123456789", f.read());
+    }
+
+    // No temporary files are left behind.
+    EXPECT_EQ((std::set<std::string>{".", "..", "test"}),
+        list_directory(backing.path().string()));
+}
+
+TEST_P(IOTest, TemporaryFiles) {
+    // A process that has exited, whose temporary files are leftovers.
+    pid_t child = fork();
+    ASSERT_LE(0, child);
+    if (child == 0) {
+        _exit(0);
+    }
+    ASSERT_EQ(child, waitpid(child, nullptr, 0));
+
+    const std::string leftover = ".asymmetricfs." + std::to_string(child) +
+        ".0";
+    const std::string ours = ".asymmetricfs." + std::to_string(getpid()) +
+        ".1000";
+    const boost::filesystem::path subdirectory = backing.path() / "sub";
+    ASSERT_EQ(0, ::mkdir(subdirectory.string().c_str(), 0700));
+    for (const auto& path : {backing.path() / leftover,
+            subdirectory / leftover, backing.path() / ours}) {
+        std::ofstream(path.string()) << "partial";
+    }
+
+    // Temporary files are never listed.
+    stat_map entries;
+    EXPECT_EQ(0, readdir("/", &entries));
+    EXPECT_EQ(0u, entries.count(leftover));
+    EXPECT_EQ(0u, entries.count(ours));
+    EXPECT_EQ(1u, entries.count("sub"));
+
+    // Mounting removes only those whose process is gone.
+    asymmetricfs other;
+    other.set_target(backing.path().string() + "/");
+    other.set_recipients({key.thumbprint()});
+    other.init(nullptr);
+
+    EXPECT_EQ((std::set<std::string>{".", "..", "sub", ours}),
+        list_directory(backing.path().string()));
+    EXPECT_EQ((std::set<std::string>{".", ".."}),
+        list_directory(subdirectory.string()));
+}
+
+TEST_P(IOTest, SyncAfterDirectoryRename) {
+    // Only files whose plaintext is known are rewritten.
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    ASSERT_EQ(0, fs.mkdir("/a", 0700));
+    {
+        scoped_file f(fs, "/a/test", O_CREAT | O_RDWR);
+        f.write("abcdef");
+        ASSERT_EQ(0, f.flush());
+
+        // The directory the file was replaced in is synced, wherever it is.
+        ASSERT_EQ(0, fs.rename("/a", "/b"));
+        EXPECT_EQ(0, f.fsync());
+    }
+
+    scoped_file f(fs, "/b/test", O_RDONLY);
+    EXPECT_EQ("abcdef", f.read());
+}
+
+TEST_P(IOTest, RawViewDisabled) {
+    struct stat buf;
+    EXPECT_EQ(-ENOENT, getattr(asymmetricfs::raw_view_prefix, &buf));
+}
+
+TEST_P(IOTest, RawView) {
+    fs.set_raw_view(true);
+
+    const std::string filename("/test");
+    const std::string raw_filename(
+        std::string(asymmetricfs::raw_view_prefix) + filename);
+    const std::string contents("abcdefg");
+    {
+        scoped_file f(fs, filename, O_CREAT | O_WRONLY);
+        f.write(contents);
+    }
+
+    // The raw view reports the size of the ciphertext, without write access.
+    struct stat backing_buf;
+    const std::string backing_file = (backing.path() / filename).string();
+    ASSERT_EQ(0, stat(backing_file.c_str(), &backing_buf));
+
+    struct stat buf;
+    ASSERT_EQ(0, getattr(raw_filename, &buf));
+    EXPECT_EQ(backing_buf.st_size, buf.st_size);
+    EXPECT_EQ(0, buf.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+
+    ASSERT_EQ(0, getattr(asymmetricfs::raw_view_prefix, &buf));
+    EXPECT_TRUE(S_ISDIR(buf.st_mode));
+
+    {
+        stat_map buffer;
+        ASSERT_EQ(0, readdir(asymmetricfs::raw_view_prefix, &buffer));
+        EXPECT_EQ(1u, buffer.count("test"));
+    }
+
+    // The ciphertext can be read in both modes.
+    {
+        scoped_file f(fs, raw_filename, O_RDONLY);
+
+        const std::string header("-----BEGIN PGP MESSAGE-----");
+        std::string data = f.read();
+        ASSERT_EQ(size_t(backing_buf.st_size), data.size());
+        EXPECT_EQ(header, data.substr(0, header.size()));
+
+        struct fuse_bufvec *bufv = nullptr;
+        ASSERT_EQ(0, fs.read_buf(nullptr, &bufv, 16, 0, &f.info));
+        ASSERT_NE(nullptr, bufv);
+        EXPECT_TRUE(bufv->buf[0].flags & FUSE_BUF_IS_FD);
+        EXPECT_LE(0, bufv->buf[0].fd);
+        free(bufv);
+    }
+
+    // Modifications are rejected.
+    {
+        struct fuse_file_info info;
+        info.flags = O_RDWR;
+        EXPECT_EQ(-EROFS, fs.open(raw_filename.c_str(), &info));
+
+        info.flags = O_WRONLY | O_CREAT;
+        EXPECT_EQ(-EROFS, fs.create(raw_filename.c_str(), 0600, &info));
+    }
+
+    EXPECT_EQ(-EROFS, access(raw_filename, W_OK));
+    EXPECT_EQ(0, access(raw_filename, R_OK));
+    EXPECT_EQ(-EROFS, fs.unlink(raw_filename.c_str()));
+    EXPECT_EQ(-EROFS, fs.rename(filename.c_str(), raw_filename.c_str()));
+    EXPECT_EQ(-EROFS, truncate(raw_filename, 0));
+
+    // The plaintext view is unaffected.
+    if (GetParam() == IOMode::ReadWrite) {
+        scoped_file f(fs, filename, O_RDONLY);
+        EXPECT_EQ(contents, f.read());
+    }
+}
+
+TEST_P(IOTest, ReadBuf) {
+    if (GetParam() != IOMode::ReadWrite) {
+        return;
+    }
+
+    const std::string contents("abcdefg");
+    scoped_file f(fs, "/test", O_CREAT | O_RDWR);
+    f.write(contents);
+
+    struct fuse_bufvec *bufv = nullptr;
+    ASSERT_EQ(0, fs.read_buf(nullptr, &bufv, 1 << 12, 0, &f.info));
+    ASSERT_NE(nullptr, bufv);
+    EXPECT_FALSE(bufv->buf[0].flags & FUSE_BUF_IS_FD);
+    ASSERT_EQ(contents.size(), bufv->buf[0].size);
+    EXPECT_EQ(contents, std::string(
+        static_cast<const char *>(bufv->buf[0].mem), bufv->buf[0].size));
+
+    free(bufv->buf[0].mem);
+    free(bufv);
+}
+
 INSTANTIATE_TEST_CASE_P(IOTests, IOTest,
                         ::testing::Values(IOMode::ReadWrite,
                                           IOMode::WriteOnly));
@@ -1317,6 +2445,7 @@ TEST_F(ImplementationTest, StatFS) {
     fs.set_target(target.path().string());
 
     struct fuse_conn_info conn;
+    memset(&conn, 0, sizeof(conn));
     fs.init(&conn);
 
     struct statvfs buf;
@@ -1326,6 +2455,34 @@ TEST_F(ImplementationTest, StatFS) {
     EXPECT_LE(0, buf.f_bfree);
 }
 
+TEST_F(ImplementationTest, InitNegotiation) {
+    struct fuse_conn_info conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.max_write = 1 << 20;
+    conn.max_readahead = 1 << 16;
+    conn.capable = FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES |
+        FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+    conn.want = FUSE_CAP_SPLICE_MOVE;
+
+    asymmetricfs::connection_options c;
+    c.max_write = 1 << 16;
+    c.max_readahead = 1 << 20;
+    c.async_read = false;
+    fs.set_connection_options(c);
+    fs.init(&conn);
+
+    EXPECT_EQ(1u << 16, conn.max_write);
+    // The kernel's readahead cannot be raised.
+    EXPECT_EQ(1u << 16, conn.max_readahead);
+    EXPECT_EQ(0u, conn.async_read);
+    EXPECT_EQ(0u, conn.want & FUSE_CAP_ASYNC_READ);
+    EXPECT_NE(0u, conn.want & FUSE_CAP_BIG_WRITES);
+    EXPECT_NE(0u, conn.want & FUSE_CAP_SPLICE_WRITE);
+    // Capabilities the kernel does not offer are not requested.
+    EXPECT_EQ(0u, conn.want & FUSE_CAP_SPLICE_READ);
+    EXPECT_EQ(0u, conn.want & FUSE_CAP_SPLICE_MOVE);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
@@ -0,0 +1,53 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cerrno>
+#include <gtest/gtest.h>
+#include "memory_pressure.h"
+#include <unistd.h>
+
+TEST(MemoryPressure, InvalidThreshold) {
+    memory_pressure pressure([]() {});
+
+    const std::chrono::seconds window(2);
+    EXPECT_EQ(EINVAL, pressure.start(std::chrono::microseconds(0), window));
+    EXPECT_EQ(EINVAL, pressure.start(std::chrono::seconds(3), window));
+}
+
+TEST(MemoryPressure, StartStop) {
+    if (access("/proc/pressure/memory", R_OK) != 0) {
+        // The kernel does not report pressure stall information.
+        return;
+    }
+
+    memory_pressure pressure([]() {});
+    const std::chrono::milliseconds stall(150);
+    const std::chrono::seconds window(2);
+    ASSERT_EQ(0, pressure.start(stall, window));
+
+    // Restarting replaces the trigger.
+    EXPECT_EQ(0, pressure.start(stall, window));
+    pressure.stop();
+    pressure.stop();
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -288,6 +288,32 @@ TEST_F(PageBufferTest, Clear) {
     EXPECT_EQ(0u, buffer.size());
 }
 
+TEST_F(PageBufferTest, Wipe) {
+    std::string data = make_data(4096);
+
+    buffer.write(data.size(), 4096, &data[0]);
+    EXPECT_LE(data.size(), buffer.allocated());
+
+    buffer.wipe();
+    EXPECT_EQ(0u, buffer.size());
+    EXPECT_EQ(0u, buffer.allocated());
+}
+
+TEST_F(PageBufferTest, Swap) {
+    std::string data = make_data(4096);
+    buffer.write(data.size(), 0, &data[0]);
+
+    page_buffer other(memory_lock::none);
+    other.swap(buffer);
+    EXPECT_EQ(0u, buffer.size());
+    EXPECT_EQ(0u, buffer.allocated());
+    EXPECT_EQ(data.size(), other.size());
+
+    std::string tmp(data.size(), '\0');
+    EXPECT_EQ(data.size(), other.read(tmp.size(), 0, &tmp[0]));
+    EXPECT_EQ(data, tmp);
+}
+
 TEST_F(PageBufferTest, LargeGap) {
     Pipe loop;
 
@@ -0,0 +1,71 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include "placement.h"
+#include <string>
+#include <unistd.h>
+
+TEST(Placement, ParseCPUList) {
+    cpu_set_t cpus;
+
+    EXPECT_EQ(0, parse_cpu_list("0", &cpus));
+    EXPECT_EQ(1, CPU_COUNT(&cpus));
+    EXPECT_TRUE(CPU_ISSET(0, &cpus));
+
+    EXPECT_EQ(0, parse_cpu_list("0-3,6", &cpus));
+    EXPECT_EQ(5, CPU_COUNT(&cpus));
+    EXPECT_TRUE(CPU_ISSET(3, &cpus));
+    EXPECT_FALSE(CPU_ISSET(4, &cpus));
+    EXPECT_TRUE(CPU_ISSET(6, &cpus));
+}
+
+TEST(Placement, ParseInvalidCPUList) {
+    cpu_set_t cpus;
+
+    EXPECT_EQ(EINVAL, parse_cpu_list("", &cpus));
+    EXPECT_EQ(EINVAL, parse_cpu_list("a", &cpus));
+    EXPECT_EQ(EINVAL, parse_cpu_list("1,", &cpus));
+    EXPECT_EQ(EINVAL, parse_cpu_list("3-1", &cpus));
+    EXPECT_EQ(EINVAL, parse_cpu_list("1 2", &cpus));
+    EXPECT_EQ(EINVAL, parse_cpu_list(std::to_string(CPU_SETSIZE), &cpus));
+}
+
+TEST(Placement, NotACgroup) {
+    char path[] = "/tmp/asymmetricfs.placement.XXXXXX";
+    ASSERT_TRUE(mkdtemp(path) != nullptr);
+
+    cgroup c;
+    EXPECT_EQ(ENOENT, c.open(path));
+    EXPECT_EQ(-1, c.procs());
+    EXPECT_EQ(EBADF, c.set_cpu_max("max 100000"));
+
+    EXPECT_EQ(0, rmdir(path));
+}
+
+TEST(Placement, InvalidWeight) {
+    cgroup c;
+    EXPECT_EQ(EINVAL, c.set_cpu_weight(0));
+    EXPECT_EQ(EINVAL, c.set_cpu_weight(10001));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
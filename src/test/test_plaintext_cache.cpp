@@ -0,0 +1,209 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <gtest/gtest.h>
+#include "page_buffer.h"
+#include "plaintext_cache.h"
+#include <string>
+#include <thread>
+
+static const std::chrono::milliseconds long_ttl(60000);
+
+static struct stat make_stat(ino_t ino, off_t size) {
+    struct stat s;
+    memset(&s, 0, sizeof(s));
+    s.st_ino = ino;
+    s.st_size = size;
+    s.st_mtim.tv_sec = 1;
+    return s;
+}
+
+static void fill(page_buffer* buffer, const std::string& data) {
+    buffer->clear();
+    buffer->write(data.size(), 0, data.data());
+}
+
+static std::string contents(const page_buffer& buffer) {
+    std::string ret(buffer.size(), '\0');
+    buffer.read(ret.size(), 0, &ret[0]);
+    return ret;
+}
+
+TEST(PlaintextCache, Hit) {
+    plaintext_cache cache(1 << 20, long_ttl);
+    page_buffer buffer(memory_lock::none);
+    fill(&buffer, "abcdefg");
+
+    const struct stat s = make_stat(1, 100);
+    cache.insert(s, buffer);
+    EXPECT_EQ(0u, buffer.size());
+
+    EXPECT_TRUE(cache.take(s, buffer));
+    EXPECT_EQ("abcdefg", contents(buffer));
+
+    // Entries are handed back, not shared.
+    page_buffer other(memory_lock::none);
+    EXPECT_FALSE(cache.take(s, other));
+
+    const plaintext_cache::statistics stats = cache.stats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(1u, stats.misses);
+    EXPECT_EQ(1u, stats.insertions);
+    EXPECT_EQ(0u, stats.entries);
+    EXPECT_EQ(0u, stats.bytes);
+}
+
+TEST(PlaintextCache, Disabled) {
+    plaintext_cache cache(0, long_ttl);
+    page_buffer buffer(memory_lock::none);
+    fill(&buffer, "abcdefg");
+
+    const struct stat s = make_stat(1, 100);
+    cache.insert(s, buffer);
+    EXPECT_FALSE(cache.take(s, buffer));
+    EXPECT_EQ(0u, cache.stats().insertions);
+}
+
+TEST(PlaintextCache, Changed) {
+    plaintext_cache cache(1 << 20, long_ttl);
+    page_buffer buffer(memory_lock::none);
+
+    fill(&buffer, "abcdefg");
+    cache.insert(make_stat(1, 100), buffer);
+    EXPECT_FALSE(cache.take(make_stat(1, 101), buffer));
+
+    fill(&buffer, "abcdefg");
+    cache.insert(make_stat(1, 100), buffer);
+    struct stat s = make_stat(1, 100);
+    s.st_mtim.tv_nsec = 1;
+    EXPECT_FALSE(cache.take(s, buffer));
+
+    fill(&buffer, "abcdefg");
+    cache.insert(make_stat(1, 100), buffer);
+    s = make_stat(1, 100);
+    s.st_ctim.tv_sec = 1;
+    EXPECT_FALSE(cache.take(s, buffer));
+
+    const plaintext_cache::statistics stats = cache.stats();
+    EXPECT_EQ(3u, stats.invalidations);
+    EXPECT_EQ(0u, stats.entries);
+}
+
+TEST(PlaintextCache, Revalidate) {
+    plaintext_cache cache(1 << 20, long_ttl);
+    page_buffer buffer(memory_lock::none);
+
+    for (ino_t i = 1; i <= 2; i++) {
+        fill(&buffer, "abcdefg");
+        cache.insert(make_stat(i, 100), buffer);
+    }
+
+    cache.revalidate(make_stat(1, 100));
+    cache.revalidate(make_stat(2, 101));
+    EXPECT_EQ(1u, cache.stats().entries);
+    EXPECT_EQ(1u, cache.stats().invalidations);
+
+    cache.clear();
+    EXPECT_EQ(0u, cache.stats().entries);
+    EXPECT_EQ(0u, cache.stats().bytes);
+    EXPECT_FALSE(cache.take(make_stat(1, 100), buffer));
+}
+
+TEST(PlaintextCache, Capacity) {
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    plaintext_cache cache(2 * page, long_ttl);
+    page_buffer buffer(memory_lock::none);
+
+    for (ino_t i = 1; i <= 3; i++) {
+        fill(&buffer, std::to_string(i));
+        cache.insert(make_stat(i, 100), buffer);
+    }
+
+    // The least recently added entry was evicted.
+    plaintext_cache::statistics stats = cache.stats();
+    EXPECT_EQ(1u, stats.evictions);
+    EXPECT_EQ(2u, stats.entries);
+    EXPECT_EQ(2 * page, stats.bytes);
+
+    EXPECT_FALSE(cache.take(make_stat(1, 100), buffer));
+    EXPECT_TRUE(cache.take(make_stat(2, 100), buffer));
+    EXPECT_EQ("2", contents(buffer));
+
+    // Lowering the capacity evicts the rest.
+    cache.set_limits(0, long_ttl);
+    stats = cache.stats();
+    EXPECT_EQ(2u, stats.evictions);
+    EXPECT_EQ(0u, stats.entries);
+}
+
+TEST(PlaintextCache, Expiry) {
+    plaintext_cache cache(1 << 20, std::chrono::milliseconds(10));
+    page_buffer buffer(memory_lock::none);
+    fill(&buffer, "abcdefg");
+    cache.insert(make_stat(1, 100), buffer);
+
+    // Entries are dropped once they expire, even if never looked up.
+    while (cache.stats().entries > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(1u, cache.stats().expirations);
+    EXPECT_EQ(0u, cache.stats().bytes);
+}
+
+TEST(PlaintextCache, Prefetched) {
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    plaintext_cache cache(2 * page, long_ttl);
+    page_buffer buffer(memory_lock::none);
+
+    fill(&buffer, "1");
+    cache.insert(make_stat(1, 100), buffer);
+    fill(&buffer, "2");
+    cache.insert_prefetched(make_stat(2, 100), buffer, long_ttl);
+    EXPECT_TRUE(cache.contains(make_stat(2, 100)));
+    EXPECT_FALSE(cache.contains(make_stat(2, 101)));
+
+    // Prefetched entries displace nothing.
+    fill(&buffer, "3");
+    cache.insert_prefetched(make_stat(3, 100), buffer, long_ttl);
+    EXPECT_FALSE(cache.contains(make_stat(3, 100)));
+    EXPECT_TRUE(cache.contains(make_stat(1, 100)));
+
+    EXPECT_TRUE(cache.take(make_stat(2, 100), buffer));
+    EXPECT_EQ("2", contents(buffer));
+
+    // Those never taken are wasted once they expire.
+    fill(&buffer, "4");
+    cache.insert_prefetched(make_stat(4, 100), buffer,
+        std::chrono::milliseconds(10));
+    while (cache.contains(make_stat(4, 100))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    const plaintext_cache::statistics stats = cache.stats();
+    EXPECT_EQ(3u, stats.prefetched);
+    EXPECT_EQ(1u, stats.prefetch_hits);
+    EXPECT_EQ(2u, stats.prefetch_wasted);
+    EXPECT_EQ(1u, stats.entries);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
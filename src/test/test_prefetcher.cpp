@@ -0,0 +1,123 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <gtest/gtest.h>
+#include <mutex>
+#include "prefetcher.h"
+#include <set>
+#include <string>
+#include <vector>
+
+class PrefetcherTest : public ::testing::Test {
+protected:
+    PrefetcherTest() : lists(0), prefetch(
+        [this](const std::string& path, uid_t user) {
+            std::unique_lock<std::mutex> l(mx);
+            fetched.insert(path);
+            EXPECT_EQ(1000u, user);
+            cv.notify_all();
+        }, [this](const std::string& dir) {
+            std::unique_lock<std::mutex> l(mx);
+            EXPECT_EQ("/d", dir);
+            lists++;
+            return std::vector<std::string>{"e", "d", "c", "b", "a"};
+        }) {
+        prefetch.set_limits(2, 1);
+    }
+
+    // Waits for the files fetched to be expected.
+    bool wait_for(const std::set<std::string>& expected) {
+        std::unique_lock<std::mutex> l(mx);
+        return cv.wait_for(l, std::chrono::seconds(10), [&]() {
+            return fetched == expected;
+        });
+    }
+
+    std::mutex mx;
+    std::condition_variable cv;
+    std::set<std::string> fetched;
+    unsigned lists;
+
+    prefetcher prefetch;
+};
+
+TEST_F(PrefetcherTest, Listed) {
+    prefetch.listed("/d", {"x", "y"}, true);
+    prefetch.listed("/d", {"z"}, false);
+    prefetch.listed("/", {"top"}, true);
+
+    // A file opened in a listed directory starts a scan.
+    prefetch.opened("/d/x", 1000);
+    EXPECT_TRUE(wait_for({"/d/y", "/d/z"}));
+
+    prefetch.opened("/top", 1000);
+    prefetch.opened("/d/y", 1000);
+    prefetch.opened("/d/z", 1000);
+    EXPECT_EQ(0u, lists);
+
+    const prefetcher::statistics stats = prefetch.stats();
+    EXPECT_EQ(2u, stats.scans);
+    EXPECT_EQ(2u, stats.queued);
+}
+
+TEST_F(PrefetcherTest, Opened) {
+    // A single open is not a scan.
+    prefetch.opened("/d/a", 1000);
+    prefetch.opened("/d/a", 1000);
+    EXPECT_EQ(0u, prefetch.stats().scans);
+
+    // Two in a row are, so the directory is listed, in name order.
+    prefetch.opened("/d/b", 1000);
+    EXPECT_TRUE(wait_for({"/d/c", "/d/d"}));
+
+    prefetch.opened("/d/c", 1000);
+    EXPECT_TRUE(wait_for({"/d/c", "/d/d", "/d/e"}));
+    EXPECT_EQ(1u, lists);
+    EXPECT_EQ(1u, prefetch.stats().scans);
+}
+
+TEST_F(PrefetcherTest, Disabled) {
+    prefetch.set_limits(0, 1);
+    prefetch.listed("/d", {"a", "b"}, true);
+    prefetch.opened("/d/a", 1000);
+    prefetch.opened("/d/b", 1000);
+    prefetch.stop();
+
+    EXPECT_EQ(0u, lists);
+    EXPECT_TRUE(fetched.empty());
+    EXPECT_EQ(0u, prefetch.stats().queued);
+}
+
+TEST_F(PrefetcherTest, Requested) {
+    // Requests are run even when scans are not followed.
+    prefetch.set_limits(0, 1);
+    prefetch.requested([this]() {
+        std::unique_lock<std::mutex> l(mx);
+        fetched.insert("/requested");
+        cv.notify_all();
+    });
+    EXPECT_TRUE(wait_for({"/requested"}));
+    EXPECT_EQ(0u, prefetch.stats().fetched);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
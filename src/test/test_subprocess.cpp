@@ -16,8 +16,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <gtest/gtest.h>
+#include <signal.h>
+#include <string>
 #include "subprocess.h"
+#include <sys/resource.h>
 
 TEST(Subprocess, ExitCodeSuccess) {
     subprocess s(-1, -1, "/bin/true", {});
@@ -51,3 +55,69 @@ TEST(Subprocess, Communicate) {
     ret = s.wait();
     EXPECT_EQ(0, ret);
 }
+
+TEST(Subprocess, CommunicatePartialRead) {
+    subprocess s(-1, -1, "/bin/cat", {"cat", "-"});
+
+    // cat blocks writing its output long before it reads all of this.
+    const std::string write_buffer(1 << 20, 'a');
+    size_t write_size = write_buffer.size();
+
+    char read_buffer[16];
+    size_t read_size = sizeof(read_buffer);
+
+    int ret = s.communicate(read_buffer, &read_size, write_buffer.data(),
+        &write_size);
+    EXPECT_EQ(0, ret);
+    EXPECT_EQ(0, read_size);
+    EXPECT_LT(0, write_size);
+    EXPECT_EQ(0, memcmp(write_buffer.data(), read_buffer,
+        sizeof(read_buffer)));
+
+    s.kill(SIGKILL);
+    ret = s.wait();
+    EXPECT_EQ(-1, ret);
+}
+
+TEST(Subprocess, Scheduling) {
+    subprocess::scheduling sched;
+    sched.nice = 5;
+    sched.io_level = 7;
+
+    subprocess s(-1, -1, "/bin/sh", {"sh", "-c", "nice"}, sched);
+
+    char read_buffer[256];
+    size_t read_size = sizeof(read_buffer);
+    size_t write_size = 0;
+    int ret = s.communicate(read_buffer, &read_size, nullptr, &write_size);
+    EXPECT_EQ(0, ret);
+
+    const int expected = std::min(19, getpriority(PRIO_PROCESS, 0) + 5);
+    EXPECT_EQ(std::to_string(expected) + "\n",
+        std::string(read_buffer, sizeof(read_buffer) - read_size));
+
+    ret = s.wait();
+    EXPECT_EQ(0, ret);
+}
+
+TEST(Subprocess, Affinity) {
+    subprocess::scheduling sched;
+    sched.pin = true;
+    CPU_ZERO(&sched.cpus);
+    CPU_SET(0, &sched.cpus);
+
+    subprocess s(-1, -1, "/bin/sh",
+        {"sh", "-c", "grep Cpus_allowed_list /proc/self/status"}, sched);
+
+    char read_buffer[256];
+    size_t read_size = sizeof(read_buffer);
+    size_t write_size = 0;
+    int ret = s.communicate(read_buffer, &read_size, nullptr, &write_size);
+    EXPECT_EQ(0, ret);
+
+    const std::string status(read_buffer, sizeof(read_buffer) - read_size);
+    EXPECT_EQ("Cpus_allowed_list:\t0\n", status);
+
+    ret = s.wait();
+    EXPECT_EQ(0, ret);
+}
@@ -0,0 +1,126 @@
+/**
+ * asymmetricfs - An asymmetric encryption-aware filesystem
+ * (c) 2014 Chris Kennelly <chris@ckennelly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include "target_watcher.h"
+#include "test/temporary_directory.h"
+#include <unistd.h>
+
+class TargetWatcherTest : public ::testing::Test {
+protected:
+    TargetWatcherTest() : overflows(0), watcher(
+        [this](const std::string& path, bool directory) {
+            std::unique_lock<std::mutex> l(mx);
+            changes.insert(std::make_pair(path, directory));
+            cv.notify_all();
+        }, [this]() {
+            std::unique_lock<std::mutex> l(mx);
+            overflows++;
+        }) {}
+
+    void SetUp() {
+        root = ::open(dir.path().c_str(), O_CLOEXEC | O_DIRECTORY);
+        ASSERT_LE(0, root);
+    }
+
+    void TearDown() {
+        watcher.stop();
+        ::close(root);
+    }
+
+    void write_file(const std::string& path) {
+        int fd = ::openat(root, path.c_str(),
+            O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        ASSERT_LE(0, fd);
+        ASSERT_EQ(3, ::write(fd, "abc", 3));
+        ::close(fd);
+    }
+
+    // Waits for a change to path to be reported.
+    bool changed(const std::string& path, bool directory = false) {
+        const auto change = std::make_pair(path, directory);
+        std::unique_lock<std::mutex> l(mx);
+        return cv.wait_for(l, std::chrono::seconds(5), [&]() {
+            return changes.count(change) > 0;
+        });
+    }
+
+    temporary_directory dir;
+    int root;
+
+    std::mutex mx;
+    std::condition_variable cv;
+    std::set<std::pair<std::string, bool>> changes;
+    unsigned overflows;
+
+    target_watcher watcher;
+};
+
+TEST_F(TargetWatcherTest, Write) {
+    ASSERT_EQ(0, watcher.start(root));
+
+    write_file("foo");
+    EXPECT_TRUE(changed("foo"));
+
+    ASSERT_EQ(0, ::renameat(root, "foo", root, "bar"));
+    EXPECT_TRUE(changed("bar"));
+
+    ASSERT_EQ(0, ::unlinkat(root, "bar", 0));
+    EXPECT_EQ(0u, overflows);
+}
+
+TEST_F(TargetWatcherTest, Subdirectories) {
+    ASSERT_EQ(0, ::mkdirat(root, "a", 0700));
+    ASSERT_EQ(0, watcher.start(root));
+
+    // Existing directories are watched.
+    write_file("a/foo");
+    EXPECT_TRUE(changed("a/foo"));
+
+    // As are those created or moved in later.
+    ASSERT_EQ(0, ::mkdirat(root, "b", 0700));
+    EXPECT_TRUE(changed("b", true));
+    write_file("b/foo");
+    EXPECT_TRUE(changed("b/foo"));
+
+    ASSERT_EQ(0, ::renameat(root, "b", root, "a/c"));
+    EXPECT_TRUE(changed("a/c", true));
+    write_file("a/c/bar");
+    EXPECT_TRUE(changed("a/c/bar"));
+
+    ASSERT_EQ(0, ::unlinkat(root, "a/c/foo", 0));
+    ASSERT_EQ(0, ::unlinkat(root, "a/c/bar", 0));
+    ASSERT_EQ(0, ::unlinkat(root, "a/c", AT_REMOVEDIR));
+    ASSERT_EQ(0, ::unlinkat(root, "a/foo", 0));
+}
+
+TEST_F(TargetWatcherTest, InvalidDescriptor) {
+    EXPECT_EQ(EBADF, watcher.start(-1));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}